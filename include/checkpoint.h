@@ -0,0 +1,99 @@
+/*
+ * Binary checkpoint container for memory images
+ *
+ * Copyright (C) 2018,2019, Esperanto Technologies Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * File layout, all fields little endian:
+ *
+ *   CheckpointHeader
+ *   page payloads, each one CKPT_PAGE_SIZE bytes or less once compressed,
+ *   raw ones start on a CKPT_PAGE_SIZE boundary
+ *   CheckpointPage[n_pages] at index_offset, sorted by page number
+ *
+ * Pages that are all zeros are not stored.  The index goes last so that
+ * the payloads can be streamed out as they get compressed.
+ *
+ * A delta (CKPT_DELTA) only holds the pages written since its parent
+ * was saved, including the ones that became zero.  A chain manifest,
+ * a text file with one image per line, lists the images to load in
+ * order: a full one first, then the deltas on top of it.  The images of
+ * a chain are named relative to the directory of the manifest.
+ */
+#define CKPT_MAGIC     "DROMAJO\x1a"
+#define CKPT_VERSION   2
+#define CKPT_PAGE_SIZE 4096
+
+typedef struct CheckpointHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t page_size;
+    uint64_t mem_size;
+    uint64_t n_pages;  // number of stored pages
+    uint64_t index_offset;
+    uint32_t flags;  // since version 2
+    uint32_t reserved;
+} CheckpointHeader;
+
+#define CKPT_DELTA 1  // header flag: the pages not stored are the ones of the parent
+
+#define CKPT_PAGE_LZ   1  // payload is compressed, otherwise it is raw
+#define CKPT_PAGE_ZERO 2  // no payload, the page is all zeros (deltas only)
+
+typedef struct CheckpointPage {
+    uint64_t page;  // page number from the start of the memory
+    uint64_t offset;
+    uint32_t size;  // payload size in the file
+    uint32_t flags;
+} CheckpointPage;
+
+/* With a dirty bitmap, one bit per CKPT_PAGE_SIZE page, only the pages
+ * flagged are saved, as a delta.  Without compression, every stored
+ * page is kept page aligned in the file.  When base is aligned on host
+ * pages, and was obtained with mmap() like the RAM is, loading then
+ * maps those pages copy-on-write instead of reading them, so that only
+ * the pages touched get faulted in, and only the ones written get
+ * copied. */
+void checkpoint_save_memory(const void *base, size_t size, const char *file, const uint32_t *dirty, bool compress);
+void checkpoint_load_memory(void *base, size_t size, const char *file);
+
+/* Same as checkpoint_save_memory(), done by a thread while the memory
+ * keeps being written: checkpoint_job_preserve() must be called before
+ * each store to a page, until the job is done, so that the page gets
+ * copied if it was not saved yet.  A chain, when given, is written with
+ * checkpoint_save_chain() once the image is complete. */
+typedef struct CheckpointJob CheckpointJob;
+
+CheckpointJob *checkpoint_save_background(const void *base, size_t size, const char *file, const uint32_t *dirty, bool compress,
+                                          const char *chain, const char *parent);
+void           checkpoint_job_preserve(CheckpointJob *job, uint64_t page);
+bool           checkpoint_job_done(CheckpointJob *job);
+void           checkpoint_job_wait(CheckpointJob *job); /* and frees it */
+
+/* True if image can be saved as a delta on top of the chain of parent,
+ * that is if they share a directory and image is not part of it yet */
+bool checkpoint_chain_can_extend(const char *parent, const char *image);
+/* Writes the manifest of a chain made of the one of parent, or of
+ * nothing when it is NULL, followed by image */
+void checkpoint_save_chain(const char *chain, const char *parent, const char *image);
+void checkpoint_load_chain(void *base, size_t size, const char *chain);
+
+#endif
@@ -185,6 +185,11 @@ static inline int ctz32(uint32_t val)
 #endif
 }
 
+static inline int ctz64(uint64_t val) {
+    uint32_t lo = val;
+    return lo ? ctz32(lo) : 32 + ctz32(val >> 32);
+}
+
 void *mallocz(size_t size);
 void  pstrcpy(char *buf, int buf_size, const char *str);
 char *pstrcat(char *buf, int buf_size, const char *s);
@@ -211,6 +211,45 @@ static inline uintx_t glue(mulhsu, XLEN)(intx_t a, uintx_t b) {
 #define NEXT_INSN  \
     code_ptr += 4; \
     break
+#ifdef THREADED_DISPATCH
+/* Direct threading: each pre-decoded handler ends with its own copy of
+ * the head of the interpreter loop and jumps straight to the handler of
+ * the next instruction.  Only page crossings go back through the loop. */
+#define DECODED_CASE(op) \
+    case op:             \
+    handler_##op
+#define DECODED_NEXT_INSN                                 \
+    code_ptr += d->len;                                   \
+    s->pc = GET_PC();                                     \
+    if (unlikely(!--n_cycles))                            \
+        goto the_end;                                     \
+    ++insn_executed;                                      \
+    if (unlikely(s->trigger_armed & MCONTROL_EXECUTE)     \
+        && check_triggers(s, MCONTROL_EXECUTE, s->pc)) {  \
+        if (s->debug_mode)                                \
+            goto done_interp;                             \
+        goto exception;                                   \
+    }                                                     \
+    if (unlikely(code_ptr >= code_end))                   \
+        goto fetch_insn;                                  \
+    d = &dcode[(code_ptr - code_page) >> 1];              \
+    if (unlikely(d->op == DOP_UNDECODED))                 \
+        predecode_insn(d, get_insn32(code_ptr));          \
+    goto *dispatch_table[d->op]
+#else
+#define DECODED_CASE(op) case op
+#define DECODED_NEXT_INSN \
+    code_ptr += d->len;   \
+    continue
+#endif
+/* the address of a pre-decoded load/store, compressed ones wrap to XLEN */
+#define DECODED_ADDR()                      \
+    ({                                      \
+        addr = read_reg(d->rs1) + d->imm;   \
+        if (d->len == 2)                    \
+            addr = (intx_t)addr;            \
+        addr;                               \
+    })
 #define JUMP_INSN(kind)            \
     do {                           \
         code_ptr          = NULL;  \
@@ -220,6 +259,53 @@ static inline uintx_t glue(mulhsu, XLEN)(intx_t a, uintx_t b) {
         s->next_addr      = s->pc; \
         goto jump_insn;            \
     } while (0)
+/* With --jit, run the translated blocks from s->pc in the current page,
+ * if there are any (see riscv_jit.cpp), the instruction at s->pc being
+ * already counted in n_cycles and insn_executed or not */
+#ifdef JIT
+#define JIT_RUN(counted)                                                                                       \
+    do {                                                                                                       \
+        BOOL jit_refetch;                                                                                      \
+        int  jit_n;                                                                                            \
+        if (XLEN == 64 && s->jit && n_cycles - 1 + (counted) >= JIT_MIN_RUN                                    \
+            && (jit_n = riscv_jit_run(s, dcode, code_page, n_cycles - 1 + (counted), &jit_refetch)) > 0) { \
+            n_cycles -= jit_n - (counted);                                                                     \
+            insn_executed += jit_n - (counted);                                                                \
+            if (jit_refetch) {                                                                                 \
+                code_ptr          = NULL;                                                                      \
+                code_end          = NULL;                                                                      \
+                code_to_pc_addend = s->pc;                                                                     \
+            } else {                                                                                           \
+                code_ptr += (target_long)(s->pc - GET_PC());                                                   \
+            }                                                                                                  \
+            goto jump_insn;                                                                                    \
+        }                                                                                                      \
+    } while (0)
+#else
+#define JIT_RUN(counted) \
+    do {                 \
+    } while (0)
+#endif
+/* Taken control transfer of a pre-decoded instruction: a target in the
+ * current page is chained to directly, without going back through the
+ * code TLB and the decoded cache, unless an interrupt may be pending.
+ * Builds with -DCHAINING=Off always go back, run/compare_chaining.sh
+ * checks that both give the same traces. */
+#ifdef NO_CHAINING
+#define DECODED_JUMP_INSN(kind) JUMP_INSN(kind)
+#else
+#define DECODED_JUMP_INSN(kind)                                                                     \
+    do {                                                                                            \
+        if (likely(((s->pc ^ GET_PC()) & ~(target_ulong)PG_MASK) == 0 && (s->mip & s->mie) == 0)) { \
+            code_ptr += (target_long)(s->pc - GET_PC());                                            \
+            s->info      = kind;                                                                    \
+            s->next_addr = s->pc;                                                                   \
+            JIT_RUN(0);                                                                             \
+            goto jump_insn;                                                                         \
+        }                                                                                           \
+        JUMP_INSN(kind);                                                                            \
+    } while (0)
+#endif
 
 #define chkfp32 glue(chkfp32, XLEN)
 
@@ -240,19 +326,430 @@ static uint32_t chkfp32(target_ulong a) {
  *     x1/x5   x1/x5       1            push
  */
 
+#define predecode_insn glue(predecode_insn, XLEN)
+
+static inline void glue(set_decoded, XLEN)(DecodedInsn *d, int op, int rd, int rs1, int rs2, int32_t imm) {
+    d->op  = op;
+    d->rd  = rd;
+    d->rs1 = rs1;
+    d->rs2 = rs2;
+    d->imm = imm;
+}
+
+#define DECODED(op, rd, rs1, rs2, imm) glue(set_decoded, XLEN)(d, op, rd, rs1, rs2, imm)
+
+/*
+ * Fill in d for the instruction insn.  Only the common integer
+ * instructions get a fast handler; everything else, including all the
+ * illegal encodings, is left to the full decoder (DOP_SLOW).  ALU
+ * instructions writing x0 are turned into DOP_NOP so the handlers don't
+ * have to check rd.
+ */
+static void predecode_insn(DecodedInsn *d, uint32_t insn) {
+    uint32_t funct3, rd, rs1, rs2;
+    int32_t  imm;
+
+    d->op  = DOP_SLOW;
+    d->len = (insn & 3) == 3 ? 4 : 2;
+    rd     = (insn >> 7) & 0x1f;
+
+    switch (insn & 3) {
+        case 0:
+            funct3 = (insn >> 13) & 7;
+            rd     = ((insn >> 2) & 7) | 8;
+            rs1    = ((insn >> 7) & 7) | 8;
+            switch (funct3) {
+                case 0: /* c.addi4spn */
+                    imm = get_field1(insn, 11, 4, 5) | get_field1(insn, 7, 6, 9) | get_field1(insn, 6, 2, 2)
+                          | get_field1(insn, 5, 3, 3);
+                    if (imm != 0)
+                        DECODED(DOP_ADDI, rd, 2, 0, imm);
+                    break;
+                case 2: /* c.lw */
+                    imm = get_field1(insn, 10, 3, 5) | get_field1(insn, 6, 2, 2) | get_field1(insn, 5, 6, 6);
+                    DECODED(DOP_LW, rd, rs1, 0, imm);
+                    break;
+                case 6: /* c.sw */
+                    imm = get_field1(insn, 10, 3, 5) | get_field1(insn, 6, 2, 2) | get_field1(insn, 5, 6, 6);
+                    DECODED(DOP_SW, 0, rs1, rd, imm);
+                    break;
+#if XLEN >= 64
+                case 3: /* c.ld */
+                    imm = get_field1(insn, 10, 3, 5) | get_field1(insn, 5, 6, 7);
+                    DECODED(DOP_LD, rd, rs1, 0, imm);
+                    break;
+                case 7: /* c.sd */
+                    imm = get_field1(insn, 10, 3, 5) | get_field1(insn, 5, 6, 7);
+                    DECODED(DOP_SD, 0, rs1, rd, imm);
+                    break;
+#endif
+            }
+            return;
+        case 1:
+            funct3 = (insn >> 13) & 7;
+            imm    = sext(get_field1(insn, 12, 5, 5) | get_field1(insn, 2, 0, 4), 6);
+            switch (funct3) {
+                case 0: /* c.addi/c.nop */
+                    if (rd != 0)
+                        DECODED(DOP_ADDI, rd, rd, 0, imm);
+                    else
+                        DECODED(DOP_NOP, 0, 0, 0, 0);
+                    break;
+#if XLEN == 32
+                case 1: /* c.jal */
+                    imm = sext(get_field1(insn, 12, 11, 11) | get_field1(insn, 11, 4, 4) | get_field1(insn, 9, 8, 9)
+                                   | get_field1(insn, 8, 10, 10) | get_field1(insn, 7, 6, 6) | get_field1(insn, 6, 7, 7)
+                                   | get_field1(insn, 3, 1, 3) | get_field1(insn, 2, 5, 5),
+                               12);
+                    DECODED(DOP_JAL, 1, 0, 0, imm);
+                    break;
+#else
+                case 1: /* c.addiw */
+                    if (rd != 0)
+                        DECODED(DOP_ADDIW, rd, rd, 0, imm);
+                    break;
+#endif
+                case 2: /* c.li */
+                    if (rd != 0)
+                        DECODED(DOP_LI, rd, 0, 0, imm);
+                    else
+                        DECODED(DOP_NOP, 0, 0, 0, 0);
+                    break;
+                case 3:
+                    if (rd == 2) {
+                        /* c.addi16sp */
+                        imm = sext(get_field1(insn, 12, 9, 9) | get_field1(insn, 6, 4, 4) | get_field1(insn, 5, 6, 6)
+                                       | get_field1(insn, 3, 7, 8) | get_field1(insn, 2, 5, 5),
+                                   10);
+                        if (imm != 0)
+                            DECODED(DOP_ADDI, 2, 2, 0, imm);
+                    } else {
+                        /* c.lui */
+                        imm = sext(get_field1(insn, 12, 17, 17) | get_field1(insn, 2, 12, 16), 18);
+                        if (imm != 0) {
+                            if (rd != 0)
+                                DECODED(DOP_LI, rd, 0, 0, imm);
+                            else
+                                DECODED(DOP_NOP, 0, 0, 0, 0);
+                        }
+                    }
+                    break;
+                case 4:
+                    rd = ((insn >> 7) & 7) | 8;
+                    switch ((insn >> 10) & 3) {
+                        case 0: /* c.srli */
+                        case 1: /* c.srai */
+                            imm = get_field1(insn, 12, 5, 5) | get_field1(insn, 2, 0, 4);
+                            if (XLEN == 32 && (imm & 0x20))
+                                break;
+                            DECODED(((insn >> 10) & 3) == 0 ? DOP_SRLI : DOP_SRAI, rd, rd, 0, imm);
+                            break;
+                        case 2: /* c.andi */ DECODED(DOP_ANDI, rd, rd, 0, imm); break;
+                        case 3:
+                            rs2 = ((insn >> 2) & 7) | 8;
+                            switch (((insn >> 5) & 3) | ((insn >> (12 - 2)) & 4)) {
+                                case 0: /* c.sub */ DECODED(DOP_SUB, rd, rd, rs2, 0); break;
+                                case 1: /* c.xor */ DECODED(DOP_XOR, rd, rd, rs2, 0); break;
+                                case 2: /* c.or */ DECODED(DOP_OR, rd, rd, rs2, 0); break;
+                                case 3: /* c.and */ DECODED(DOP_AND, rd, rd, rs2, 0); break;
+#if XLEN >= 64
+                                case 4: /* c.subw */ DECODED(DOP_SUBW, rd, rd, rs2, 0); break;
+                                case 5: /* c.addw */ DECODED(DOP_ADDW, rd, rd, rs2, 0); break;
+#endif
+                            }
+                            break;
+                    }
+                    break;
+                case 5: /* c.j */
+                    imm = sext(get_field1(insn, 12, 11, 11) | get_field1(insn, 11, 4, 4) | get_field1(insn, 9, 8, 9)
+                                   | get_field1(insn, 8, 10, 10) | get_field1(insn, 7, 6, 6) | get_field1(insn, 6, 7, 7)
+                                   | get_field1(insn, 3, 1, 3) | get_field1(insn, 2, 5, 5),
+                               12);
+                    DECODED(DOP_JAL, 0, 0, 0, imm);
+                    break;
+                case 6: /* c.beqz */
+                case 7: /* c.bnez */
+                    imm = sext(get_field1(insn, 12, 8, 8) | get_field1(insn, 10, 3, 4) | get_field1(insn, 5, 6, 7)
+                                   | get_field1(insn, 3, 1, 2) | get_field1(insn, 2, 5, 5),
+                               9);
+                    DECODED(funct3 == 6 ? DOP_BEQ : DOP_BNE, 0, ((insn >> 7) & 7) | 8, 0, imm);
+                    break;
+            }
+            return;
+        case 2:
+            funct3 = (insn >> 13) & 7;
+            rs2    = (insn >> 2) & 0x1f;
+            switch (funct3) {
+                case 0: /* c.slli */
+                    imm = get_field1(insn, 12, 5, 5) | rs2;
+                    if (XLEN == 32 && (imm & 0x20))
+                        break;
+                    if (rd != 0)
+                        DECODED(DOP_SLLI, rd, rd, 0, imm);
+                    else
+                        DECODED(DOP_NOP, 0, 0, 0, 0);
+                    break;
+                case 2: /* c.lwsp */
+                    imm = get_field1(insn, 12, 5, 5) | (rs2 & (7 << 2)) | get_field1(insn, 2, 6, 7);
+                    if (rd != 0)
+                        DECODED(DOP_LW, rd, 2, 0, imm);
+                    break;
+                case 6: /* c.swsp */
+                    imm = get_field1(insn, 9, 2, 5) | get_field1(insn, 7, 6, 7);
+                    DECODED(DOP_SW, 0, 2, rs2, imm);
+                    break;
+#if XLEN >= 64
+                case 3: /* c.ldsp */
+                    imm = get_field1(insn, 12, 5, 5) | (rs2 & (3 << 3)) | get_field1(insn, 2, 6, 8);
+                    if (rd != 0)
+                        DECODED(DOP_LD, rd, 2, 0, imm);
+                    break;
+                case 7: /* c.sdsp */
+                    imm = get_field1(insn, 10, 3, 5) | get_field1(insn, 7, 6, 8);
+                    DECODED(DOP_SD, 0, 2, rs2, imm);
+                    break;
+#endif
+                case 4:
+                    if (((insn >> 12) & 1) == 0) {
+                        if (rs2 == 0) {
+                            /* c.jr */
+                            if (rd != 0)
+                                DECODED(DOP_JALR, 0, rd, 0, 0);
+                        } else {
+                            /* c.mv */
+                            if (rd != 0)
+                                DECODED(DOP_ADD, rd, 0, rs2, 0);
+                            else
+                                DECODED(DOP_NOP, 0, 0, 0, 0);
+                        }
+                    } else if (rs2 == 0) {
+                        /* c.jalr, c.ebreak is left to the full decoder */
+                        if (rd != 0)
+                            DECODED(DOP_JALR, 1, rd, 0, 0);
+                    } else {
+                        /* c.add */
+                        if (rd != 0)
+                            DECODED(DOP_ADD, rd, rd, rs2, 0);
+                        else
+                            DECODED(DOP_NOP, 0, 0, 0, 0);
+                    }
+                    break;
+            }
+            return;
+    }
+
+    funct3 = (insn >> 12) & 7;
+    rs1    = (insn >> 15) & 0x1f;
+    rs2    = (insn >> 20) & 0x1f;
+    imm    = (int32_t)insn >> 20;
+    switch (insn & 0x7f) {
+        case 0x37: /* lui */
+            if (rd != 0)
+                DECODED(DOP_LI, rd, 0, 0, (int32_t)(insn & 0xfffff000));
+            else
+                DECODED(DOP_NOP, 0, 0, 0, 0);
+            break;
+        case 0x17: /* auipc */
+            if (rd != 0)
+                DECODED(DOP_AUIPC, rd, 0, 0, (int32_t)(insn & 0xfffff000));
+            else
+                DECODED(DOP_NOP, 0, 0, 0, 0);
+            break;
+        case 0x6f: /* jal */
+            imm = ((insn >> (31 - 20)) & (1 << 20)) | ((insn >> (21 - 1)) & 0x7fe) | ((insn >> (20 - 11)) & (1 << 11))
+                  | (insn & 0xff000);
+            imm = (imm << 11) >> 11;
+            DECODED(DOP_JAL, rd, 0, 0, imm);
+            break;
+        case 0x67: /* jalr */
+            if (funct3 == 0)
+                DECODED(DOP_JALR, rd, rs1, 0, imm);
+            break;
+        case 0x63:
+            if (funct3 == 2 || funct3 == 3)
+                break;
+            imm = ((insn >> (31 - 12)) & (1 << 12)) | ((insn >> (25 - 5)) & 0x7e0) | ((insn >> (8 - 1)) & 0x1e)
+                  | ((insn << (11 - 7)) & (1 << 11));
+            imm = (imm << 19) >> 19;
+            DECODED(DOP_BEQ + (funct3 < 2 ? funct3 : funct3 - 2), 0, rs1, rs2, imm);
+            break;
+        case 0x03: /* load */
+            switch (funct3) {
+                case 0: /* lb */ DECODED(DOP_LB, rd, rs1, 0, imm); break;
+                case 1: /* lh */ DECODED(DOP_LH, rd, rs1, 0, imm); break;
+                case 2: /* lw */ DECODED(DOP_LW, rd, rs1, 0, imm); break;
+                case 4: /* lbu */ DECODED(DOP_LBU, rd, rs1, 0, imm); break;
+                case 5: /* lhu */ DECODED(DOP_LHU, rd, rs1, 0, imm); break;
+#if XLEN >= 64
+                case 3: /* ld */ DECODED(DOP_LD, rd, rs1, 0, imm); break;
+                case 6: /* lwu */ DECODED(DOP_LWU, rd, rs1, 0, imm); break;
+#endif
+            }
+            break;
+        case 0x23: /* store */
+            imm = rd | ((insn >> (25 - 5)) & 0xfe0);
+            imm = (imm << 20) >> 20;
+            switch (funct3) {
+                case 0: /* sb */ DECODED(DOP_SB, 0, rs1, rs2, imm); break;
+                case 1: /* sh */ DECODED(DOP_SH, 0, rs1, rs2, imm); break;
+                case 2: /* sw */ DECODED(DOP_SW, 0, rs1, rs2, imm); break;
+#if XLEN >= 64
+                case 3: /* sd */ DECODED(DOP_SD, 0, rs1, rs2, imm); break;
+#endif
+            }
+            break;
+        case 0x13:
+            switch (funct3) {
+                case 0: /* addi */ DECODED(DOP_ADDI, rd, rs1, 0, imm); break;
+                case 1: /* slli */
+                    if ((imm & ~(XLEN - 1)) == 0)
+                        DECODED(DOP_SLLI, rd, rs1, 0, imm);
+                    break;
+                case 2: /* slti */ DECODED(DOP_SLTI, rd, rs1, 0, imm); break;
+                case 3: /* sltiu */ DECODED(DOP_SLTIU, rd, rs1, 0, imm); break;
+                case 4: /* xori */ DECODED(DOP_XORI, rd, rs1, 0, imm); break;
+                case 5: /* srli/srai */
+                    if ((imm & ~((XLEN - 1) | 0x400)) == 0)
+                        DECODED(imm & 0x400 ? DOP_SRAI : DOP_SRLI, rd, rs1, 0, imm & (XLEN - 1));
+                    break;
+                case 6: /* ori */ DECODED(DOP_ORI, rd, rs1, 0, imm); break;
+                case 7: /* andi */ DECODED(DOP_ANDI, rd, rs1, 0, imm); break;
+            }
+            if (rd == 0 && d->op != DOP_SLOW)
+                DECODED(DOP_NOP, 0, 0, 0, 0);
+            break;
+#if XLEN >= 64
+        case 0x1b: /* OP-IMM-32 */
+            switch (funct3) {
+                case 0: /* addiw */ DECODED(DOP_ADDIW, rd, rs1, 0, imm); break;
+                case 1: /* slliw */
+                    if ((imm & ~31) == 0)
+                        DECODED(DOP_SLLIW, rd, rs1, 0, imm);
+                    break;
+                case 5: /* srliw/sraiw */
+                    if ((imm & ~(31 | 0x400)) == 0)
+                        DECODED(imm & 0x400 ? DOP_SRAIW : DOP_SRLIW, rd, rs1, 0, imm & 31);
+                    break;
+            }
+            if (rd == 0 && d->op != DOP_SLOW)
+                DECODED(DOP_NOP, 0, 0, 0, 0);
+            break;
+        case 0x3b: /* OP-32 */
+            switch (insn >> 25) {
+                case 0x00:
+                    if (funct3 == 0) /* addw */
+                        DECODED(DOP_ADDW, rd, rs1, rs2, 0);
+                    break;
+                case 0x20:
+                    if (funct3 == 0) /* subw */
+                        DECODED(DOP_SUBW, rd, rs1, rs2, 0);
+                    break;
+            }
+            if (rd == 0 && d->op != DOP_SLOW)
+                DECODED(DOP_NOP, 0, 0, 0, 0);
+            break;
+#endif
+        case 0x33:
+            switch (insn >> 25) {
+                case 0x00:
+                    switch (funct3) {
+                        case 0: /* add */ DECODED(DOP_ADD, rd, rs1, rs2, 0); break;
+                        case 1: /* sll */ DECODED(DOP_SLL, rd, rs1, rs2, 0); break;
+                        case 2: /* slt */ DECODED(DOP_SLT, rd, rs1, rs2, 0); break;
+                        case 3: /* sltu */ DECODED(DOP_SLTU, rd, rs1, rs2, 0); break;
+                        case 4: /* xor */ DECODED(DOP_XOR, rd, rs1, rs2, 0); break;
+                        case 5: /* srl */ DECODED(DOP_SRL, rd, rs1, rs2, 0); break;
+                        case 6: /* or */ DECODED(DOP_OR, rd, rs1, rs2, 0); break;
+                        case 7: /* and */ DECODED(DOP_AND, rd, rs1, rs2, 0); break;
+                    }
+                    break;
+                case 0x20:
+                    if (funct3 == 0) /* sub */
+                        DECODED(DOP_SUB, rd, rs1, rs2, 0);
+                    else if (funct3 == 5) /* sra */
+                        DECODED(DOP_SRA, rd, rs1, rs2, 0);
+                    break;
+            }
+            if (rd == 0 && d->op != DOP_SLOW)
+                DECODED(DOP_NOP, 0, 0, 0, 0);
+            break;
+        case 0x0f: /* misc-mem */
+            if (funct3 == 0) /* fence */
+                DECODED(DOP_NOP, 0, 0, 0, 0);
+            break;
+    }
+}
+
+#undef DECODED
+
 int no_inline glue(riscv_cpu_interp, XLEN)(RISCVCPUState *s, int n_cycles);
 
 int no_inline glue(riscv_cpu_interp, XLEN)(RISCVCPUState *s, int n_cycles) {
     uint32_t     opcode, insn, rd, rs1, rs2, funct3;
     int32_t      imm, cond, err;
     target_ulong addr, val, val2;
-    uint8_t *    code_ptr, *code_end;
+    uint8_t *    code_ptr, *code_end, *code_page;
     target_ulong code_to_pc_addend;
+    DecodedInsn *dcode, *d;
     uint64_t     insn_counter_addend;
     uint64_t     insn_counter_start = s->insn_counter;
 #if FLEN > 0
     uint32_t rs3;
     int32_t  rm;
+#endif
+#ifdef THREADED_DISPATCH
+    /* indexed by DecodedInsn.op, see the DOP_ enum */
+    static const void *const dispatch_table[DOP_NB] = {
+        &&handler_DOP_SLOW, /* DOP_UNDECODED is never dispatched */
+        &&handler_DOP_SLOW,
+        &&handler_DOP_NOP,
+        &&handler_DOP_LI,
+        &&handler_DOP_AUIPC,
+        &&handler_DOP_ADDI,
+        &&handler_DOP_SLTI,
+        &&handler_DOP_SLTIU,
+        &&handler_DOP_XORI,
+        &&handler_DOP_ORI,
+        &&handler_DOP_ANDI,
+        &&handler_DOP_SLLI,
+        &&handler_DOP_SRLI,
+        &&handler_DOP_SRAI,
+        &&handler_DOP_ADD,
+        &&handler_DOP_SUB,
+        &&handler_DOP_SLL,
+        &&handler_DOP_SLT,
+        &&handler_DOP_SLTU,
+        &&handler_DOP_XOR,
+        &&handler_DOP_SRL,
+        &&handler_DOP_SRA,
+        &&handler_DOP_OR,
+        &&handler_DOP_AND,
+        &&handler_DOP_ADDIW,
+        &&handler_DOP_SLLIW,
+        &&handler_DOP_SRLIW,
+        &&handler_DOP_SRAIW,
+        &&handler_DOP_ADDW,
+        &&handler_DOP_SUBW,
+        &&handler_DOP_LB,
+        &&handler_DOP_LH,
+        &&handler_DOP_LW,
+        &&handler_DOP_LBU,
+        &&handler_DOP_LHU,
+        &&handler_DOP_LWU,
+        &&handler_DOP_LD,
+        &&handler_DOP_SB,
+        &&handler_DOP_SH,
+        &&handler_DOP_SW,
+        &&handler_DOP_SD,
+        &&handler_DOP_BEQ,
+        &&handler_DOP_BNE,
+        &&handler_DOP_BLT,
+        &&handler_DOP_BGE,
+        &&handler_DOP_BLTU,
+        &&handler_DOP_BGEU,
+        &&handler_DOP_JAL,
+        &&handler_DOP_JALR,
+    };
 #endif
     int insn_executed               = 0;
     s->most_recently_written_reg    = -1;
@@ -276,6 +773,8 @@ int no_inline glue(riscv_cpu_interp, XLEN)(RISCVCPUState *s, int n_cycles) {
     /* Note: we assume NULL is represented as a zero number */
     code_ptr          = NULL;
     code_end          = NULL;
+    code_page         = NULL;
+    dcode             = NULL;
     code_to_pc_addend = s->pc;
 
     /* we use a single execution loop to keep a simple control flow
@@ -287,12 +786,15 @@ int no_inline glue(riscv_cpu_interp, XLEN)(RISCVCPUState *s, int n_cycles) {
 
         ++insn_executed;
 
-        if (check_triggers(s, MCONTROL_EXECUTE, s->pc))
+        if (unlikely(s->trigger_armed & MCONTROL_EXECUTE) && check_triggers(s, MCONTROL_EXECUTE, s->pc))
             if (s->debug_mode)
                 goto done_interp;
             else
                 goto exception;
 
+#ifdef THREADED_DISPATCH
+    fetch_insn:
+#endif
         if (unlikely(code_ptr >= code_end)) {
             uint32_t     tlb_idx;
             uint16_t     insn_high;
@@ -306,9 +808,10 @@ int no_inline glue(riscv_cpu_interp, XLEN)(RISCVCPUState *s, int n_cycles) {
             }
 
             addr    = s->pc;
-            tlb_idx = (addr >> PG_SHIFT) & (TLB_SIZE - 1);
+            tlb_idx = (addr >> PG_SHIFT) & s->tlb_mask;
             if (likely(s->tlb_code[tlb_idx].vaddr == (addr & ~PG_MASK))) {
                 /* TLB match */
+                s->tlb_hit_count++;
                 uintptr_t mem_addend;
                 mem_addend        = s->tlb_code[tlb_idx].mem_addend;
                 code_ptr          = (uint8_t *)(mem_addend + (uintptr_t)addr);
@@ -324,19 +827,186 @@ int no_inline glue(riscv_cpu_interp, XLEN)(RISCVCPUState *s, int n_cycles) {
                             goto mmu_exception;
                         insn |= insn_high << 16;
                     }
-                } else {
-                    insn = get_insn32(code_ptr);
+                    goto decode_insn;
                 }
-
+                code_page = code_ptr - (addr & PG_MASK);
+#ifdef PADDR_INLINE
+                dcode = decode_cache_lookup(s, s->tlb_code[tlb_idx].paddr_addend + addr, code_page);
+#else
+                dcode = decode_cache_lookup(s, s->tlb_code_paddr_addend[tlb_idx] + addr, code_page);
+#endif
+                JIT_RUN(1);
             } else {
                 if (unlikely(target_read_insn_slow(s, &insn, 32, addr)))
                     goto mmu_exception;
+                goto decode_insn;
             }
-        } else {
-            /* fast path */
-            insn = get_insn32(code_ptr);
         }
 
+        /* fast path: pre-decoded instruction */
+        d = &dcode[(code_ptr - code_page) >> 1];
+        if (unlikely(d->op == DOP_UNDECODED))
+            predecode_insn(d, get_insn32(code_ptr));
+
+#ifdef THREADED_DISPATCH
+        goto *dispatch_table[d->op];
+#endif
+        switch (d->op) {
+            DECODED_CASE(DOP_NOP): DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_LI): write_reg(d->rd, d->imm); DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_AUIPC): write_reg(d->rd, (intx_t)(GET_PC() + d->imm)); DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_ADDI): write_reg(d->rd, (intx_t)(read_reg(d->rs1) + d->imm)); DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_SLTI): write_reg(d->rd, (target_long)read_reg(d->rs1) < (target_long)d->imm); DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_SLTIU): write_reg(d->rd, read_reg(d->rs1) < (target_ulong)d->imm); DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_XORI): write_reg(d->rd, read_reg(d->rs1) ^ d->imm); DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_ORI): write_reg(d->rd, read_reg(d->rs1) | d->imm); DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_ANDI): write_reg(d->rd, read_reg(d->rs1) & d->imm); DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_SLLI): write_reg(d->rd, (intx_t)(read_reg(d->rs1) << d->imm)); DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_SRLI): write_reg(d->rd, (intx_t)((uintx_t)read_reg(d->rs1) >> d->imm)); DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_SRAI): write_reg(d->rd, (intx_t)read_reg(d->rs1) >> d->imm); DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_ADD): write_reg(d->rd, (intx_t)(read_reg(d->rs1) + read_reg(d->rs2))); DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_SUB): write_reg(d->rd, (intx_t)(read_reg(d->rs1) - read_reg(d->rs2))); DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_SLL): write_reg(d->rd, (intx_t)(read_reg(d->rs1) << (read_reg(d->rs2) & (XLEN - 1)))); DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_SLT):
+                write_reg(d->rd, (target_long)read_reg(d->rs1) < (target_long)read_reg(d->rs2));
+                DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_SLTU): write_reg(d->rd, read_reg(d->rs1) < read_reg(d->rs2)); DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_XOR): write_reg(d->rd, read_reg(d->rs1) ^ read_reg(d->rs2)); DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_SRL):
+                write_reg(d->rd, (intx_t)((uintx_t)read_reg(d->rs1) >> (read_reg(d->rs2) & (XLEN - 1))));
+                DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_SRA): write_reg(d->rd, (intx_t)read_reg(d->rs1) >> (read_reg(d->rs2) & (XLEN - 1))); DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_OR): write_reg(d->rd, read_reg(d->rs1) | read_reg(d->rs2)); DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_AND): write_reg(d->rd, read_reg(d->rs1) & read_reg(d->rs2)); DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_ADDIW): write_reg(d->rd, (int32_t)(read_reg(d->rs1) + d->imm)); DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_SLLIW): write_reg(d->rd, (int32_t)(read_reg(d->rs1) << d->imm)); DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_SRLIW): write_reg(d->rd, (int32_t)((uint32_t)read_reg(d->rs1) >> d->imm)); DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_SRAIW): write_reg(d->rd, (int32_t)read_reg(d->rs1) >> d->imm); DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_ADDW): write_reg(d->rd, (int32_t)(read_reg(d->rs1) + read_reg(d->rs2))); DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_SUBW): write_reg(d->rd, (int32_t)(read_reg(d->rs1) - read_reg(d->rs2))); DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_LB): {
+                uint8_t rval;
+                if (target_read_u8(s, &rval, DECODED_ADDR()))
+                    goto mmu_exception;
+                if (d->rd != 0)
+                    write_reg(d->rd, (int8_t)rval);
+            }
+                DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_LH): {
+                uint16_t rval;
+                if (target_read_u16(s, &rval, DECODED_ADDR()))
+                    goto mmu_exception;
+                if (d->rd != 0)
+                    write_reg(d->rd, (int16_t)rval);
+            }
+                DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_LW): {
+                uint32_t rval;
+                if (target_read_u32(s, &rval, DECODED_ADDR()))
+                    goto mmu_exception;
+                if (d->rd != 0)
+                    write_reg(d->rd, (int32_t)rval);
+            }
+                DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_LBU): {
+                uint8_t rval;
+                if (target_read_u8(s, &rval, DECODED_ADDR()))
+                    goto mmu_exception;
+                if (d->rd != 0)
+                    write_reg(d->rd, rval);
+            }
+                DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_LHU): {
+                uint16_t rval;
+                if (target_read_u16(s, &rval, DECODED_ADDR()))
+                    goto mmu_exception;
+                if (d->rd != 0)
+                    write_reg(d->rd, rval);
+            }
+                DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_LWU): {
+                uint32_t rval;
+                if (target_read_u32(s, &rval, DECODED_ADDR()))
+                    goto mmu_exception;
+                if (d->rd != 0)
+                    write_reg(d->rd, rval);
+            }
+                DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_LD): {
+                uint64_t rval;
+                if (target_read_u64(s, &rval, DECODED_ADDR()))
+                    goto mmu_exception;
+                if (d->rd != 0)
+                    write_reg(d->rd, (int64_t)rval);
+            }
+                DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_SB):
+                if (target_write_u8(s, DECODED_ADDR(), read_reg(d->rs2)))
+                    goto mmu_exception;
+                DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_SH):
+                if (target_write_u16(s, DECODED_ADDR(), read_reg(d->rs2)))
+                    goto mmu_exception;
+                DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_SW):
+                if (target_write_u32(s, DECODED_ADDR(), read_reg(d->rs2)))
+                    goto mmu_exception;
+                DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_SD):
+                if (target_write_u64(s, DECODED_ADDR(), read_reg(d->rs2)))
+                    goto mmu_exception;
+                DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_BEQ): cond = read_reg(d->rs1) == read_reg(d->rs2); goto decoded_branch;
+            DECODED_CASE(DOP_BNE): cond = read_reg(d->rs1) != read_reg(d->rs2); goto decoded_branch;
+            DECODED_CASE(DOP_BLT): cond = (target_long)read_reg(d->rs1) < (target_long)read_reg(d->rs2); goto decoded_branch;
+            DECODED_CASE(DOP_BGE): cond = (target_long)read_reg(d->rs1) >= (target_long)read_reg(d->rs2); goto decoded_branch;
+            DECODED_CASE(DOP_BLTU): cond = read_reg(d->rs1) < read_reg(d->rs2); goto decoded_branch;
+            DECODED_CASE(DOP_BGEU):
+                cond = read_reg(d->rs1) >= read_reg(d->rs2);
+            decoded_branch:
+                if (cond) {
+                    intx_t new_pc = (intx_t)(GET_PC() + d->imm);
+                    if (d->len == 4 && !(s->misa & MCPUID_C) && (new_pc & 3) != 0) {
+                        s->pending_exception = CAUSE_MISALIGNED_FETCH;
+                        s->pending_tval      = 0;
+                        goto exception;
+                    }
+                    s->pc = new_pc;
+                    DECODED_JUMP_INSN(ctf_taken_branch);
+                }
+                DECODED_NEXT_INSN;
+            DECODED_CASE(DOP_JAL): {
+                intx_t new_pc = (intx_t)(GET_PC() + d->imm);
+                if (d->len == 4 && !(s->misa & MCPUID_C) && (new_pc & 3) != 0) {
+                    s->pending_exception = CAUSE_MISALIGNED_FETCH;
+                    s->pending_tval      = 0;
+                    goto exception;
+                }
+                if (d->rd != 0)
+                    write_reg(d->rd, GET_PC() + d->len);
+                s->pc = new_pc;
+                DECODED_JUMP_INSN(ctf_taken_jump);
+            }
+            DECODED_CASE(DOP_JALR): {
+                intx_t new_pc = (intx_t)(read_reg(d->rs1) + d->imm) & ~1;
+                if (d->len == 4 && !(s->misa & MCPUID_C) && (new_pc & 3) != 0) {
+                    s->pending_exception = CAUSE_MISALIGNED_FETCH;
+                    s->pending_tval      = 0;
+                    goto exception;
+                }
+                val   = GET_PC() + d->len;
+                s->pc = new_pc;
+                if (d->rd != 0)
+                    write_reg(d->rd, val);
+                DECODED_JUMP_INSN(ctf_compute_hint(d->rd, d->rs1));
+            }
+            default:
+            DECODED_CASE(DOP_SLOW):
+                insn = get_insn32(code_ptr);
+                break;
+        }
+
+    decode_insn:
         opcode = insn & 0x7f;
         rd     = (insn >> 7) & 0x1f;
         rs1    = (insn >> 15) & 0x1f;
@@ -1109,6 +1779,7 @@ int no_inline glue(riscv_cpu_interp, XLEN)(RISCVCPUState *s, int n_cycles) {
                             s->mcycle += delta;
                             s->minstret += delta;
                         }
+                        insn_counter_start = s->insn_counter;
                         if (csr_read(s, funct3, &val2, imm, TRUE))
                             goto illegal_insn;
                         val2 = (intx_t)val2;
@@ -1137,6 +1808,7 @@ int no_inline glue(riscv_cpu_interp, XLEN)(RISCVCPUState *s, int n_cycles) {
                             s->mcycle += delta;
                             s->minstret += delta;
                         }
+                        insn_counter_start = s->insn_counter;
                         if (csr_read(s, funct3, &val2, imm, (rs1 != 0)))
                             goto illegal_insn;
                         val2 = (intx_t)val2;
@@ -1211,7 +1883,16 @@ int no_inline glue(riscv_cpu_interp, XLEN)(RISCVCPUState *s, int n_cycles) {
                                     if (s->priv
                                         < PRV_M)  // FIXME: It should be illegal even in M, but this is the only that we have now
                                         goto illegal_insn;
-                                    s->pc = GET_PC();
+                                    /* count the debug mode instructions before dret restarts the counters */
+                                    s->insn_counter = GET_INSN_COUNTER();
+                                    if (!s->stop_the_counter) {
+                                        int delta = s->insn_counter - insn_counter_start;
+                                        assert(delta >= 0);
+                                        s->mcycle += delta;
+                                        s->minstret += delta;
+                                    }
+                                    insn_counter_start = s->insn_counter;
+                                    s->pc              = GET_PC();
                                     handle_dret(s);
                                     goto done_interp;
                                 }
@@ -1246,11 +1927,7 @@ int no_inline glue(riscv_cpu_interp, XLEN)(RISCVCPUState *s, int n_cycles) {
                                         goto illegal_insn;
                                     if (s->priv == PRV_S && s->mstatus & MSTATUS_TVM)
                                         goto illegal_insn;
-                                    if (rs1 == 0) {
-                                        tlb_flush_all(s);
-                                    } else {
-                                        tlb_flush_vaddr(s, read_reg(rs1));
-                                    }
+                                    tlb_flush_vaddr(s, rs1 == 0, read_reg(rs1), rs2 == 0, read_reg(rs2));
                                     /* the current code TLB may have been flushed */
                                     s->pc = GET_PC() + 4;
                                     JUMP_INSN(ctf_nop);
@@ -1271,7 +1948,9 @@ int no_inline glue(riscv_cpu_interp, XLEN)(RISCVCPUState *s, int n_cycles) {
                         break;
                     case 1: /* fence.i */
                         /* all variantions are reserved for future use */
-                        break;
+                        riscv_cpu_flush_decode_cache(s);
+                        s->pc = GET_PC() + 4;
+                        JUMP_INSN(ctf_nop);
 #if XLEN >= 128
                     case 2: /* lq */
                         imm  = (int32_t)insn >> 20;
@@ -1289,6 +1968,7 @@ int no_inline glue(riscv_cpu_interp, XLEN)(RISCVCPUState *s, int n_cycles) {
 #define OP_A(size)                                                                      \
     {                                                                                   \
         uint##size##_t rval;                                                            \
+        bool           stored;                                                          \
                                                                                         \
         addr   = read_reg(rs1);                                                         \
         funct3 = insn >> 27;                                                            \
@@ -1298,8 +1978,10 @@ int no_inline glue(riscv_cpu_interp, XLEN)(RISCVCPUState *s, int n_cycles) {
                     goto illegal_insn;                                                  \
                 if (target_read_u##size(s, &rval, addr))                                \
                     goto mmu_exception;                                                 \
-                val         = (int##size##_t)rval;                                      \
-                s->load_res = addr;                                                     \
+                val             = (int##size##_t)rval;                                  \
+                s->load_res     = addr;                                                 \
+                s->load_res_val = rval;                                                 \
+                reservation_set(s);                                                     \
                 break;                                                                  \
                                                                                         \
             case 3: /* sc.w */                                                          \
@@ -1310,14 +1992,14 @@ int no_inline glue(riscv_cpu_interp, XLEN)(RISCVCPUState *s, int n_cycles) {
                     goto mmu_exception;                                                 \
                 }                                                                       \
                                                                                         \
-                if (s->load_res == addr) {                                              \
-                    if (target_write_u##size(s, addr, read_reg(rs2)))                   \
+                if (s->load_res == addr && reservation_held(s)) {                       \
+                    if (target_sc_u##size(s, addr, read_reg(rs2), &stored))             \
                         goto mmu_exception;                                             \
-                    val         = 0;                                                    \
-                    s->load_res = ~0;                                                   \
+                    val = !stored;                                                      \
                 } else {                                                                \
                     val = 1;                                                            \
                 }                                                                       \
+                reservation_clear(s);                                                   \
                 break;                                                                  \
             case 1:    /* amiswap.w */                                                  \
             case 0:    /* amoadd.w */                                                   \
@@ -1328,39 +2010,9 @@ int no_inline glue(riscv_cpu_interp, XLEN)(RISCVCPUState *s, int n_cycles) {
             case 0x14: /* amomax.w */                                                   \
             case 0x18: /* amominu.w */                                                  \
             case 0x1c: /* amomaxu.w */                                                  \
-                if (target_read_u##size(s, &rval, addr)) {                              \
-                    if (s->pending_exception != CAUSE_BREAKPOINT)                       \
-                        s->pending_exception += 2; /* LD -> ST */                       \
-                    goto mmu_exception;                                                 \
-                }                                                                       \
-                val  = (int##size##_t)rval;                                             \
-                val2 = read_reg(rs2);                                                   \
-                switch (funct3) {                                                       \
-                    case 1: /* amiswap.w */ break;                                      \
-                    case 0: /* amoadd.w */ val2 = (int##size##_t)(val + val2); break;   \
-                    case 4: /* amoxor.w */ val2 = (int##size##_t)(val ^ val2); break;   \
-                    case 0xc: /* amoand.w */ val2 = (int##size##_t)(val & val2); break; \
-                    case 0x8: /* amoor.w */ val2 = (int##size##_t)(val | val2); break;  \
-                    case 0x10: /* amomin.w */                                           \
-                        if ((int##size##_t)val < (int##size##_t)val2)                   \
-                            val2 = (int##size##_t)val;                                  \
-                        break;                                                          \
-                    case 0x14: /* amomax.w */                                           \
-                        if ((int##size##_t)val > (int##size##_t)val2)                   \
-                            val2 = (int##size##_t)val;                                  \
-                        break;                                                          \
-                    case 0x18: /* amominu.w */                                          \
-                        if ((uint##size##_t)val < (uint##size##_t)val2)                 \
-                            val2 = (int##size##_t)val;                                  \
-                        break;                                                          \
-                    case 0x1c: /* amomaxu.w */                                          \
-                        if ((uint##size##_t)val > (uint##size##_t)val2)                 \
-                            val2 = (int##size##_t)val;                                  \
-                        break;                                                          \
-                    default: goto illegal_insn;                                         \
-                }                                                                       \
-                if (target_write_u##size(s, addr, val2))                                \
+                if (target_amo_u##size(s, funct3, addr, read_reg(rs2), &rval))          \
                     goto mmu_exception;                                                 \
+                val = (int##size##_t)rval;                                              \
                 break;                                                                  \
             default: goto illegal_insn;                                                 \
         }                                                                               \
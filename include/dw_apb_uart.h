@@ -51,3 +51,5 @@ typedef struct DW_apb_uart_state {
 void     dw_apb_uart_poll(void *opaque);
 uint32_t dw_apb_uart_read(void *opaque, uint32_t offset, int size_log2);
 void     dw_apb_uart_write(void *opaque, uint32_t offset, uint32_t val, int size_log2);
+void     dw_apb_uart_save(void *opaque, FILE *f);
+BOOL     dw_apb_uart_load(void *opaque, FILE *f);
@@ -40,10 +40,16 @@
 #ifndef IOMEM_H
 #define IOMEM_H
 
+#include <stdio.h>
+
 #include "cutils.h"
 
 typedef void     DeviceWriteFunc(void *opaque, uint32_t offset, uint32_t val, int size_log2);
 typedef uint32_t DeviceReadFunc(void *opaque, uint32_t offset, int size_log2);
+/* checkpointing of the state that the registers do not give back, the
+   load function returns FALSE if the saved state is short or bad */
+typedef void DeviceSaveFunc(void *opaque, FILE *f);
+typedef BOOL DeviceLoadFunc(void *opaque, FILE *f);
 
 #define DEVIO_SIZE8  (1 << 0)
 #define DEVIO_SIZE16 (1 << 1)
@@ -73,18 +79,41 @@ typedef struct {
     uint32_t *dirty_bits;      /* NULL if not used */
     uint32_t *dirty_bits_tab[2];
     int       dirty_bits_index; /* 0-1 */
+    /* called with the page index before a dirty bit gets set, if any */
+    void (*write_hook)(void *opaque, size_t page_index);
+    void *write_hook_opaque;
     /* the following is used for I/O access */
     void *           opaque;
     DeviceReadFunc * read_func;
     DeviceWriteFunc *write_func;
     int              devio_flags;
+    DeviceSaveFunc * save_func; /* NULL if the device has no state to save */
+    DeviceLoadFunc * load_func;
 } PhysMemoryRange;
 
 #define PHYS_MEM_RANGE_MAX 32
 
+/* The enabled ranges are flattened into sorted, disjoint segments, the
+ * highest registered range winning where they overlap. Below
+ * 1 << PHYS_MEM_INDEX_LIMIT_LOG2, a table of 1 << PHYS_MEM_INDEX_SHIFT
+ * byte granules gives the range directly unless several share the
+ * granule. */
+#define PHYS_MEM_INDEX_SHIFT      20
+#define PHYS_MEM_INDEX_LIMIT_LOG2 36
+#define PHYS_MEM_INDEX_MIXED      ((PhysMemoryRange *)1) /* search the segments */
+
+typedef struct {
+    uint64_t         start;
+    uint64_t         end; /* exclusive */
+    PhysMemoryRange *pr;
+} PhysMemorySegment;
+
 struct PhysMemoryMap {
     int             n_phys_mem_range;
     PhysMemoryRange phys_mem_range[PHYS_MEM_RANGE_MAX];
+    int               n_segment;
+    PhysMemorySegment segment[2 * PHYS_MEM_RANGE_MAX];
+    PhysMemoryRange **index; /* see phys_mem_map_update() */
     PhysMemoryRange *(*register_ram)(PhysMemoryMap *s, uint64_t addr, uint64_t size, int devram_flags);
     void (*free_ram)(PhysMemoryMap *s, PhysMemoryRange *pr);
     const uint32_t *(*get_dirty_bits)(PhysMemoryMap *s, PhysMemoryRange *pr);
@@ -101,9 +130,30 @@ static inline PhysMemoryRange *cpu_register_ram(PhysMemoryMap *s, uint64_t addr,
 }
 PhysMemoryRange *cpu_register_device(PhysMemoryMap *s, uint64_t addr, uint64_t size, void *opaque, DeviceReadFunc *read_func,
                                      DeviceWriteFunc *write_func, int devio_flags);
-PhysMemoryRange *get_phys_mem_range(PhysMemoryMap *s, uint64_t paddr);
+PhysMemoryRange *phys_mem_range_search(PhysMemoryMap *s, uint64_t paddr);
 void             phys_mem_set_addr(PhysMemoryRange *pr, uint64_t addr, BOOL enabled);
 
+static inline void phys_mem_set_state_funcs(PhysMemoryRange *pr, DeviceSaveFunc *save_func, DeviceLoadFunc *load_func) {
+    pr->save_func = save_func;
+    pr->load_func = load_func;
+}
+BOOL phys_mem_save_devices(PhysMemoryMap *s, FILE *f);
+BOOL phys_mem_load_devices(PhysMemoryMap *s, FILE *f);
+
+/* raw fields of a device state, of the layout of the build */
+static inline void device_state_put(FILE *f, const void *buf, size_t len) { fwrite(buf, len, 1, f); }
+static inline BOOL device_state_get(FILE *f, void *buf, size_t len) { return fread(buf, len, 1, f) == 1; }
+
+/* return NULL if not found */
+static inline PhysMemoryRange *get_phys_mem_range(PhysMemoryMap *s, uint64_t paddr) {
+    if ((paddr >> PHYS_MEM_INDEX_LIMIT_LOG2) == 0) {
+        PhysMemoryRange *pr = s->index[paddr >> PHYS_MEM_INDEX_SHIFT];
+        if (pr != PHYS_MEM_INDEX_MIXED)
+            return pr;
+    }
+    return phys_mem_range_search(s, paddr);
+}
+
 static inline const uint32_t *phys_mem_get_dirty_bits(PhysMemoryRange *pr) {
     PhysMemoryMap *map = pr->map;
     return map->get_dirty_bits(map, pr);
@@ -116,7 +166,10 @@ static inline void phys_mem_set_dirty_bit(PhysMemoryRange *pr, size_t offset) {
         page_index     = offset >> DEVRAM_PAGE_SIZE_LOG2;
         mask           = 1 << (page_index & 0x1f);
         dirty_bits_ptr = pr->dirty_bits + (page_index >> 5);
-        *dirty_bits_ptr |= mask;
+        /* harts running in parallel may share the word */
+        __atomic_or_fetch(dirty_bits_ptr, mask, __ATOMIC_RELAXED);
+        if (pr->write_hook)
+            pr->write_hook(pr->write_hook_opaque, page_index);
     }
 }
 
@@ -39,6 +39,7 @@
  */
 
 #include <stdint.h>
+#include <stdio.h>
 
 #include "json.h"
 
@@ -179,6 +180,13 @@ typedef struct {
     /* Clear mimpid, marchid, mvendorid */
     bool clear_ids;
 
+    /* TLB entries per bank and L2 TLB entries (0 to disable) */
+    uint32_t tlb_size;
+    uint32_t l2_tlb_size;
+
+    /* ASID bits implemented in satp, from 0 to ASID_BITS_MAX */
+    uint32_t asid_bits;
+
     uint64_t physical_addr_len;
 
     char *logfile;  // If non-zero, all output goes here, stderr and stdout
@@ -202,9 +210,26 @@ typedef struct VirtMachine {
 
     char *   snapshot_load_name;
     char *   snapshot_save_name;
+    bool     snapshot_uncompressed; /* keep the saved pages as is, so that loading maps them */
+    bool     snapshot_incremental;  /* save the pages written since the last snapshot only */
+    char *   snapshot_last_name;    /* last snapshot saved or loaded, parent of an incremental one */
+    uint64_t checkpoint_every;      /* instructions between periodic snapshots, 0 if none */
+    uint64_t checkpoint_start;      /* maxinsns when they started */
+    uint64_t checkpoint_next;       /* maxinsns at the next one */
     char *   terminate_event;
     uint64_t maxinsns;
     uint64_t trace;
+    uint64_t quantum;   /* instructions per hart between scheduling points, 0 to single step */
+    bool     stats;     /* print per-hart statistics upon exit */
+    bool     parallel;  /* run each hart on its own host thread, a quantum at a time */
+    bool     idle_skip; /* stall harts in WFI, and skip ahead when all of them are */
+
+    /* Scheduling of the harts in quantum mode, see virt_machine_next_quantum() */
+    uint64_t *hart_quantum;   /* quantum of every hart */
+    uint32_t  quantum_jitter; /* percentage by which a quantum randomly varies */
+    uint64_t  sched_seed;     /* state of the jitter's pseudo-random numbers */
+    FILE *    sched_record;   /* log of the quanta run, NULL if not recording */
+    FILE *    sched_replay;   /* log of the quanta to run, NULL if not replaying */
 
     /* For co-simulation only, they are -1 if nothing is pending. */
     bool cosim;
@@ -228,6 +253,8 @@ char *      get_file_path(const char *base_filename, const char *filename);
 void        virt_machine_free_config(VirtMachineParams *p);
 RISCVMachine *virt_machine_init(const VirtMachineParams *p);
 int           virt_machine_get_sleep_duration(RISCVMachine *s, int hartid, int delay);
+uint64_t      virt_machine_get_event_budget(RISCVMachine *s, int hartid);
+uint64_t      virt_machine_idle_skip(RISCVMachine *s, uint64_t max_cycles);
 BOOL          vm_mouse_is_absolute(RISCVMachine *s);
 void          vm_send_mouse_event(RISCVMachine *s1, int dx, int dy, int dz, unsigned int buttons);
 void          vm_send_key_event(RISCVMachine *s1, BOOL is_down, uint16_t key_code);
@@ -250,11 +277,16 @@ BlockDevice *block_device_init_http(const char *url, int max_cache_size_kb, void
 #ifdef __cplusplus
 extern "C" {
 #endif
+/* The snapshot of --load, in common.snapshot_load_name, is left for the
+ * caller to restore with virt_machine_deserialize() */
 RISCVMachine *virt_machine_main(int argc, char **argv);
 void          virt_machine_end(RISCVMachine *s);
 void          virt_machine_serialize(RISCVMachine *m, const char *dump_name);
 void          virt_machine_deserialize(RISCVMachine *m, const char *dump_name);
+void          virt_machine_checkpoint(RISCVMachine *m);
 BOOL          virt_machine_run(RISCVMachine *m, int hartid);
+BOOL          virt_machine_run_quantum(RISCVMachine *m, int hartid, uint64_t n_insns, uint64_t *n_steps);
+uint64_t      virt_machine_next_quantum(RISCVMachine *m, int hartid);
 uint64_t      virt_machine_get_pc(RISCVMachine *m, int hartid);
 uint64_t      virt_machine_get_reg(RISCVMachine *m, int hartid, int rn);
 uint64_t      virt_machine_get_fpreg(RISCVMachine *m, int hartid, int rn);
@@ -44,7 +44,8 @@
 
 #include "riscv.h"
 
-#define ROM_SIZE       0x00001000
+#define ROM_SIZE_LOG2  12 /* the ROM recovery code shifts by it */
+#define ROM_SIZE       (1 << ROM_SIZE_LOG2)
 #define ROM_BASE_ADDR  0x00010000
 #define BOOT_BASE_ADDR 0x00010000
 
@@ -115,14 +116,45 @@ typedef uint128_t mem_uint_t;
 #unsupported MLEN
 #endif
 
-#define TLB_SIZE 256
+#define TLB_SIZE 256 /* default entries per bank, see --tlb_size */
+
+/* The second-level TLB is shared by all the banks and address spaces of
+ * a hart and holds leaf translations of any page size */
+#define L2_TLB_SIZE 1024 /* default entries, see --l2_tlb_size */
+#define L2_TLB_WAYS 4
+
+/* Page walk cache of the non-leaf PTEs, direct mapped per level */
+#define PWC_SIZE     64 /* must be a power of 2 */
+#define PWC_LEVEL_NB 3  /* non-leaf levels of sv48 */
+
+/* The TLBs are banked by translation context: data accesses by effective
+ * privilege and the mstatus SUM/MXR bits that apply to it, code by
+ * privilege. A context switch selects another bank instead of flushing. */
+#define TLB_DATA_CTX_NB 6
+#define TLB_CODE_CTX_NB 3
+
+/* Number of address spaces (satp values, i.e. ASID and root page table)
+ * whose banks survive satp writes */
+#define TLB_SPACE_NB 4
+
+/* Superpage leaves remembered per address space to keep sfence.vma of
+ * other addresses cheap */
+#define TLB_SUPERPAGE_NB 8
+
+#define DECODE_CACHE_SIZE 64 /* code pages per hart, must be a power of 2 */
+/* With many harts, each gets fewer pages, down to DECODE_CACHE_MIN, so
+ * that they do not add up to more than DECODE_CACHE_TOTAL */
+#define DECODE_CACHE_MIN   4
+#define DECODE_CACHE_TOTAL 4096
 
 #define PG_SHIFT 12
 #define PG_MASK  ((1 << PG_SHIFT) - 1)
 
-#define ASID_BITS 0
+/* Of the 16 bits of the satp ASID field, the machine implements
+ * asid_bits (see --asid_bits), none by default */
+#define ASID_BITS_MAX 16
 
-#define SATP_MASK ((15ULL << 60) | (((1ULL << ASID_BITS) - 1) << 44) | ((1ULL << 44) - 1))
+#define SATP_MASK(asid_bits) ((15ULL << 60) | (((1ULL << (asid_bits)) - 1) << 44) | ((1ULL << 44) - 1))
 
 #ifndef MAX_TRIGGERS
 #define MAX_TRIGGERS 1  // As of right now, one trigger register
@@ -147,6 +179,124 @@ typedef struct {
     uintptr_t    mem_addend;
 } TLBEntry;
 
+/* The TLB banks of one address space */
+typedef struct {
+    uint64_t satp;         /* -1 when unused */
+    uint64_t last_use;     /* for recycling, see tlb_set_satp() */
+    uint8_t  data_used;    /* banks filled since the last flush */
+    uint8_t  code_used;
+    uint8_t  superpage_nb; /* TLB_SUPERPAGE_NB + 1 once they don't fit */
+
+    target_ulong superpage[TLB_SUPERPAGE_NB]; /* vaddr | log2 of the size */
+
+    uint32_t l2_gen;    /* bumped to drop all its L2 TLB and PWC entries */
+    uint8_t  l2_shifts; /* page sizes in the L2 TLB, see l2_tlb_set() */
+
+    /* Banks of tlb_size entries, see tlb_init() */
+    TLBEntry *read[TLB_DATA_CTX_NB];
+    TLBEntry *write[TLB_DATA_CTX_NB];
+    TLBEntry *code[TLB_CODE_CTX_NB];
+#ifndef PADDR_INLINE
+    target_ulong *read_paddr_addend[TLB_DATA_CTX_NB];
+    target_ulong *write_paddr_addend[TLB_DATA_CTX_NB];
+    target_ulong *code_paddr_addend[TLB_CODE_CTX_NB];
+#endif
+    /* log2 of the page each entry was filled from, for sfence.vma */
+    uint8_t *read_shift[TLB_DATA_CTX_NB];
+    uint8_t *write_shift[TLB_DATA_CTX_NB];
+    uint8_t *code_shift[TLB_CODE_CTX_NB];
+} TLBSpace;
+
+typedef struct {
+    target_ulong vaddr; /* aligned on the page size */
+    target_ulong paddr;
+    uint32_t     gen;   /* valid if equal to the l2_gen of its space */
+    uint8_t      space; /* index in tlb_spaces, 0xff when unused */
+    uint8_t      shift; /* log2 of the page size */
+    uint8_t      pte;   /* low bits of the leaf PTE (V to D) */
+} L2TLBEntry;
+
+typedef struct {
+    target_ulong vpn;   /* vaddr >> log2 of the size mapped by the PTE */
+    target_ulong paddr; /* of the next level page table */
+    uint32_t     gen;   /* as for L2TLBEntry */
+    uint8_t      space;
+} PWCEntry;
+
+/* An instruction as pre-decoded by the interpreter: op selects one of
+ * its fast handlers (0 means not decoded yet), len is 2 or 4 and the
+ * operands are already extracted (compressed instructions are mapped to
+ * their 32-bit equivalent). */
+typedef struct {
+    uint8_t op;
+    uint8_t len;
+    uint8_t rd;
+    uint8_t rs1;
+    uint8_t rs2;
+    int32_t imm;
+} DecodedInsn;
+
+/* Pre-decoded instructions of one physical page, indexed by halfword */
+typedef struct {
+    target_ulong paddr; /* page address, -1 if the slot is free */
+    uint32_t     gen;   /* bumped whenever insn[] is cleared, see riscv_jit.cpp */
+    DecodedInsn  insn[(PG_MASK + 1) / 2];
+} DecodedPage;
+
+/* Fast handlers for pre-decoded instructions (DecodedInsn.op) */
+enum {
+    DOP_UNDECODED = 0,
+    DOP_SLOW, /* handled by the full decoder */
+    DOP_NOP,
+    DOP_LI,
+    DOP_AUIPC,
+    DOP_ADDI,
+    DOP_SLTI,
+    DOP_SLTIU,
+    DOP_XORI,
+    DOP_ORI,
+    DOP_ANDI,
+    DOP_SLLI,
+    DOP_SRLI,
+    DOP_SRAI,
+    DOP_ADD,
+    DOP_SUB,
+    DOP_SLL,
+    DOP_SLT,
+    DOP_SLTU,
+    DOP_XOR,
+    DOP_SRL,
+    DOP_SRA,
+    DOP_OR,
+    DOP_AND,
+    DOP_ADDIW,
+    DOP_SLLIW,
+    DOP_SRLIW,
+    DOP_SRAIW,
+    DOP_ADDW,
+    DOP_SUBW,
+    DOP_LB,
+    DOP_LH,
+    DOP_LW,
+    DOP_LBU,
+    DOP_LHU,
+    DOP_LWU,
+    DOP_LD,
+    DOP_SB,
+    DOP_SH,
+    DOP_SW,
+    DOP_SD,
+    DOP_BEQ,
+    DOP_BNE,
+    DOP_BLT,
+    DOP_BGE,
+    DOP_BLTU,
+    DOP_BGEU,
+    DOP_JAL,
+    DOP_JALR,
+    DOP_NB,
+};
+
 /* Control-flow summary information */
 typedef enum {
     ctf_nop = 1,
@@ -160,6 +310,17 @@ typedef enum {
     ctf_taken_jalr_pop_push,
 } RISCVCTFInfo;
 
+static inline RISCVCTFInfo ctf_compute_hint(int rd, int rs1) {
+    int          rd_link  = rd == 1 || rd == 5;
+    int          rs1_link = rs1 == 1 || rs1 == 5;
+    RISCVCTFInfo k        = (RISCVCTFInfo)(rd_link * 2 + rs1_link + (int)ctf_taken_jalr);
+
+    if (k == ctf_taken_jalr_pop_push && rs1 == rd)
+        return ctf_taken_jalr_push;
+
+    return k;
+}
+
 typedef struct RISCVCPUState {
     RISCVMachine *machine;
     target_ulong  pc;
@@ -218,6 +379,7 @@ typedef struct RISCVCPUState {
     uint32_t     tselect;
     target_ulong tdata1[MAX_TRIGGERS];
     target_ulong tdata2[MAX_TRIGGERS];
+    uint8_t      trigger_armed; /* MCONTROL_{EXECUTE,STORE,LOAD} that can fire now */
 
     target_ulong mhpmevent[32];
 
@@ -245,18 +407,54 @@ typedef struct RISCVCPUState {
 
     uint32_t plic_enable_irq[2];
 
-    target_ulong load_res; /* for atomic LR/SC */
+    target_ulong load_res;     /* for atomic LR/SC */
+    uint64_t     load_res_val; /* value loaded by the LR, see target_sc_u32() */
 
     PhysMemoryMap *mem_map;
     int            physical_addr_len;
 
-    TLBEntry tlb_read[TLB_SIZE];
-    TLBEntry tlb_write[TLB_SIZE];
-    TLBEntry tlb_code[TLB_SIZE];
+    /* Banks of the current context, see tlb_select() */
+    TLBEntry *tlb_read;
+    TLBEntry *tlb_write;
+    TLBEntry *tlb_code;
 #ifndef PADDR_INLINE
-    target_ulong tlb_read_paddr_addend[TLB_SIZE];
-    target_ulong tlb_write_paddr_addend[TLB_SIZE];
-    target_ulong tlb_code_paddr_addend[TLB_SIZE];
+    target_ulong *tlb_read_paddr_addend;
+    target_ulong *tlb_write_paddr_addend;
+    target_ulong *tlb_code_paddr_addend;
+#endif
+    uint8_t *tlb_read_shift;
+    uint8_t *tlb_write_shift;
+    uint8_t *tlb_code_shift;
+    uint8_t  tlb_leaf_shift; /* of the last riscv_cpu_get_phys_addr() */
+
+    TLBSpace *tlb_space; /* of the current satp */
+    TLBSpace  tlb_spaces[TLB_SPACE_NB];
+    uint64_t  tlb_clock;
+    uint32_t  tlb_mask; /* entries per bank - 1 */
+
+    L2TLBEntry *l2_tlb; /* NULL when disabled */
+    uint32_t    l2_tlb_set_mask;
+    uint32_t    l2_tlb_victim;
+
+    PWCEntry         pwc[PWC_LEVEL_NB][PWC_SIZE];
+    PhysMemoryRange *ptw_ram; /* holding the last PTE read, see ptw_read() */
+
+    /* for --stats */
+    uint64_t tlb_hit_count;
+    uint64_t tlb_miss_count;
+    uint64_t l2_tlb_hit_count;
+    uint64_t l2_tlb_miss_count;
+    uint64_t ptw_count; /* page table walks */
+    uint64_t pte_read_count;
+
+    /* Physically indexed, direct mapped cache of pre-decoded code pages,
+     * each allocated when first used */
+    DecodedPage **decode_cache;
+    uint32_t      decode_cache_mask;
+
+#ifdef JIT
+    /* Blocks of decode_cache translated to host code, NULL without --jit */
+    struct RISCVJit *jit;
 #endif
 
     // Benchmark return value
@@ -279,12 +477,17 @@ RISCVCPUState *riscv_cpu_init(RISCVMachine *machine, int hartid);
 void           riscv_cpu_end(RISCVCPUState *s);
 int            riscv_cpu_interp(RISCVCPUState *s, int n_cycles);
 uint64_t       riscv_cpu_get_cycles(RISCVCPUState *s);
+void           riscv_cpu_print_stats(RISCVCPUState *s);
 void           riscv_cpu_set_mip(RISCVCPUState *s, uint32_t mask);
 void           riscv_cpu_reset_mip(RISCVCPUState *s, uint32_t mask);
 uint32_t       riscv_cpu_get_mip(RISCVCPUState *s);
 BOOL           riscv_cpu_get_power_down(RISCVCPUState *s);
+BOOL           riscv_cpu_stalled(RISCVCPUState *s);
+void           riscv_cpu_idle(RISCVCPUState *s, uint64_t n_cycles);
 uint32_t       riscv_cpu_get_misa(RISCVCPUState *s);
 void           riscv_cpu_flush_tlb_write_range_ram(RISCVCPUState *s, uint8_t *ram_ptr, size_t ram_size);
+void           riscv_cpu_flush_decode_cache(RISCVCPUState *s);
+BOOL           riscv_cpu_invalidate_decoded(RISCVCPUState *s, uint64_t paddr, int size);
 void           riscv_set_pc(RISCVCPUState *s, uint64_t pc);
 uint64_t       riscv_get_pc(RISCVCPUState *s);
 uint64_t       riscv_get_reg(RISCVCPUState *s, int rn);
@@ -308,8 +511,12 @@ void riscv_set_debug_mode(RISCVCPUState *s, bool on);
 int riscv_benchmark_exit_code(RISCVCPUState *s);
 
 #include "riscv_machine.h"
-void riscv_cpu_serialize(RISCVCPUState *s, const char *dump_name, const uint64_t clint_base_addr);
-void riscv_cpu_deserialize(RISCVCPUState *s, const char *dump_name);
+/* In the background, the main RAM is saved by m->checkpoint_job, which
+ * riscv_cpu_serialize_wait() waits for */
+BOOL riscv_cpu_can_serialize(RISCVMachine *m);
+void riscv_cpu_serialize(RISCVMachine *m, const char *dump_name, BOOL background);
+void riscv_cpu_serialize_wait(RISCVMachine *m);
+void riscv_cpu_deserialize(RISCVMachine *m, const char *dump_name);
 
 int riscv_cpu_read_memory(RISCVCPUState *s, mem_uint_t *pval, target_ulong addr, int size_log2);
 int riscv_cpu_write_memory(RISCVCPUState *s, target_ulong addr, mem_uint_t val, int size_log2);
@@ -0,0 +1,42 @@
+/*
+ * Translation of hot blocks of pre-decoded instructions to x86-64 code
+ *
+ * Copyright (C) 2018,2019, Esperanto Technologies Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RISCV_JIT_H
+#define RISCV_JIT_H
+
+#include "riscv_machine.h"
+
+#ifdef JIT
+/* Only built with -DJIT=On, and only used by harts run with --jit */
+#define JIT_MIN_RUN 8 /* shorter runs, like single steps, are left to the interpreter */
+
+void riscv_jit_init(RISCVCPUState *s);
+void riscv_jit_end(RISCVCPUState *s);
+
+/*
+ * Run the translated blocks starting at s->pc, in the page whose
+ * pre-decoded instructions are dcode and host address is code_page, for
+ * up to max_insns instructions.  Returns the number executed, s->pc is
+ * the next one to run; 0 if there is no block to run there.  *refetch
+ * is set if the next instruction must go through the code TLB again,
+ * either because it is in another page or because an interrupt may be
+ * pending.
+ */
+int riscv_jit_run(RISCVCPUState *s, DecodedInsn *dcode, uint8_t *code_page, int max_insns, BOOL *refetch);
+#endif
+
+#endif
@@ -40,6 +40,9 @@
 #ifndef RISCV_MACHINE_H
 #define RISCV_MACHINE_H
 
+#include <mutex>
+
+#include "checkpoint.h"
 #include "machine.h"
 #include "riscv_cpu.h"
 #include "virtio.h"
@@ -48,7 +51,9 @@
 #include "LiveCacheCore.h"
 #endif
 
-#define MAX_CPUS 8
+/* Hart state is sized by ncpus; the limit comes from the CLINT and PLIC
+   register layouts (1024 harts leave room for both M and S contexts) */
+#define MAX_CPUS 1024
 
 /* Hooks */
 typedef struct RISCVMachineHooks {
@@ -57,6 +62,37 @@ typedef struct RISCVMachineHooks {
     int (*csr_write)(RISCVCPUState *s, uint32_t funct3, uint32_t csr, uint64_t val);
 } RISCVMachineHooks;
 
+/* Events are callbacks due at a hart 0 mcycle.  Devices schedule them
+   in the machine's queue instead of being polled after every step, and
+   the harts only stop to run the queue once its first event is due. */
+typedef struct RISCVEvent RISCVEvent;
+typedef void RISCVEventFunc(RISCVMachine *m, RISCVEvent *ev, uint64_t now);
+
+struct RISCVEvent {
+    uint64_t        when;
+    RISCVEventFunc *func;
+    void *          opaque;
+    int             index; /* in the queue's heap, -1 if not scheduled */
+};
+
+/* Min-heap of the scheduled events, on their due mcycle */
+typedef struct RISCVEventQueue {
+    RISCVEvent **heap;
+    int          count;
+    int          size;
+} RISCVEventQueue;
+
+/* Machine timebase: mtime advances every RTC_FREQ_DIV cycles of hart 0 */
+typedef struct RISCVTimebase {
+    /* due mcycle of the first event in the queue, UINT64_MAX if none */
+    uint64_t deadline;
+    /* harts running in parallel see hart 0's mcycle as it last published
+       it, and mtime writes wait for hart 0 to apply them */
+    uint64_t cycles;
+    uint64_t mtime_write;
+    bool     mtime_written;
+} RISCVTimebase;
+
 struct RISCVMachine {
     VirtMachine       common;
     RISCVMachineHooks hooks;
@@ -64,17 +100,27 @@ struct RISCVMachine {
 #ifdef LIVECACHE
     LiveCache *llc;
 #endif
-    RISCVCPUState *cpu_state[MAX_CPUS];
-    int            ncpus;
-    uint64_t       ram_size;
-    uint64_t       ram_base_addr;
+    RISCVCPUState **cpu_state; /* ncpus entries */
+    int             ncpus;
+    uint64_t        ram_size;
+    uint64_t        ram_base_addr;
     /* PLIC */
     uint32_t  plic_pending_irq;
     uint32_t  plic_served_irq;
+    uint32_t  plic_priority[PLIC_NUM_SOURCES + 1];
     IRQSignal plic_irq[32]; /* IRQ 0 is not used */
+    /* Bitmap of the harts enabling each IRQ in any context, so that an IRQ
+       only updates the mip of the harts it can reach */
+    uint64_t *plic_irq_harts[32];
+
+    RISCVTimebase   timebase;
+    RISCVEventQueue events;
+    RISCVEvent *    timer_event; /* mtimecmp of every hart */
 
-    /* HTIF */
+    /* HTIF: stores to the page of tohost are watched, and flag it as
+       written until it is found to hold no exit request */
     uint64_t htif_tohost_addr;
+    bool     htif_tohost_written;
 
     VIRTIODevice *keyboard_dev;
     VIRTIODevice *mouse_dev;
@@ -85,7 +131,10 @@ struct RISCVMachine {
     uint64_t reset_vector;
 
     /* Bootrom Params */
-    bool compact_bootrom;
+    bool     compact_bootrom;
+    /* ROM_SIZE per hart: the FDT after the boot code takes less than
+       this per hart, and so does the recovery code of a checkpoint */
+    uint32_t rom_size;
 
     /* PLIC/CLINT Params */
     uint64_t plic_base_addr;
@@ -99,6 +148,27 @@ struct RISCVMachine {
     /* Clear mimpid, marchid, mvendorid */
     bool clear_ids;
 
+    /* TLB sizes of every core */
+    uint32_t tlb_size;
+    uint32_t l2_tlb_size;
+
+    /* ASID bits implemented in satp */
+    uint32_t asid_bits;
+
+    /* Serializes device accesses, which can come from several host
+       threads when harts run in parallel */
+    std::mutex *io_lock;
+
+    /* Main RAM of the last checkpoint, while it is being saved in the
+       background, NULL otherwise */
+    CheckpointJob *checkpoint_job;
+
+    /* LR/SC reservations: the cache line reserved by every hart, -1 if
+       none, and a filter of the lines reserved, see
+       riscv_reservations_store() */
+    uint64_t *reserved_line;
+    uint64_t reserved_filter;
+
     /* Extension state, not used by Dromajo itself */
     void *ext_state;
 };
@@ -106,6 +176,9 @@ struct RISCVMachine {
 #define PLIC_BASE_ADDR 0x10000000
 #define PLIC_SIZE      0x2000000
 
+#define PLIC_CONTEXTS(ncpus)   (2u * (ncpus)) /* PLIC_HART_CONFIG is "MS" */
+#define PLIC_HART_WORDS(ncpus) (((ncpus) + 63) / 64)
+
 #define CLINT_BASE_ADDR 0x02000000
 #define CLINT_SIZE      0x000c0000
 
@@ -115,6 +188,30 @@ struct RISCVMachine {
 
 #define RTC_FREQ_DIV (CPU_FREQUENCY / RTC_FREQ)
 
+/* Hart 0 publishes its mcycle to the harts running in parallel */
+void riscv_timebase_publish(RISCVMachine *m);
+
+/* Scheduling an event that is already in the queue moves it, and
+ * scheduling it at UINT64_MAX cancels it.  In parallel runs the queue is
+ * guarded by io_lock, which device callbacks already hold. */
+void riscv_event_init(RISCVEvent *ev, RISCVEventFunc *func, void *opaque);
+void riscv_event_schedule(RISCVMachine *m, RISCVEvent *ev, uint64_t when);
+void riscv_event_cancel(RISCVMachine *m, RISCVEvent *ev);
+
+/* LR/SC reservation sets are cache lines */
+#define RESERVATION_LINE_SHIFT 6
+
+void riscv_reservations_break(RISCVMachine *m, int hartid, uint64_t paddr);
+void riscv_reservations_update_filter(RISCVMachine *m);
+
+/* A store to paddr by hartid, or -1 for other bus masters, voids the
+ * reservations of the other harts on its cache line.  The filter keeps
+ * this to a single test for lines nobody reserved. */
+static inline void riscv_reservations_store(RISCVMachine *m, int hartid, uint64_t paddr) {
+    if (unlikely(m->reserved_filter & (uint64_t)1 << ((paddr >> RESERVATION_LINE_SHIFT) & 63)))
+        riscv_reservations_break(m, hartid, paddr);
+}
+
 #define HTIF_BASE_ADDR        0x40008000
 #define IDE_BASE_ADDR         0x40009000
 #define VIRTIO_BASE_ADDR      0x40010000
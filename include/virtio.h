@@ -77,6 +77,9 @@ struct BlockDevice {
     int (*write_async)(BlockDevice *bs, uint64_t sector_num, const uint8_t *buf, int n, BlockDeviceCompletionFunc *cb,
                        void *opaque);
     void *opaque;
+    /* optional, the sectors written that the backing file does not hold */
+    void (*save_state)(BlockDevice *bs, FILE *f);
+    BOOL (*load_state)(BlockDevice *bs, FILE *f);
 };
 
 VIRTIODevice *virtio_block_init(VIRTIOBusDef *bus, BlockDevice *bs);
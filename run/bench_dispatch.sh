@@ -0,0 +1,58 @@
+#!/bin/bash
+#
+# Compare the simulation speed of the switch and the threaded
+# (-DTHREADED=On) interpreters on riscv-simple-tests and, when the
+# images from doc/setup.md are present in run/, on a Linux boot.
+#
+# usage: bench_dispatch.sh [linux_maxinsns]
+
+dromajo_root=$(readlink -f $(dirname $0)/..)
+linux_maxinsns=${1:-200M}
+
+echo "using dromajo_root:"$dromajo_root
+
+mkdir -p build_bench
+cd build_bench
+
+for variant in switch threaded; do
+  mkdir -p $variant
+  pushd $variant > /dev/null
+  if [ $variant = threaded ]; then
+    cmake -DCMAKE_BUILD_TYPE=Release -DTHREADED=On $dromajo_root > /dev/null
+  else
+    cmake -DCMAKE_BUILD_TYPE=Release -DTHREADED=Off $dromajo_root > /dev/null
+  fi
+  make -j dromajo > /dev/null
+  if [ $? -ne 0 ]; then
+    echo "$variant build failed" >&2
+    exit 1
+  fi
+  popd > /dev/null
+done
+
+# prints the MIPS reported by dromajo for the given arguments
+mips() {
+  "$@" 2>&1 >/dev/null | sed -n 's/^Simulation speed: *\([0-9.]*\) MIPS.*/\1/p'
+}
+
+############################## riscv-simple-tests
+
+printf "%-24s %10s %10s\n" test switch threaded
+for t in $dromajo_root/riscv-simple-tests/*; do
+  case $t in *.dump) continue;; esac
+  s=$(mips ./switch/dromajo --quantum 10k $t)
+  r=$(mips ./threaded/dromajo --quantum 10k $t)
+  printf "%-24s %10s %10s\n" $(basename $t) "$s" "$r"
+done
+
+############################## Linux boot
+
+if [ -f $dromajo_root/run/Image -a -f $dromajo_root/run/fw_jump.bin -a -f $dromajo_root/run/rootfs.cpio ]; then
+  pushd $dromajo_root/run > /dev/null
+  s=$(mips $OLDPWD/switch/dromajo --quantum 10k --maxinsns $linux_maxinsns boot.cfg)
+  r=$(mips $OLDPWD/threaded/dromajo --quantum 10k --maxinsns $linux_maxinsns boot.cfg)
+  popd > /dev/null
+  printf "%-24s %10s %10s\n" "linux ($linux_maxinsns)" "$s" "$r"
+else
+  echo "skipping the Linux boot, see doc/setup.md to build Image, fw_jump.bin and rootfs.cpio in run/"
+fi
@@ -0,0 +1,68 @@
+#!/bin/bash
+#
+# Check that chaining in-page branches between pre-decoded blocks does
+# not change what the interpreter does: a build without it
+# (-DCHAINING=Off) and the chained builds, switch and threaded, must give
+# the same commit trace and the same saved state on riscv-simple-tests
+# and on random RV64IMC programs from random_rv64imc.py.
+#
+# usage: compare_chaining.sh [nseeds] [maxinsns]
+
+dromajo_root=$(readlink -f $(dirname $0)/..)
+nseeds=${1:-200}
+maxinsns=${2:-3000}
+
+echo "using dromajo_root:"$dromajo_root
+
+mkdir -p build_chaining
+cd build_chaining
+
+for variant in reference chained threaded; do
+  mkdir -p $variant
+  pushd $variant > /dev/null
+  case $variant in
+    reference) cmake -DCMAKE_BUILD_TYPE=Release -DCHAINING=Off -DTHREADED=Off $dromajo_root > /dev/null;;
+    chained)   cmake -DCMAKE_BUILD_TYPE=Release -DCHAINING=On -DTHREADED=Off $dromajo_root > /dev/null;;
+    threaded)  cmake -DCMAKE_BUILD_TYPE=Release -DCHAINING=On -DTHREADED=On $dromajo_root > /dev/null;;
+  esac
+  make -j dromajo > /dev/null
+  if [ $? -ne 0 ]; then
+    echo "$variant build failed" >&2
+    exit 1
+  fi
+  popd > /dev/null
+done
+
+fail=0
+
+# compares the trace and the state saved by each variant on the given program
+compare() {
+  ./reference/dromajo --trace 0 "$@" 2>&1 >/dev/null | grep -v MIPS > reference.trace
+  ./reference/dromajo --save reference "$@" > /dev/null 2>&1
+  for variant in chained threaded; do
+    ./$variant/dromajo --trace 0 "$@" 2>&1 >/dev/null | grep -v MIPS > $variant.trace
+    ./$variant/dromajo --save $variant "$@" > /dev/null 2>&1
+    if ! cmp -s reference.trace $variant.trace; then
+      echo "$variant trace differs on $*" >&2
+      fail=1
+    elif ! cmp -s reference.re_regs $variant.re_regs || ! cmp -s reference.mainram $variant.mainram; then
+      echo "$variant state differs on $*" >&2
+      fail=1
+    fi
+  done
+}
+
+for t in $dromajo_root/riscv-simple-tests/*; do
+  case $t in *.dump) continue;; esac
+  compare $t
+done
+
+for seed in $(seq 1 $nseeds); do
+  python3 $dromajo_root/run/random_rv64imc.py $seed random.elf
+  compare --maxinsns $maxinsns random.elf
+done
+
+if [ $fail -ne 0 ]; then
+  exit 1
+fi
+echo "chaining matches the reference on riscv-simple-tests and $nseeds random programs"
@@ -0,0 +1,53 @@
+#!/bin/bash
+#
+# Check the --jit translation against dromajo_cosim_step: a -DJIT=On
+# build runs dromajo_jit_lockstep on riscv-simple-tests and on random
+# RV64IMC programs from random_rv64imc.py, the latter looping long enough
+# for their blocks to get translated, half of them rewriting their own
+# code on each pass.  Each program is run in chunks of up to 50 and up
+# to 1000 instructions.
+#
+# usage: jit_lockstep.sh [nseeds] [maxinsns]
+
+dromajo_root=$(readlink -f $(dirname $0)/..)
+nseeds=${1:-100}
+maxinsns=${2:-200000}
+
+echo "using dromajo_root:"$dromajo_root
+
+mkdir -p build_jit
+cd build_jit
+
+cmake -DCMAKE_BUILD_TYPE=Release -DJIT=On $dromajo_root > /dev/null
+make -j dromajo_jit_lockstep > /dev/null
+if [ $? -ne 0 ]; then
+  echo "build failed" >&2
+  exit 1
+fi
+
+fail=0
+
+check() {
+  for chunk in 50 1000; do
+    if ! ./dromajo_jit_lockstep --chunk $chunk "$@" > /dev/null 2> lockstep.log; then
+      echo "differences with --chunk $chunk on $*:" >&2
+      cat lockstep.log >&2
+      fail=1
+    fi
+  done
+}
+
+for t in $dromajo_root/riscv-simple-tests/*; do
+  case $t in *.dump) continue;; esac
+  check $t
+done
+
+for seed in $(seq 1 $nseeds); do
+  python3 $dromajo_root/run/random_rv64imc.py $seed random.elf 500 $((seed % 2))
+  check --seed $seed --mem_every 20 --maxinsns $maxinsns --memory_size 1 random.elf
+done
+
+if [ $fail -ne 0 ]; then
+  exit 1
+fi
+echo "--jit matches dromajo_cosim_step on riscv-simple-tests and $nseeds random programs"
@@ -0,0 +1,183 @@
+#!/usr/bin/env python3
+#
+# Write a random RV64IMC program as a bare ELF for run/compare_chaining.sh.
+#
+# The program runs a random block of integer, load/store and compressed
+# instructions three times (or passes times), with forward branches and
+# jumps of random kinds inside it, and unless smc is 0 rewrites one of its
+# own instructions on each pass so that the pre-decoded pages get
+# invalidated.  It then spins on a "j .", so runs are bounded with
+# --maxinsns.
+#
+# usage: random_rv64imc.py seed out.elf [passes [smc]]
+
+import random
+import struct
+import sys
+
+seed = int(sys.argv[1])
+out  = sys.argv[2]
+NPASS = int(sys.argv[3]) if len(sys.argv) > 3 else 3     # up to 2047
+SMC   = int(sys.argv[4]) if len(sys.argv) > 4 else 1
+R    = random.Random(seed)
+BASE = 0x80000000
+DATA = 0x80010000  # a0 and sp point here, loads and stores stay below +2 KiB
+
+def R_(op,rd,f3,rs1,rs2,f7): return op|rd<<7|f3<<12|rs1<<15|rs2<<20|f7<<25
+def I(op,rd,f3,rs1,imm): return op|rd<<7|f3<<12|rs1<<15|(imm&0xfff)<<20
+def S(op,f3,rs1,rs2,imm): return op|(imm&0x1f)<<7|f3<<12|rs1<<15|rs2<<20|((imm>>5)&0x7f)<<25
+def B(f3,rs1,rs2,imm): return 0x63|((imm>>11)&1)<<7|((imm>>1)&0xf)<<8|f3<<12|rs1<<15|rs2<<20|((imm>>5)&0x3f)<<25|((imm>>12)&1)<<31
+def U(op,rd,imm20): return op|rd<<7|(imm20&0xfffff)<<12
+def J(rd,imm): return 0x6f|rd<<7|((imm>>12)&0xff)<<12|((imm>>11)&1)<<20|((imm>>1)&0x3ff)<<21|((imm>>20)&1)<<31
+RD = [1,3,4,5,6,7,8,9]+list(range(13,32))
+RDC = [8,9,13,14,15]
+def rd(): return R.choice(RD)
+def rs(): return R.randrange(32)
+def cr(): return R.choice(RDC)-8
+def crs(): return R.randrange(8)
+# items: ('w', word) 4 bytes, ('h', half) 2 bytes, ('br', kind, skip) forward branch placeholder
+def rand_item():
+    k = R.randrange(20)
+    if k == 0: return ('w', I(0x13, rd(), R.choice([0,2,3,4,6,7]), rs(), R.randrange(-2048,2048)))
+    if k == 1:
+        f3 = R.choice([1,5]); sh = R.randrange(64); hi = 0x400 if (f3==5 and R.random()<.5) else 0
+        return ('w', I(0x13, rd(), f3, rs(), sh|hi))
+    if k == 2:
+        f3 = R.randrange(8); f7 = R.choice([0,0,1,0x20]) 
+        if f7 == 0x20 and f3 not in (0,5): f7 = 0
+        return ('w', R_(0x33, rd(), f3, rs(), rs(), f7))
+    if k == 3:
+        c = R.choice([(0,0),(0,0x20),(1,0),(5,0),(5,0x20),(0,1),(4,1),(5,1),(6,1),(7,1)])
+        return ('w', R_(0x3b, rd(), c[0], rs(), rs(), c[1]))
+    if k == 4:
+        f3 = R.choice([0,1,5]); imm = R.randrange(-2048,2048) if f3==0 else (R.randrange(32)|(0x400 if f3==5 and R.random()<.5 else 0))
+        return ('w', I(0x1b, rd(), f3, rs(), imm))
+    if k == 5: return ('w', U(R.choice([0x37,0x17]), R.choice(RD+[0]), R.randrange(1<<20)))
+    if k == 6:
+        f3 = R.choice([0,1,2,3,4,5,6]); sz = [1,2,4,8,1,2,4][f3]
+        return ('w', I(0x03, R.choice(RD+[0]), f3, 10, R.randrange(0, 2040//sz)*sz))
+    if k == 7:
+        f3 = R.randrange(4); sz = 1<<f3
+        return ('w', S(0x23, f3, 10, rs(), R.randrange(0, 2040//sz)*sz))
+    if k == 8: return ('br', 'b', R.choice([0,1,4,5,6,7]), rs(), rs(), R.randrange(1,4))
+    if k == 9: return ('br', 'jal', R.choice(RD+[0]), R.randrange(1,4))
+    # compressed
+    k = R.randrange(14)
+    if k == 0: # c.addi / c.li / c.addiw
+        f3 = R.choice([0,1,2]); imm = R.randrange(64); r = R.choice(RD)
+        return ('h', 1|f3<<13|((imm>>5)&1)<<12|r<<7|(imm&0x1f)<<2)
+    if k == 1: # c.lui
+        imm = R.randrange(1,64); r = R.choice([x for x in RD if x != 2])
+        return ('h', 1|3<<13|((imm>>5)&1)<<12|r<<7|(imm&0x1f)<<2)
+    if k == 2: # c.srli/srai/andi
+        f2 = R.randrange(3); imm = R.randrange(64)
+        return ('h', 1|4<<13|((imm>>5)&1)<<12|f2<<10|cr()<<7|(imm&0x1f)<<2)
+    if k == 3: # c.sub..c.addw
+        f = R.randrange(6)
+        return ('h', 1|4<<13|((f>>2)&1)<<12|3<<10|cr()<<7|(f&3)<<5|crs()<<2)
+    if k == 4: # c.slli
+        imm = R.randrange(64)
+        return ('h', 2|0<<13|((imm>>5)&1)<<12|R.choice(RD)<<7|(imm&0x1f)<<2)
+    if k == 5: # c.mv / c.add
+        b = R.randrange(2)
+        return ('h', 2|4<<13|b<<12|R.choice(RD)<<7|R.randrange(1,32)<<2)
+    if k == 6: # c.lw/c.ld rs1'=x10(2)
+        f3 = R.choice([2,3]); off = R.randrange(32)*(4 if f3==2 else 8)
+        if f3 == 2: enc = ((off>>3)&7)<<10|((off>>2)&1)<<6|((off>>6)&1)<<5
+        else: enc = ((off>>3)&7)<<10|((off>>6)&3)<<5
+        return ('h', 0|f3<<13|enc|2<<7|cr()<<2)
+    if k == 7: # c.sw/c.sd
+        f3 = R.choice([6,7]); off = R.randrange(32)*(4 if f3==6 else 8)
+        if f3 == 6: enc = ((off>>3)&7)<<10|((off>>2)&1)<<6|((off>>6)&1)<<5
+        else: enc = ((off>>3)&7)<<10|((off>>6)&3)<<5
+        return ('h', 0|f3<<13|enc|2<<7|crs()<<2)
+    if k == 8: # c.lwsp / c.ldsp
+        f3 = R.choice([2,3])
+        if f3 == 2: off = R.randrange(64)*4; enc = ((off>>5)&1)<<12|((off>>2)&7)<<4|((off>>6)&3)<<2
+        else: off = R.randrange(64)*8; enc = ((off>>5)&1)<<12|((off>>3)&3)<<5|((off>>6)&7)<<2
+        return ('h', 2|f3<<13|enc|R.choice(RD)<<7)
+    if k == 9: # c.swsp/c.sdsp
+        f3 = R.choice([6,7])
+        if f3 == 6: off = R.randrange(64)*4; enc = ((off>>2)&0xf)<<9|((off>>6)&3)<<7
+        else: off = R.randrange(64)*8; enc = ((off>>3)&7)<<10|((off>>6)&7)<<7
+        return ('h', 2|f3<<13|enc|rs()<<2)
+    if k == 10: # c.addi4spn
+        imm = R.randrange(1,256)*4
+        enc = ((imm>>4)&3)<<11|((imm>>6)&0xf)<<7|((imm>>2)&1)<<6|((imm>>3)&1)<<5
+        return ('h', 0|enc|cr()<<2)
+    if k == 11: return ('br', 'cb', R.choice([6,7]), crs(), R.randrange(1,4))
+    if k == 12: return ('br', 'cj', R.randrange(1,4))
+    return ('h', 1)  # c.nop
+def size(it): return 2 if it[0]=='h' or (it[0]=='br' and it[1] in ('cb','cj')) else 4
+body = [rand_item() for _ in range(R.randrange(50,400))]
+# program
+pre = []
+pre.append(('w', I(0x13,10,0,0,1)))
+pre.append(('w', I(0x13,10,1,10,31)))
+pre.append(('w', U(0x37,13,(DATA-BASE)>>12)))
+pre.append(('w', R_(0x33,10,0,10,13,0)))
+pre.append(('w', I(0x13,2,0,10,1024)))     # sp = a0+1024
+pre.append(('w', I(0x13,12,0,0,NPASS)))    # x12 = loop count
+loop = [('label','loop')] + body + [('smc',)] * SMC + [('w', I(0x13,12,0,12,-1)), ('bnez12',)]
+items = pre + loop + [('w', J(0,0))]
+# layout
+def lay(items):
+    pcs=[]; pc=BASE
+    for it in items:
+        pcs.append(pc)
+        if it[0]=='label': continue
+        if it[0]=='smc': pc += (pc & 2) + 4*5 + 4; continue  # aligned for its sw
+        pc += size(it) if it[0] in ('w','h','br') else 4
+    return pcs
+pcs = lay(items)
+code = bytearray()
+real_idx = [i for i,it in enumerate(items) if it[0] not in ('label',)]
+loop_pc = pcs[items.index(('label','loop'))]
+def nth_next_pc(i, k):
+    j = i; n = 0
+    while n < k:
+        j += 1
+        if items[j][0] != 'label': n += 1
+    return pcs[j] if j < len(items) else pcs[-1]
+for i,it in enumerate(items):
+    pc = pcs[i]
+    t = it[0]
+    if t == 'label': continue
+    if t == 'w': code += struct.pack('<I', it[1])
+    elif t == 'h': code += struct.pack('<H', it[1])
+    elif t == 'br':
+        tgt = nth_next_pc(i, it[-1]+1) if i+it[-1]+1 < len(items) else pcs[-1]
+        off = tgt - pc
+        if it[1] == 'b': code += struct.pack('<I', B(it[2], it[3], it[4], off))
+        elif it[1] == 'jal': code += struct.pack('<I', J(it[2], off))
+        elif it[1] == 'cb':
+            enc = ((off>>8)&1)<<12|((off>>3)&3)<<10|((off>>6)&3)<<5|((off>>1)&3)<<3|((off>>5)&1)<<2
+            code += struct.pack('<H', 1|it[2]<<13|enc|it[3]<<7)
+        else:
+            enc = ((off>>11)&1)<<12|((off>>4)&1)<<11|((off>>8)&3)<<9|((off>>10)&1)<<8|((off>>6)&1)<<7|((off>>7)&1)<<6|((off>>1)&7)<<3|((off>>5)&1)<<2
+            code += struct.pack('<H', 1|5<<13|enc)
+    elif t == 'smc':
+        if pc & 2:
+            code += struct.pack('<H', 1)                # c.nop
+            pc += 2
+        # store a new "addi x5, x0, K" over the slot 5 instructions on, run on the next pass
+        slot_pc = pc + 4*5
+        newi = I(0x13,5,0,0,R.randrange(100))
+        lo = newi & 0xfff; lo = lo - 0x1000 if lo >= 0x800 else lo
+        hi = ((newi - lo) >> 12) & 0xfffff
+        code += struct.pack('<I', U(0x37,11,hi))        # lui x11
+        code += struct.pack('<I', I(0x1b,11,0,11,lo))   # addiw x11
+        code += struct.pack('<I', U(0x17,13,0))         # auipc x13 (pc+8)
+        code += struct.pack('<I', S(0x23,2,13,11,slot_pc-(pc+8)))  # sw x11, (slot)
+        code += struct.pack('<I', I(0x13,0,0,0,0))      # nop
+        code += struct.pack('<I', I(0x13,5,0,0,7))      # slot
+    elif t == 'bnez12':
+        code += struct.pack('<I', B(1,12,0,loop_pc-pc))
+data = bytes(code)
+# ELF
+memsz = 0x20000
+ehdr = struct.pack('<16sHHIQQQIHHHHHH', b'\x7fELF\x02\x01\x01'+b'\0'*9, 2, 243, 1, BASE, 64, 0, 0, 64, 56, 1, 64, 0, 0)
+phdr = struct.pack('<IIQQQQQQ', 1, 7, 0x1000, BASE, BASE, len(data), memsz, 0x1000)
+f = ehdr + phdr
+f += b'\0'*(0x1000-len(f)) + data
+open(out,'wb').write(f)
@@ -0,0 +1,732 @@
+/*
+ * Binary checkpoint container for memory images
+ *
+ * Copyright (C) 2018,2019, Esperanto Technologies Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "checkpoint.h"
+
+#include <err.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "cutils.h"
+
+/* Pages are compressed by batches, one slot per page, so that memory
+ * use stays bounded whatever the size of the RAM */
+#define CKPT_BATCH_PAGES 4096
+
+static bool page_is_zero(const uint8_t *p, size_t n) {
+    size_t i = 0;
+
+#ifdef __SSE2__
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 64 <= n; i += 64) {
+        acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(p + i)));
+        acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(p + i + 16)));
+        acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(p + i + 32)));
+        acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(p + i + 48)));
+    }
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF)
+        return false;
+#else
+    uint64_t acc = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, sizeof w);
+        acc |= w;
+    }
+    if (acc)
+        return false;
+#endif
+
+    for (; i < n; ++i)
+        if (p[i])
+            return false;
+
+    return true;
+}
+
+/*
+ * A small LZ77 codec in the spirit of LZ4.  A block is a sequence of
+ *
+ *   token     literal length (high nibble), match length - 4 (low nibble)
+ *   [255...]  literal length extension, when the nibble is 15
+ *   literals
+ *   offset    2 bytes, back from the current position
+ *   [255...]  match length extension, when the nibble is 15
+ *
+ * The last sequence has literals only, and ends the block.
+ */
+#define LZ_MIN_MATCH  4
+#define LZ_HASH_LOG2  12
+#define LZ_MAX_OFFSET 0xFFFF
+
+static inline uint32_t lz_load32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v) { return (v * 2654435761U) >> (32 - LZ_HASH_LOG2); }
+
+static bool lz_put_length(uint8_t **op, const uint8_t *op_end, size_t len) {
+    for (; len >= 255; len -= 255) {
+        if (*op == op_end)
+            return false;
+        *(*op)++ = 255;
+    }
+    if (*op == op_end)
+        return false;
+    *(*op)++ = len;
+    return true;
+}
+
+static bool lz_put_sequence(uint8_t **op, const uint8_t *op_end, const uint8_t *lit, size_t n_lit, size_t offset,
+                            size_t match_len) {
+    size_t m = match_len ? match_len - LZ_MIN_MATCH : 0;
+
+    if (*op == op_end)
+        return false;
+    *(*op)++ = (std::min<size_t>(n_lit, 15) << 4) | std::min<size_t>(m, 15);
+    if (n_lit >= 15 && !lz_put_length(op, op_end, n_lit - 15))
+        return false;
+
+    if ((size_t)(op_end - *op) < n_lit)
+        return false;
+    memcpy(*op, lit, n_lit);
+    *op += n_lit;
+
+    if (!match_len)
+        return true;
+
+    if (op_end - *op < 2)
+        return false;
+    *(*op)++ = offset;
+    *(*op)++ = offset >> 8;
+    return m < 15 || lz_put_length(op, op_end, m - 15);
+}
+
+/* Returns the compressed size, or 0 when it would not fit in cap bytes */
+static size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    uint32_t table[1 << LZ_HASH_LOG2];  // position + 1 of the last occurrence, 0 if none
+    memset(table, 0, sizeof table);
+
+    uint8_t *      op     = dst;
+    const uint8_t *op_end = dst + cap;
+    size_t         ip     = 0;
+    size_t         anchor = 0;
+
+    while (ip + LZ_MIN_MATCH <= n) {
+        uint32_t seq = lz_load32(src + ip);
+        uint32_t h   = lz_hash(seq);
+        size_t   ref = table[h];
+        table[h]     = ip + 1;
+
+        if (!ref || ip - (ref - 1) > LZ_MAX_OFFSET || lz_load32(src + ref - 1) != seq) {
+            ++ip;
+            continue;
+        }
+
+        --ref;
+        size_t len = LZ_MIN_MATCH;
+        while (ip + len < n && src[ref + len] == src[ip + len]) ++len;
+
+        if (!lz_put_sequence(&op, op_end, src + anchor, ip - anchor, ip - ref, len))
+            return 0;
+        ip += len;
+        anchor = ip;
+    }
+
+    if (!lz_put_sequence(&op, op_end, src + anchor, n - anchor, 0, 0))
+        return 0;
+
+    return op - dst;
+}
+
+static bool lz_get_length(const uint8_t **ip, const uint8_t *ip_end, size_t *len) {
+    uint8_t b;
+    do {
+        if (*ip == ip_end)
+            return false;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+/* Returns false if src is not a valid block expanding to exactly n bytes */
+static bool lz_decompress(const uint8_t *src, size_t src_size, uint8_t *dst, size_t n) {
+    const uint8_t *ip     = src;
+    const uint8_t *ip_end = src + src_size;
+    uint8_t *      op     = dst;
+    uint8_t *      op_end = dst + n;
+
+    while (ip < ip_end) {
+        uint8_t token = *ip++;
+        size_t  n_lit = token >> 4;
+        if (n_lit == 15 && !lz_get_length(&ip, ip_end, &n_lit))
+            return false;
+        if ((size_t)(ip_end - ip) < n_lit || (size_t)(op_end - op) < n_lit)
+            return false;
+        memcpy(op, ip, n_lit);
+        ip += n_lit;
+        op += n_lit;
+
+        if (ip == ip_end)
+            break;
+
+        if (ip_end - ip < 2)
+            return false;
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        size_t len = token & 15;
+        if (len == 15 && !lz_get_length(&ip, ip_end, &len))
+            return false;
+        len += LZ_MIN_MATCH;
+        if (offset == 0 || (size_t)(op - dst) < offset || (size_t)(op_end - op) < len)
+            return false;
+
+        const uint8_t *match = op - offset;
+        while (len--) *op++ = *match++;  // may overlap
+    }
+
+    return op == op_end;
+}
+
+/* State of a page of a memory saved in the background */
+enum {
+    JOB_PAGE_PENDING,  // in memory, not looked at yet
+    JOB_PAGE_SAVING,   // being compressed by the writer, stores must wait
+    JOB_PAGE_COPYING,  // being copied before a store, the writer must wait
+    JOB_PAGE_COPIED,   // the writer takes the copy
+    JOB_PAGE_DONE,     // saved, or not to be saved
+};
+
+struct CheckpointJob {
+    const uint8_t *        base;
+    size_t                 size;
+    std::string            file, chain, parent;
+    bool                   compress;
+    std::vector<uint32_t>  dirty;  // empty for a full image
+    std::vector<uint8_t>   state;  // JOB_PAGE_*, accessed atomically
+    std::vector<uint8_t *> copies;
+    std::thread            writer;
+    bool                   done;
+};
+
+/* Returns the contents of a page as it was when the job started */
+static const uint8_t *job_page_acquire(CheckpointJob *job, uint64_t pg) {
+    uint8_t st = JOB_PAGE_PENDING;
+
+    if (__atomic_compare_exchange_n(&job->state[pg], &st, JOB_PAGE_SAVING, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+        return job->base + pg * CKPT_PAGE_SIZE;
+
+    while (__atomic_load_n(&job->state[pg], __ATOMIC_ACQUIRE) != JOB_PAGE_COPIED) std::this_thread::yield();
+    return job->copies[pg];
+}
+
+static void job_page_release(CheckpointJob *job, uint64_t pg) {
+    free(job->copies[pg]);
+    job->copies[pg] = NULL;
+    __atomic_store_n(&job->state[pg], JOB_PAGE_DONE, __ATOMIC_RELEASE);
+}
+
+/* Compresses the pages of a batch assigned to one thread.  A page
+ * without payload is not stored, unless it is flagged CKPT_PAGE_ZERO. */
+static void compress_pages(const uint8_t *base, size_t size, const uint32_t *dirty, CheckpointJob *job, uint64_t first, size_t n,
+                           size_t thread, size_t n_threads, bool compress, uint8_t *out, uint32_t *sizes, uint32_t *flags) {
+    for (size_t i = thread; i < n; i += n_threads) {
+        uint64_t pg   = first + i;
+        size_t   off  = pg * CKPT_PAGE_SIZE;
+        size_t   len  = std::min<size_t>(CKPT_PAGE_SIZE, size - off);
+        uint8_t *slot = out + i * CKPT_PAGE_SIZE;
+
+        sizes[i] = 0;
+        flags[i] = 0;
+        if (dirty && !(dirty[pg / 32] >> (pg % 32) & 1))
+            continue;
+
+        const uint8_t *page = job ? job_page_acquire(job, pg) : base + off;
+
+        if (page_is_zero(page, len)) {
+            if (dirty)
+                flags[i] = CKPT_PAGE_ZERO;
+        } else {
+            size_t c = compress ? lz_compress(page, len, slot, len - 1) : 0;
+            if (c) {
+                sizes[i] = c;
+                flags[i] = CKPT_PAGE_LZ;
+            } else {
+                memcpy(slot, page, len);
+                sizes[i] = len;
+            }
+        }
+
+        if (job)
+            job_page_release(job, pg);
+    }
+}
+
+/* The header and the index are stored little endian whatever the host.
+ * Their fields are naturally aligned, so the structs are the file layout */
+static_assert(sizeof(CheckpointHeader) == 48 && sizeof(CheckpointPage) == 24, "checkpoint structs must not be padded");
+
+static CheckpointHeader header_to_le(const CheckpointHeader &h) {
+    CheckpointHeader le = h;
+    put_le32((uint8_t *)&le.version, h.version);
+    put_le32((uint8_t *)&le.page_size, h.page_size);
+    put_le64((uint8_t *)&le.mem_size, h.mem_size);
+    put_le64((uint8_t *)&le.n_pages, h.n_pages);
+    put_le64((uint8_t *)&le.index_offset, h.index_offset);
+    put_le32((uint8_t *)&le.flags, h.flags);
+    put_le32((uint8_t *)&le.reserved, h.reserved);
+    return le;
+}
+
+static CheckpointHeader header_from_le(const CheckpointHeader &le) {
+    CheckpointHeader h = le;
+    h.version      = get_le32((const uint8_t *)&le.version);
+    h.page_size    = get_le32((const uint8_t *)&le.page_size);
+    h.mem_size     = get_le64((const uint8_t *)&le.mem_size);
+    h.n_pages      = get_le64((const uint8_t *)&le.n_pages);
+    h.index_offset = get_le64((const uint8_t *)&le.index_offset);
+    h.flags        = get_le32((const uint8_t *)&le.flags);
+    h.reserved     = get_le32((const uint8_t *)&le.reserved);
+    return h;
+}
+
+static CheckpointPage page_to_le(const CheckpointPage &p) {
+    CheckpointPage le;
+    put_le64((uint8_t *)&le.page, p.page);
+    put_le64((uint8_t *)&le.offset, p.offset);
+    put_le32((uint8_t *)&le.size, p.size);
+    put_le32((uint8_t *)&le.flags, p.flags);
+    return le;
+}
+
+static CheckpointPage page_from_le(const CheckpointPage &le) {
+    CheckpointPage p;
+    p.page   = get_le64((const uint8_t *)&le.page);
+    p.offset = get_le64((const uint8_t *)&le.offset);
+    p.size   = get_le32((const uint8_t *)&le.size);
+    p.flags  = get_le32((const uint8_t *)&le.flags);
+    return p;
+}
+
+static void write_padding(FILE *f, uint64_t *offset, size_t align, const char *file) {
+    static const uint8_t zeros[CKPT_PAGE_SIZE] = {0};
+    size_t               pad                   = -*offset & (align - 1);
+
+    if (pad && fwrite(zeros, pad, 1, f) != 1)
+        err(-3, "while writing %s", file);
+    *offset += pad;
+}
+
+static void save_memory(const uint8_t *base, size_t size, const char *file, const uint32_t *dirty, CheckpointJob *job,
+                        size_t n_threads, bool compress) {
+    /* A file being replaced may still be mapped by a run that loaded it,
+     * so the new one is written aside and renamed over it */
+    size_t n        = strlen(file) + 8;
+    char * tmp_name = (char *)alloca(n);
+    snprintf(tmp_name, n, "%s.tmp", file);
+
+    FILE *f = fopen(tmp_name, "wb");
+    if (!f)
+        err(-3, "trying to write %s", tmp_name);
+
+    CheckpointHeader hdr;
+    memset(&hdr, 0, sizeof hdr);
+    memcpy(hdr.magic, CKPT_MAGIC, sizeof hdr.magic);
+    hdr.version   = CKPT_VERSION;
+    hdr.page_size = CKPT_PAGE_SIZE;
+    hdr.mem_size  = size;
+    hdr.flags     = dirty ? CKPT_DELTA : 0;
+
+    CheckpointHeader hdr_le = header_to_le(hdr);
+    if (fwrite(&hdr_le, sizeof hdr_le, 1, f) != 1)
+        err(-3, "while writing %s", tmp_name);
+
+    uint64_t n_total = (size + CKPT_PAGE_SIZE - 1) / CKPT_PAGE_SIZE;
+    uint64_t offset  = sizeof hdr;
+
+    std::vector<uint8_t>        out(CKPT_BATCH_PAGES * CKPT_PAGE_SIZE);
+    std::vector<uint32_t>       sizes(CKPT_BATCH_PAGES);
+    std::vector<uint32_t>       flags(CKPT_BATCH_PAGES);
+    std::vector<CheckpointPage> index;
+
+    for (uint64_t first = 0; first < n_total; first += CKPT_BATCH_PAGES) {
+        size_t n = std::min<uint64_t>(CKPT_BATCH_PAGES, n_total - first);
+        size_t t = std::min<size_t>(n_threads, n);
+
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < t; ++i)
+            threads.emplace_back(compress_pages,
+                                 base,
+                                 size,
+                                 dirty,
+                                 job,
+                                 first,
+                                 n,
+                                 i,
+                                 t,
+                                 compress,
+                                 out.data(),
+                                 sizes.data(),
+                                 flags.data());
+        compress_pages(base, size, dirty, job, first, n, 0, t, compress, out.data(), sizes.data(), flags.data());
+        for (auto &th : threads) th.join();
+
+        for (size_t i = 0; i < n; ++i) {
+            if (!sizes[i] && !(flags[i] & CKPT_PAGE_ZERO))
+                continue;
+
+            // Raw pages are aligned so that they can be mapped when loaded
+            if (sizes[i] && !(flags[i] & CKPT_PAGE_LZ))
+                write_padding(f, &offset, CKPT_PAGE_SIZE, tmp_name);
+
+            if (sizes[i] && fwrite(&out[i * CKPT_PAGE_SIZE], sizes[i], 1, f) != 1)
+                err(-3, "while writing %s", tmp_name);
+
+            CheckpointPage p = {first + i, offset, sizes[i], flags[i]};
+            index.push_back(page_to_le(p));
+            offset += sizes[i];
+        }
+    }
+
+    write_padding(f, &offset, sizeof(uint64_t), tmp_name);
+    hdr.n_pages      = index.size();
+    hdr.index_offset = offset;
+    hdr_le           = header_to_le(hdr);
+
+    if ((!index.empty() && fwrite(index.data(), sizeof index[0], index.size(), f) != index.size())
+        || fseek(f, 0, SEEK_SET) || fwrite(&hdr_le, sizeof hdr_le, 1, f) != 1 || fclose(f))
+        err(-3, "while writing %s", tmp_name);
+
+    if (rename(tmp_name, file))
+        err(-3, "renaming %s to %s", tmp_name, file);
+}
+
+void checkpoint_save_memory(const void *base, size_t size, const char *file, const uint32_t *dirty, bool compress) {
+    save_memory((const uint8_t *)base,
+                size,
+                file,
+                dirty,
+                NULL,
+                std::max(1U, std::thread::hardware_concurrency()),
+                compress);
+}
+
+/* A single writer, so that the simulation keeps the other host cores */
+static void job_write(CheckpointJob *job) {
+    save_memory(job->base, job->size, job->file.c_str(), job->dirty.empty() ? NULL : job->dirty.data(), job, 1, job->compress);
+
+    if (!job->chain.empty())
+        checkpoint_save_chain(job->chain.c_str(), job->parent.empty() ? NULL : job->parent.c_str(), job->file.c_str());
+
+    __atomic_store_n(&job->done, true, __ATOMIC_RELEASE);
+}
+
+CheckpointJob *checkpoint_save_background(const void *base, size_t size, const char *file, const uint32_t *dirty, bool compress,
+                                          const char *chain, const char *parent) {
+    CheckpointJob *job = new CheckpointJob;
+    uint64_t       n   = (size + CKPT_PAGE_SIZE - 1) / CKPT_PAGE_SIZE;
+
+    job->base     = (const uint8_t *)base;
+    job->size     = size;
+    job->file     = file;
+    job->chain    = chain ? chain : "";
+    job->parent   = parent ? parent : "";
+    job->compress = compress;
+    job->done     = false;
+    job->state.assign(n, JOB_PAGE_PENDING);
+    job->copies.assign(n, NULL);
+
+    /* The bitmap gets reused by the next checkpoint, and the pages out of
+     * the delta are left as they are */
+    if (dirty) {
+        job->dirty.assign(dirty, dirty + (n + 31) / 32);
+        for (uint64_t pg = 0; pg < n; ++pg)
+            if (!(dirty[pg / 32] >> (pg % 32) & 1))
+                job->state[pg] = JOB_PAGE_DONE;
+    }
+
+    job->writer = std::thread(job_write, job);
+    return job;
+}
+
+void checkpoint_job_preserve(CheckpointJob *job, uint64_t page) {
+    for (;;) {
+        uint8_t st = __atomic_load_n(&job->state[page], __ATOMIC_ACQUIRE);
+
+        if (st == JOB_PAGE_DONE || st == JOB_PAGE_COPIED)
+            return;
+
+        if (st == JOB_PAGE_PENDING
+            && __atomic_compare_exchange_n(&job->state[page], &st, JOB_PAGE_COPYING, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            size_t off = page * CKPT_PAGE_SIZE;
+            size_t len = std::min<size_t>(CKPT_PAGE_SIZE, job->size - off);
+
+            job->copies[page] = (uint8_t *)malloc(len);
+            if (!job->copies[page])
+                err(-3, "saving %s", job->file.c_str());
+            memcpy(job->copies[page], job->base + off, len);
+            __atomic_store_n(&job->state[page], JOB_PAGE_COPIED, __ATOMIC_RELEASE);
+            return;
+        }
+
+        // Another thread has the page, for as long as one page takes
+        std::this_thread::yield();
+    }
+}
+
+bool checkpoint_job_done(CheckpointJob *job) { return __atomic_load_n(&job->done, __ATOMIC_ACQUIRE); }
+
+void checkpoint_job_wait(CheckpointJob *job) {
+    job->writer.join();
+    delete job;
+}
+
+/* Backs [addr, addr + len) with a private copy-on-write mapping of the file
+ * at offset, or with fresh zero pages when fd is -1 */
+static bool map_pages(uint8_t *addr, size_t len, int fd, uint64_t offset) {
+    int   flags = MAP_PRIVATE | MAP_FIXED | (fd < 0 ? MAP_ANONYMOUS | MAP_NORESERVE : 0);
+    void *p     = mmap(addr, len, PROT_READ | PROT_WRITE, flags, fd, fd < 0 ? 0 : offset);
+
+    return p != MAP_FAILED;
+}
+
+/* Dumps from before the container are the raw memory image */
+static void load_raw_memory(int fd, void *base, size_t size, size_t file_size, bool can_map, const char *file) {
+    if (can_map && file_size == size && size % CKPT_PAGE_SIZE == 0 && map_pages((uint8_t *)base, size, fd, 0))
+        return;
+
+    size_t sz = read(fd, base, size);
+
+    if (sz != size)
+        err(-3, "%s %zd size does not match memory size %zd", file, sz, size);
+}
+
+/* Loads a memory image.  A full one replaces the memory, a delta only
+ * replaces the pages it holds, and is only accepted in a chain. */
+static void load_image(void *base, size_t size, const char *file, bool in_chain, bool first) {
+    int fd = open(file, O_RDONLY);
+    if (fd < 0)
+        err(-3, "trying to read %s", file);
+
+    struct stat st;
+    if (fstat(fd, &st))
+        err(-3, "trying to read %s", file);
+
+    /* Pages of the file can replace the ones of the memory when both are
+     * aligned on host pages */
+    bool can_map = sysconf(_SC_PAGESIZE) == CKPT_PAGE_SIZE && (uintptr_t)base % CKPT_PAGE_SIZE == 0;
+
+    CheckpointHeader hdr;
+    size_t           hdr_v1 = offsetof(CheckpointHeader, flags);
+    memset(&hdr, 0, sizeof hdr);
+    if ((size_t)st.st_size < hdr_v1 || pread(fd, &hdr, sizeof hdr, 0) < (ssize_t)hdr_v1
+        || memcmp(hdr.magic, CKPT_MAGIC, sizeof hdr.magic)) {
+        if (in_chain && !first)
+            errx(-3, "%s: only the first image of a chain can be a raw dump", file);
+        load_raw_memory(fd, base, size, st.st_size, can_map, file);
+        close(fd);
+        return;
+    }
+
+    hdr = header_from_le(hdr);
+    if (hdr.version == 1)
+        hdr.flags = 0;
+    else if (hdr.version != CKPT_VERSION)
+        errx(-3, "%s: unsupported checkpoint version %u", file, hdr.version);
+    if (hdr.page_size != CKPT_PAGE_SIZE)
+        errx(-3, "%s: unsupported checkpoint page size %u", file, hdr.page_size);
+    if (hdr.mem_size != size)
+        errx(-3, "%s %" PRIu64 " size does not match memory size %zd", file, hdr.mem_size, size);
+    if (hdr.index_offset > (uint64_t)st.st_size
+        || hdr.n_pages > ((uint64_t)st.st_size - hdr.index_offset) / sizeof(CheckpointPage))
+        errx(-3, "%s: truncated checkpoint", file);
+
+    bool delta = hdr.flags & CKPT_DELTA;
+    if (delta && !in_chain)
+        errx(-3, "%s: incremental checkpoint, load it through its chain", file);
+    if (delta == first)
+        errx(-3, "%s: a chain starts with a full image followed by deltas", file);
+
+    const uint8_t *map = (const uint8_t *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        err(-3, "trying to map %s", file);
+
+    const CheckpointPage *index   = (const CheckpointPage *)(map + hdr.index_offset);
+    uint8_t *             mem     = (uint8_t *)base;
+    uint64_t              n_total = (size + CKPT_PAGE_SIZE - 1) / CKPT_PAGE_SIZE;
+    uint64_t              n_full  = size / CKPT_PAGE_SIZE;
+    uint64_t              next    = 0;  // first page not restored yet
+
+    // Start from zero pages without touching them, except for a partial last page
+    bool zeroed = !delta && can_map && map_pages(mem, n_full * CKPT_PAGE_SIZE, -1, 0);
+
+    // Run of raw pages that are contiguous in both the file and the memory
+    uint64_t run_page = 0, run_offset = 0, run_len = 0;
+
+    for (uint64_t i = 0; i <= hdr.n_pages; ++i) {
+        CheckpointPage entry;
+        if (i < hdr.n_pages)
+            entry = page_from_le(index[i]);
+        uint64_t page = i < hdr.n_pages ? entry.page : n_total;
+
+        if (page < next || page > n_total || (page == n_total && i < hdr.n_pages))
+            errx(-3, "%s: corrupted page index", file);
+
+        // The pages a full image skips are zeros, the ones a delta skips are kept
+        for (; next < page && !delta; ++next) {
+            size_t len = std::min<size_t>(CKPT_PAGE_SIZE, size - next * CKPT_PAGE_SIZE);
+            if ((!zeroed || next == n_full) && !page_is_zero(mem + next * CKPT_PAGE_SIZE, len))
+                memset(mem + next * CKPT_PAGE_SIZE, 0, len);
+        }
+
+        const CheckpointPage *p      = i < hdr.n_pages ? &entry : NULL;
+        size_t                len    = p ? std::min<size_t>(CKPT_PAGE_SIZE, size - page * CKPT_PAGE_SIZE) : 0;
+        bool                  mapped = p && can_map && !(p->flags & (CKPT_PAGE_LZ | CKPT_PAGE_ZERO))
+                      && len == CKPT_PAGE_SIZE && p->offset % CKPT_PAGE_SIZE == 0;
+
+        if (run_len && (!mapped || page != run_page + run_len || p->offset != run_offset + run_len * CKPT_PAGE_SIZE)) {
+            uint8_t *addr = mem + run_page * CKPT_PAGE_SIZE;
+            if (!map_pages(addr, run_len * CKPT_PAGE_SIZE, fd, run_offset))
+                memcpy(addr, map + run_offset, run_len * CKPT_PAGE_SIZE);
+            run_len = 0;
+        }
+
+        if (!p)
+            break;
+
+        if (p->offset > hdr.index_offset || p->size > hdr.index_offset - p->offset)
+            errx(-3, "%s: corrupted page index", file);
+
+        uint8_t *dst = mem + page * CKPT_PAGE_SIZE;
+        bool     ok  = true;
+        if (p->flags & CKPT_PAGE_ZERO) {
+            ok = delta && p->size == 0;
+            if (ok && !(len == CKPT_PAGE_SIZE && can_map && map_pages(dst, len, -1, 0)))
+                memset(dst, 0, len);
+        } else if (p->flags & CKPT_PAGE_LZ) {
+            ok = lz_decompress(map + p->offset, p->size, dst, len);
+        } else if (p->size != len) {
+            ok = false;
+        } else if (mapped) {
+            if (!run_len) {
+                run_page   = page;
+                run_offset = p->offset;
+            }
+            ++run_len;
+        } else {
+            memcpy(dst, map + p->offset, len);
+        }
+        if (!ok)
+            errx(-3, "%s: corrupted page %" PRIu64, file, page);
+
+        next = page + 1;
+    }
+
+    munmap((void *)map, st.st_size);
+    close(fd);
+}
+
+void checkpoint_load_memory(void *base, size_t size, const char *file) { load_image(base, size, file, false, true); }
+
+static std::string dir_name(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash ? std::string(path, slash + 1 - path) : std::string();
+}
+
+static const char *base_name(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+/* The images of a chain, in loading order, as named in its manifest */
+static std::vector<std::string> read_chain(const char *chain) {
+    std::vector<std::string> images;
+
+    FILE *f = fopen(chain, "r");
+    if (!f)
+        return images;
+
+    char line[4096];
+    while (fgets(line, sizeof line, f)) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] && line[0] != '#')
+            images.push_back(line);
+    }
+    fclose(f);
+
+    return images;
+}
+
+bool checkpoint_chain_can_extend(const char *parent, const char *image) {
+    if (dir_name(parent) != dir_name(image))
+        return false;
+
+    std::vector<std::string> images = read_chain(parent);
+    if (images.empty())
+        return false;
+
+    return std::find(images.begin(), images.end(), base_name(image)) == images.end();
+}
+
+void checkpoint_save_chain(const char *chain, const char *parent, const char *image) {
+    std::vector<std::string> images;
+    if (parent)
+        images = read_chain(parent);
+    images.push_back(base_name(image));
+
+    size_t n        = strlen(chain) + 8;
+    char * tmp_name = (char *)alloca(n);
+    snprintf(tmp_name, n, "%s.tmp", chain);
+
+    FILE *f = fopen(tmp_name, "w");
+    if (!f)
+        err(-3, "trying to write %s", tmp_name);
+
+    fprintf(f, "# DROMAJO checkpoint chain, full image first\n");
+    for (auto &i : images) fprintf(f, "%s\n", i.c_str());
+
+    if (fclose(f) || rename(tmp_name, chain))
+        err(-3, "while writing %s", chain);
+}
+
+void checkpoint_load_chain(void *base, size_t size, const char *chain) {
+    std::vector<std::string> images = read_chain(chain);
+    if (images.empty())
+        errx(-3, "%s: empty or unreadable checkpoint chain", chain);
+
+    std::string dir = dir_name(chain);
+    for (size_t i = 0; i < images.size(); ++i) load_image(base, size, (dir + images[i]).c_str(), true, i == 0);
+}
@@ -33,7 +33,12 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
 #include "LiveCacheCore.h"
 #include "cutils.h"
@@ -50,11 +55,22 @@
 FILE *simpoint_bb_file = nullptr;
 int   simpoint_roi     = 0;  // start without ROI enabled
 
-int simpoint_step(RISCVMachine *m, int hartid) {
+static uint64_t ninst = 0;  // ninst in BB
+
+/* Instructions that can run back to back before the next simpoint needs
+ * to be looked at.  Basic block profiling observes every instruction. */
+static uint64_t simpoint_budget(RISCVMachine *m) {
+    if (simpoint_bb_file || m->common.simpoint_next >= m->common.simpoints.size())
+        return 1;
+
+    auto &sp = m->common.simpoints[m->common.simpoint_next];
+    return sp.start > ninst ? sp.start - ninst : 1;
+}
+
+int simpoint_step(RISCVMachine *m, int hartid, uint64_t n_insns) {
     assert(hartid == 0);  // Only single core for simpoint creation
 
-    static uint64_t ninst = 0;  // ninst in BB
-    ninst++;
+    ninst += n_insns;
 
     if (simpoint_bb_file == 0) {  // Creating checkpoints mode
 
@@ -122,9 +138,10 @@ int simpoint_step(RISCVMachine *m, int hartid) {
 #endif
 
 int iterate_core(RISCVMachine *m, int hartid) {
-    if (m->common.maxinsns-- <= 0)
+    if (m->common.maxinsns == 0)
         /* Succeed after N instructions without failure. */
         return 0;
+    --m->common.maxinsns;
 
     RISCVCPUState *cpu = m->cpu_state[hartid];
 
@@ -136,8 +153,14 @@ int iterate_core(RISCVMachine *m, int hartid) {
     uint32_t insn_raw = -1;
     (void)riscv_read_insn(cpu, &insn_raw, last_pc);
     int keep_going = virt_machine_run(m, hartid);
-    if (last_pc == virt_machine_get_pc(m, hartid))
-        return 0;
+    if (last_pc == virt_machine_get_pc(m, hartid)) {
+        /* Not a self loop, the hart is stalled in WFI and retired nothing */
+        if (!m->common.idle_skip || !riscv_cpu_get_power_down(cpu))
+            return 0;
+        if (m->common.trace)
+            --m->common.trace;
+        return keep_going;
+    }
 
     if (m->common.trace) {
         --m->common.trace;
@@ -169,6 +192,178 @@ int iterate_core(RISCVMachine *m, int hartid) {
     return keep_going;
 }
 
+/* Fast mode: run hartid for a whole quantum, falling back to
+ * iterate_core() when every instruction has to be observed, that is
+ * once the trace is on or a simpoint boundary is close.  The scheduler
+ * is only asked for a quantum when the hart is not single stepped. */
+static int iterate_core_quantum(RISCVMachine *m, int hartid, uint64_t *n_steps) {
+    uint64_t n_insns = std::min(m->common.trace, m->common.maxinsns);
+#ifdef SIMPOINT_BB
+    if (simpoint_roi)
+        n_insns = std::min(n_insns, simpoint_budget(m));
+#endif
+
+    *n_steps = 1;
+    if (n_insns <= 1)
+        return iterate_core(m, hartid);
+
+    n_insns = std::min(n_insns, virt_machine_next_quantum(m, hartid));
+    if (n_insns <= 1)
+        return iterate_core(m, hartid);
+
+    uint64_t last_pc    = virt_machine_get_pc(m, hartid);
+    int      keep_going = virt_machine_run_quantum(m, hartid, n_insns, n_steps);
+
+    m->common.maxinsns -= std::min(*n_steps, m->common.maxinsns);
+    m->common.trace -= std::min(*n_steps, m->common.trace);
+
+    /* Let a single step decide if the hart is stuck in a self loop */
+    if (keep_going && last_pc == virt_machine_get_pc(m, hartid)) {
+        ++*n_steps;
+        return iterate_core(m, hartid);
+    }
+
+    return keep_going;
+}
+
+/* --idle_skip: while every hart is stalled in WFI, jump to the next
+ * event, usually a timer interrupt.  Each skipped cycle costs every hart a step of the
+ * instruction budgets, as if it had been single stepped. */
+static void iterate_idle(RISCVMachine *m) {
+    uint64_t budget = std::min(m->common.trace, m->common.maxinsns);
+#ifdef SIMPOINT_BB
+    if (simpoint_roi)
+        return;
+#endif
+
+    uint64_t n_cycles = virt_machine_idle_skip(m, budget / m->ncpus);
+
+    m->common.maxinsns -= n_cycles * m->ncpus;
+    m->common.trace -= std::min(n_cycles * m->ncpus, m->common.trace);
+}
+
+/* Periodic checkpoints, and the one being saved, are looked after
+ * between rounds of the harts */
+static inline bool checkpoint_due(RISCVMachine *m) {
+    return m->checkpoint_job || (m->common.checkpoint_every && m->common.maxinsns <= m->common.checkpoint_next);
+}
+
+/* Reusable barrier the threads of a parallel run meet at between quanta */
+class HartBarrier {
+  public:
+    explicit HartBarrier(int n) : n(n) {}
+
+    void wait() {
+        std::unique_lock<std::mutex> lock(mtx);
+        uint64_t                     g = gen;
+
+        if (++count == n) {
+            count = 0;
+            ++gen;
+            cv.notify_all();
+            return;
+        }
+        cv.wait(lock, [&] { return gen != g; });
+    }
+
+  private:
+    std::mutex              mtx;
+    std::condition_variable cv;
+    int                     n;
+    int                     count = 0;
+    uint64_t                gen   = 0;
+};
+
+struct ParallelRun {
+    RISCVMachine *        m;
+    HartBarrier           barrier;
+    bool                  stop;
+    std::vector<uint64_t> n_insns, last_pc, n_steps;
+    std::vector<int>      keep_going;
+
+    ParallelRun(RISCVMachine *m)
+        : m(m), barrier(m->ncpus), stop(false), n_insns(m->ncpus), last_pc(m->ncpus), n_steps(m->ncpus), keep_going(m->ncpus) {}
+};
+
+/* Pick the instructions every hart runs in the next parallel quantum.
+ * The remaining budgets are shared by all harts, the trace countdown
+ * included, so that none of them overshoots.  Returns false once they
+ * are too small to go on in parallel. */
+static bool parallel_quantum(ParallelRun *p) {
+    RISCVMachine *m      = p->m;
+    uint64_t      budget = std::min(m->common.trace, m->common.maxinsns) / m->ncpus;
+
+    for (int i = 0; i < m->ncpus; ++i) p->n_insns[i] = std::min(virt_machine_next_quantum(m, i), budget);
+
+    return budget > 1;
+}
+
+/* Everything shared by the harts is settled by hart 0 between quanta,
+ * while the others wait at the barrier: the instruction budgets, the
+ * self loop single steps of iterate_core_quantum(), and the filter of
+ * the LR/SC reservations. */
+static void parallel_sync(ParallelRun *p) {
+    RISCVMachine *m          = p->m;
+    int           keep_going = 0;
+
+    riscv_reservations_update_filter(m);
+    riscv_timebase_publish(m);
+
+    for (int i = 0; i < m->ncpus; ++i) {
+        m->common.maxinsns -= std::min(p->n_steps[i], m->common.maxinsns);
+        m->common.trace -= std::min(p->n_steps[i], m->common.trace);
+    }
+
+    for (int i = 0; i < m->ncpus; ++i) {
+        if (p->keep_going[i] && p->last_pc[i] == virt_machine_get_pc(m, i))
+            p->keep_going[i] = iterate_core(m, i);
+        keep_going |= p->keep_going[i];
+    }
+
+    if (keep_going && m->common.idle_skip)
+        iterate_idle(m);
+
+    if (keep_going && checkpoint_due(m))
+        virt_machine_checkpoint(m);
+
+    p->stop = !keep_going || !parallel_quantum(p);
+}
+
+static void iterate_hart_parallel(ParallelRun *p, int hartid) {
+    for (;;) {
+        p->barrier.wait();
+        if (p->stop)
+            return;
+
+        p->last_pc[hartid]    = virt_machine_get_pc(p->m, hartid);
+        p->keep_going[hartid] = virt_machine_run_quantum(p->m, hartid, p->n_insns[hartid], &p->n_steps[hartid]);
+
+        p->barrier.wait();
+        if (hartid == 0)
+            parallel_sync(p);
+    }
+}
+
+/* Run every hart on its own host thread, a quantum at a time, for as
+ * long as no hart is traced.  Returns 0 if the simulation is over,
+ * otherwise the harts continue being stepped in turn. */
+static int iterate_parallel(RISCVMachine *m) {
+    ParallelRun p(m);
+
+    if (!parallel_quantum(&p))
+        return 1;
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < m->ncpus; ++i) threads.emplace_back(iterate_hart_parallel, &p, i);
+    iterate_hart_parallel(&p, 0);
+    for (auto &t : threads) t.join();
+
+    for (int i = 0; i < m->ncpus; ++i)
+        if (p.keep_going[i])
+            return 1;
+    return 0;
+}
+
 static double execution_start_ts;
 static uint64_t *execution_progress_meassure;
 
@@ -207,21 +402,36 @@ int main(int argc, char **argv) {
     if (!m)
         return 1;
 
+    if (m->common.snapshot_load_name)
+        virt_machine_deserialize(m, m->common.snapshot_load_name);
+
     execution_start_ts = get_current_time_in_seconds();
     execution_progress_meassure = &m->cpu_state[0]->minstret;
     signal(SIGINT, sigintr_handler);
 
-    int keep_going;
-    do {
+    int keep_going = 1;
+    if (m->common.parallel)
+        keep_going = iterate_parallel(m);
+
+    while (keep_going) {
+        uint64_t n_steps = 1;
+
+        if (m->common.idle_skip)
+            iterate_idle(m);
+
         keep_going = 0;
-        for (int i = 0; i < m->ncpus; ++i) keep_going |= iterate_core(m, i);
+        for (int i = 0; i < m->ncpus; ++i)
+            keep_going |= m->common.quantum ? iterate_core_quantum(m, i, &n_steps) : iterate_core(m, i);
+
+        if (keep_going && checkpoint_due(m))
+            virt_machine_checkpoint(m);
 #ifdef SIMPOINT_BB
         if (simpoint_roi) {
-            if (!simpoint_step(m, 0))
+            if (!simpoint_step(m, 0, n_steps))
                 break;
         }
 #endif
-    } while (keep_going);
+    }
 
     double t = get_current_time_in_seconds();
 
@@ -236,6 +446,9 @@ int main(int argc, char **argv) {
     fprintf(dromajo_stderr, "Simulation speed: %5.2f MIPS (single-core)\n",
             1e-6 * *execution_progress_meassure / (t - execution_start_ts));
 
+    if (m->common.stats)
+        for (int i = 0; i < m->ncpus; ++i) riscv_cpu_print_stats(m->cpu_state[i]);
+
     fprintf(dromajo_stderr, "\nPower off.\n");
 
     virt_machine_end(m);
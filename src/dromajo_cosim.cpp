@@ -51,6 +51,10 @@ dromajo_cosim_state_t *dromajo_cosim_init(int argc, char *argv[]) {
     m->common.pending_interrupt = -1;
     m->common.pending_exception = -1;
 
+    // The harts restore themselves through the boot ROM, like RTL does
+    if (m->common.snapshot_load_name)
+        virt_machine_deserialize(m, m->common.snapshot_load_name);
+
     return (dromajo_cosim_state_t *)m;
 }
 
@@ -472,6 +476,8 @@ int dromajo_cosim_override_mem(dromajo_cosim_state_t *state, int hartid, uint64_
         return 0;
     } else if (pr->is_ram) {
         phys_mem_set_dirty_bit(pr, dut_paddr - pr->addr);
+        riscv_cpu_invalidate_decoded(s, dut_paddr, 1 << size_log2);
+        riscv_reservations_store(r, -1, dut_paddr);
         ptr = pr->phys_mem + (uintptr_t)(dut_paddr - pr->addr);
         switch (size_log2) {
             case 0: *(uint8_t *)ptr = dut_val; break;
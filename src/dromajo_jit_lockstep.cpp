@@ -0,0 +1,212 @@
+/*
+ * Lockstep check of the --jit translation against dromajo_cosim_step
+ *
+ * Copyright (C) 2018,2019, Esperanto Technologies Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * The same program runs on two machines: a reference one, stepped one
+ * instruction at a time with dromajo_cosim_step(), and one with --jit,
+ * run by riscv_cpu_interp64() up to the same instruction count in one
+ * go, so that it goes through the translated blocks.  The runs are of
+ * random lengths, up to --chunk instructions, and after each of them the
+ * pc, privilege, registers, the CSRs written by traps and the counters
+ * must be the same, as well as the RAM every --mem_every runs and at the
+ * end.
+ */
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include "dromajo.h"
+#include "dromajo_cosim.h"
+#include "riscv_machine.h"
+
+static void usage(const char *progname) {
+    fprintf(stderr,
+            "Usage: %s [--chunk N] [--seed N] [--mem_every N] $dromajoargs ...\n"
+            "  --chunk N      instructions per run of the --jit machine, at most (default 1000)\n"
+            "  --seed N       of the run lengths (default 1)\n"
+            "  --mem_every N  runs between RAM comparisons (default 1000)\n",
+            progname);
+    exit(EXIT_FAILURE);
+}
+
+static void quiet_log(int hartid, const char *fmt, ...) {}
+
+static void error_log(int hartid, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+}
+
+static int n_diffs;
+
+static void check(const char *what, uint64_t ref, uint64_t jit) {
+    if (ref == jit)
+        return;
+    fprintf(stderr, "  %-16s ref %016" PRIx64 " jit %016" PRIx64 "\n", what, ref, jit);
+    n_diffs++;
+}
+
+static void check_state(RISCVCPUState *r, RISCVCPUState *j) {
+    char name[16];
+
+    check("pc", r->pc, j->pc);
+    check("priv", r->priv, j->priv);
+    for (int i = 0; i < 32; i++) {
+        snprintf(name, sizeof name, "x%d", i);
+        check(name, r->reg[i], j->reg[i]);
+        snprintf(name, sizeof name, "x%d prior", i);
+        check(name, r->reg_prior[i], j->reg_prior[i]);
+#if FLEN > 0
+        snprintf(name, sizeof name, "f%d", i);
+        check(name, r->fp_reg[i], j->fp_reg[i]);
+#endif
+    }
+#if FLEN > 0
+    check("fflags", r->fflags, j->fflags);
+#endif
+    check("last_data_paddr", r->last_data_paddr, j->last_data_paddr);
+    check("insn_counter", r->insn_counter, j->insn_counter);
+    check("minstret", r->minstret, j->minstret);
+    check("mcycle", r->mcycle, j->mcycle);
+    check("mstatus", riscv_cpu_get_mstatus(r), riscv_cpu_get_mstatus(j));
+    check("mcause", r->mcause, j->mcause);
+    check("mepc", r->mepc, j->mepc);
+    check("mtval", r->mtval, j->mtval);
+    check("scause", r->scause, j->scause);
+    check("sepc", r->sepc, j->sepc);
+    check("stval", r->stval, j->stval);
+    check("mip", r->mip, j->mip);
+    check("load_res", r->load_res, j->load_res);
+    check("terminated", riscv_terminated(r), riscv_terminated(j));
+}
+
+/* Like htif_exit_requested() in dromajo_main.cpp, which cosim lacks, but
+ * reading tohost without going through the hart, whose state is compared */
+static bool htif_exit(RISCVMachine *m) {
+    if (!m->htif_tohost_addr || !m->htif_tohost_written)
+        return false;
+    m->htif_tohost_written = false;
+    PhysMemoryRange *pr    = get_phys_mem_range(m->mem_map, m->htif_tohost_addr);
+    uint32_t         tohost;
+    if (!pr || !pr->is_ram)
+        return false;
+    memcpy(&tohost, pr->phys_mem + (m->htif_tohost_addr - pr->addr), sizeof tohost);
+    return tohost & 1;
+}
+
+static void check_ram(RISCVMachine *r, RISCVMachine *j) {
+    for (int i = 0; i < r->mem_map->n_phys_mem_range; i++) {
+        PhysMemoryRange *rr = &r->mem_map->phys_mem_range[i];
+        PhysMemoryRange *jr = &j->mem_map->phys_mem_range[i];
+        if (!rr->is_ram)
+            continue;
+        for (uint64_t off = 0; off < rr->size; off += 8) {
+            uint64_t rv, jv;
+            memcpy(&rv, rr->phys_mem + off, sizeof rv);
+            memcpy(&jv, jr->phys_mem + off, sizeof jv);
+            if (rv != jv) {
+                char name[32];
+                snprintf(name, sizeof name, "mem %08" PRIx64, rr->addr + off);
+                check(name, rv, jv);
+                return;
+            }
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *progname  = argv[0];
+    long        chunk     = 1000;
+    long        mem_every = 1000;
+    uint64_t    seed      = 1;
+
+    dromajo_stdout = stdout;
+    dromajo_stderr = stderr;
+
+    while (argc > 2 && argv[1][0] == '-' && argv[1][1] == '-') {
+        if (strcmp(argv[1], "--chunk") == 0)
+            chunk = atol(argv[2]);
+        else if (strcmp(argv[1], "--seed") == 0)
+            seed = strtoull(argv[2], NULL, 0);
+        else if (strcmp(argv[1], "--mem_every") == 0)
+            mem_every = atol(argv[2]);
+        else
+            break;
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc < 2 || chunk <= 0 || mem_every <= 0)
+        usage(progname);
+
+    std::vector<char *> ref_args(argv, argv + argc), jit_args(argv, argv + argc);
+    ref_args[0] = jit_args[0] = (char *)progname;
+    jit_args.insert(jit_args.begin() + 1, (char *)"--jit");
+    ref_args.push_back(NULL);
+    jit_args.push_back(NULL);
+
+    dromajo_cosim_state_t *ref = dromajo_cosim_init(argc, ref_args.data());
+    dromajo_cosim_state_t *jit = dromajo_cosim_init(argc + 1, jit_args.data());
+    if (!ref || !jit)
+        usage(progname);
+    dromajo_install_new_loggers(ref, quiet_log, error_log);
+
+    RISCVMachine * rm = (RISCVMachine *)ref, *jm = (RISCVMachine *)jit;
+    RISCVCPUState *r = rm->cpu_state[0], *j = jm->cpu_state[0];
+    if (rm->ncpus != 1) {
+        fprintf(stderr, "%s: only single hart machines are supported\n", progname);
+        return EXIT_FAILURE;
+    }
+
+    uint64_t n_runs = 0;
+    bool     done   = false;
+    while (!done) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        long n = 1 + (long)(seed % chunk);
+
+        for (long i = 0; i < n && !done; i++) done = dromajo_cosim_step(ref, 0, 0, 0, 0, 0, false) != 0 || htif_exit(rm);
+
+        /* traps stop riscv_cpu_interp64() early, without counting */
+        for (int stuck = 0; j->insn_counter < r->insn_counter && !riscv_terminated(j); ) {
+            uint64_t before = j->insn_counter;
+            riscv_cpu_interp64(j, r->insn_counter - j->insn_counter);
+            stuck = j->insn_counter == before ? stuck + 1 : 0;
+            if (stuck > 100) {
+                fprintf(stderr, "%s: the --jit machine is stuck\n", progname);
+                break;
+            }
+        }
+
+        n_runs++;
+        check_state(r, j);
+        if (done || n_runs % mem_every == 0)
+            check_ram(rm, jm);
+        if (n_diffs) {
+            fprintf(stderr, "%s: differences after run %" PRIu64 " of %ld instructions\n", progname, n_runs, n);
+            return EXIT_FAILURE;
+        }
+    }
+
+    fprintf(stderr, "%s: %" PRIu64 " instructions in %" PRIu64 " runs, no difference\n", progname, r->insn_counter, n_runs);
+    dromajo_cosim_fini(ref);
+    dromajo_cosim_fini(jit);
+    return EXIT_SUCCESS;
+}
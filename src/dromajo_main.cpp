@@ -43,6 +43,7 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <net/if.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -63,6 +64,7 @@
 #include <sys/stat.h>
 
 #include <algorithm>
+#include <vector>
 
 #include "cutils.h"
 #include "iomem.h"
@@ -71,6 +73,7 @@
 #include "fs_utils.h"
 #include "fs_wget.h"
 #endif
+#include "riscv_jit.h"
 #include "riscv_machine.h"
 #ifdef CONFIG_SLIRP
 #include "slirp/libslirp.h"
@@ -287,6 +290,41 @@ static int bf_write_async(BlockDevice *bs, uint64_t sector_num, const uint8_t *b
     return ret;
 }
 
+/* The sectors written in snapshot mode, which the file does not hold */
+static void bf_save_state(BlockDevice *bs, FILE *f) {
+    BlockDeviceFile *bf = (BlockDeviceFile *)bs->opaque;
+    uint64_t         n  = 0;
+
+    for (int64_t i = 0; i < bf->nb_sectors; i++) n += bf->sector_table[i] != NULL;
+    device_state_put(f, &n, sizeof n);
+
+    for (uint64_t i = 0; i < (uint64_t)bf->nb_sectors; i++) {
+        if (bf->sector_table[i]) {
+            device_state_put(f, &i, sizeof i);
+            device_state_put(f, bf->sector_table[i], SECTOR_SIZE);
+        }
+    }
+}
+
+static BOOL bf_load_state(BlockDevice *bs, FILE *f) {
+    BlockDeviceFile *bf = (BlockDeviceFile *)bs->opaque;
+    uint64_t         n, sector_num;
+
+    if (!device_state_get(f, &n, sizeof n))
+        return FALSE;
+
+    while (n--) {
+        if (!device_state_get(f, &sector_num, sizeof sector_num) || sector_num >= (uint64_t)bf->nb_sectors)
+            return FALSE;
+        if (!bf->sector_table[sector_num])
+            bf->sector_table[sector_num] = (uint8_t *)malloc(SECTOR_SIZE);
+        if (!device_state_get(f, bf->sector_table[sector_num], SECTOR_SIZE))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
 static BlockDevice *block_device_init(const char *filename, BlockDeviceModeEnum mode) {
     const char *mode_str;
 
@@ -313,6 +351,8 @@ static BlockDevice *block_device_init(const char *filename, BlockDeviceModeEnum
 
     if (mode == BF_MODE_SNAPSHOT) {
         bf->sector_table = (uint8_t **)mallocz(sizeof(bf->sector_table[0]) * bf->nb_sectors);
+        bs->save_state   = bf_save_state;
+        bs->load_state   = bf_load_state;
     }
 
     bs->opaque           = bf;
@@ -488,25 +528,128 @@ static EthernetDevice *slirp_open(void) {
 
 #endif /* CONFIG_SLIRP */
 
-BOOL virt_machine_run(RISCVMachine *s, int hartid) {
-    (void)virt_machine_get_sleep_duration(s, hartid, MAX_SLEEP_TIME);
-
-    riscv_cpu_interp64(s->cpu_state[hartid], 1);
+/* Returns true once the benchmark has signaled its exit through HTIF.
+ * tohost is only read after a store to its page, the exit request then
+ * stays flagged so that every hart gets to see it. */
+static bool htif_exit_requested(RISCVMachine *s, int hartid) {
     RISCVCPUState *cpu = s->cpu_state[hartid];
-    if (s->htif_tohost_addr) {
+    if (s->htif_tohost_addr && __atomic_exchange_n(&s->htif_tohost_written, false, __ATOMIC_SEQ_CST)) {
         uint32_t tohost;
         bool     fail = true;
-        tohost        = riscv_phys_read_u32(s->cpu_state[hartid], s->htif_tohost_addr, &fail);
+        tohost        = riscv_phys_read_u32(cpu, s->htif_tohost_addr, &fail);
         if (!fail && tohost & 1) {
+            __atomic_store_n(&s->htif_tohost_written, true, __ATOMIC_SEQ_CST);
             if (tohost != 1)
                 cpu->benchmark_exit_code = tohost;
-            return false;
+            return true;
         }
     }
 
+    return false;
+}
+
+BOOL virt_machine_run(RISCVMachine *s, int hartid) {
+    (void)virt_machine_get_sleep_duration(s, hartid, MAX_SLEEP_TIME);
+
+    /* with --idle_skip a hart in WFI does not go on until woken up */
+    if (s->common.idle_skip && riscv_cpu_stalled(s->cpu_state[hartid]))
+        riscv_cpu_idle(s->cpu_state[hartid], 1);
+    else
+        riscv_cpu_interp64(s->cpu_state[hartid], 1);
+    if (htif_exit_requested(s, hartid))
+        return false;
+
     return !riscv_terminated(s->cpu_state[hartid]) && s->common.maxinsns > 0;
 }
 
+/* Like virt_machine_run(), but lets the interpreter run up to n_insns
+ * instructions before coming back.  Each call into the interpreter
+ * still ends on traps, xRET and WFI, and is cut short so that events
+ * run, and timer interrupts are posted, on the same instruction as when
+ * single stepping.  *n_steps is the number of single steps this amounts to. */
+BOOL virt_machine_run_quantum(RISCVMachine *s, int hartid, uint64_t n_insns, uint64_t *n_steps) {
+    RISCVCPUState *cpu   = s->cpu_state[hartid];
+    uint64_t       steps = 0;
+#ifdef SIMPOINT_BB
+    int roi = simpoint_roi;
+#endif
+
+    while (steps < n_insns) {
+        (void)virt_machine_get_sleep_duration(s, hartid, MAX_SLEEP_TIME);
+
+        uint64_t budget = std::min(n_insns - steps, virt_machine_get_event_budget(s, hartid));
+        if (s->common.idle_skip && riscv_cpu_stalled(cpu)) {
+            riscv_cpu_idle(cpu, budget);
+            steps += budget;
+            continue;
+        }
+
+        int n = riscv_cpu_interp64(cpu, (int)std::min(budget, (uint64_t)INT_MAX));
+
+        /* an interrupt or a faulting instruction still costs a step */
+        steps += n > 0 ? n : 1;
+
+        if (htif_exit_requested(s, hartid)) {
+            *n_steps = steps;
+            return false;
+        }
+        if (riscv_terminated(cpu))
+            break;
+#ifdef SIMPOINT_BB
+        /* the driver has to observe the ROI from its first instruction */
+        if (simpoint_roi != roi)
+            break;
+#endif
+    }
+
+    *n_steps = steps;
+    return !riscv_terminated(cpu) && s->common.maxinsns > steps;
+}
+
+/* splitmix64, so that a seed gives the same jitter on every host */
+static uint64_t sched_random(VirtMachine *m) {
+    uint64_t z = m->sched_seed += 0x9e3779b97f4a7c15ULL;
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Number of instructions hartid runs before the next hart gets its
+ * turn: its quantum, randomly shortened or stretched by up to
+ * quantum_jitter percent.  The harts take their turns in order, so
+ * logging this number makes the interleaving of a run reproducible,
+ * whatever the quanta and the seed were. */
+uint64_t virt_machine_next_quantum(RISCVMachine *s, int hartid) {
+    VirtMachine *m = &s->common;
+    uint64_t     n_insns;
+    int          logged_hartid;
+
+    if (m->sched_replay && fscanf(m->sched_replay, "%d %" SCNu64, &logged_hartid, &n_insns) == 2) {
+        if (logged_hartid != hartid) {
+            fprintf(dromajo_stderr, "error: hart %d is scheduled but the replayed schedule has hart %d\n", hartid, logged_hartid);
+            exit(1);
+        }
+    } else {
+        if (m->sched_replay) {
+            /* the recorded run ended here, go on with the quanta */
+            fclose(m->sched_replay);
+            m->sched_replay = NULL;
+        }
+
+        n_insns = m->hart_quantum[hartid];
+        if (m->quantum_jitter) {
+            uint64_t span = n_insns * m->quantum_jitter / 100;
+            n_insns       = std::max(n_insns - span + sched_random(m) % (2 * span + 1), (uint64_t)1);
+        }
+    }
+
+    if (m->sched_record)
+        fprintf(m->sched_record, "%d %" PRIu64 "\n", hartid, n_insns);
+
+    return n_insns;
+}
+
 void launch_alternate_executable(char **argv) {
     char        filename[1024];
     char        new_exename[64];
@@ -556,9 +699,22 @@ static void usage(const char *prog, const char *msg) {
             "       --load resumes a previously saved snapshot\n"
             "       --simpoint reads a simpoint file to create multiple checkpoints\n"
             "       --save saves a snapshot upon exit\n"
+            "       --save_uncompressed leaves the memory of --save uncompressed, so that --load maps it\n"
+            "       --save_incremental only saves the memory written since the last snapshot saved or loaded\n"
+            "       --checkpoint_every saves a snapshot every N instructions, named after --save (default checkpoint)\n"
+            "                          and the instructions run, its memory is written in the background\n"
             "       --maxinsns terminates execution after a number of instructions\n"
             "       --terminate-event name of the validate event to terminate execution\n"
             "       --trace start trace dump after a number of instructions. Trace disabled by default\n"
+            "       --quantum run each hart up to N instructions at a time while not tracing (default 0, single step)\n"
+            "                 N0,N1,... sets the quantum of every hart, the last one is used by the remaining harts\n"
+            "       --quantum_jitter randomly vary every quantum by up to a percentage of it\n"
+            "       --schedule_seed seed of the quantum jitter (default 0)\n"
+            "       --record_schedule log the quanta run by every hart to a file\n"
+            "       --replay_schedule run the quanta logged by --record_schedule\n"
+            "       --parallel run each hart on its own host thread, needs --quantum\n"
+            "       --stats print per-hart simulation statistics upon exit\n"
+            "       --idle_skip fast-forward to the next timer interrupt when every hart waits in WFI\n"
             "       --ignore_sbi_shutdown continue simulation even upon seeing the SBI_SHUTDOWN call\n"
             "       --dump_memories dump memories that could be used to load a cosimulation\n"
             "       --memory_size sets the memory size in MiB (default 256 MiB)\n"
@@ -573,7 +729,13 @@ static void usage(const char *prog, const char *msg) {
 #ifdef LIVECACHE
             "       --live_cache_size live cache warmup for checkpoint (default 8M)\n"
 #endif
-            "       --clear_ids clear mvendorid, marchid, mimpid for all cores\n",
+#ifdef JIT
+            "       --jit translate hot blocks to x86-64 code\n"
+#endif
+            "       --clear_ids clear mvendorid, marchid, mimpid for all cores\n"
+            "       --tlb_size TLB entries per translation context, a power of 2 (default %d)\n"
+            "       --l2_tlb_size second-level TLB entries, a power of 2 or 0 to disable (default %d)\n"
+            "       --asid_bits ASID bits implemented in satp, up to %d (default 0)\n",
             msg,
             CONFIG_VERSION,
             prog,
@@ -582,7 +744,10 @@ static void usage(const char *prog, const char *msg) {
             (long)PLIC_BASE_ADDR,
             (long)PLIC_SIZE,
             (long)CLINT_BASE_ADDR,
-            (long)CLINT_SIZE);
+            (long)CLINT_SIZE,
+            TLB_SIZE,
+            L2_TLB_SIZE,
+            ASID_BITS_MAX);
 
     exit(EXIT_FAILURE);
 }
@@ -612,11 +777,21 @@ RISCVMachine *virt_machine_main(int argc, char **argv) {
     const char *prog                     = argv[0];
     char *      snapshot_load_name       = 0;
     char *      snapshot_save_name       = 0;
+    bool        snapshot_uncompressed    = false;
+    bool        snapshot_incremental     = false;
+    uint64_t    checkpoint_every         = 0;
     const char *path                     = NULL;
     const char *cmdline                  = NULL;
     long        ncpus                    = 0;
     uint64_t    maxinsns                 = 0;
     uint64_t    trace                    = UINT64_MAX;
+    long        quantum_jitter           = -1;
+    uint64_t    schedule_seed            = 0;
+    const char *record_schedule          = 0;
+    const char *replay_schedule          = 0;
+    bool        parallel                 = false;
+    bool        stats                    = false;
+    bool        idle_skip                = false;
     long        memory_size_override     = 0;
     uint64_t    memory_addr_override     = 0;
     bool        ignore_sbi_shutdown      = false;
@@ -632,9 +807,16 @@ RISCVMachine *virt_machine_main(int argc, char **argv) {
     bool        custom_extension         = false;
     const char *simpoint_file            = 0;
     bool        clear_ids                = false;
+    long        tlb_size                 = 0;
+    long        l2_tlb_size              = -1;
+    long        asid_bits                = -1;
 #ifdef LIVECACHE
     uint64_t    live_cache_size          = 8*1024*1024;
 #endif
+#ifdef JIT
+    bool        jit                      = false;
+#endif
+    std::vector<uint64_t> quanta;
 
     dromajo_stdout = stdout;
     dromajo_stderr = stderr;
@@ -649,9 +831,20 @@ RISCVMachine *virt_machine_main(int argc, char **argv) {
             {"ncpus",                   required_argument, 0,  'n' }, // CFG
             {"load",                    required_argument, 0,  'l' },
             {"save",                    required_argument, 0,  's' },
+            {"save_uncompressed",             no_argument, 0,  'U' },
+            {"save_incremental",              no_argument, 0,  'K' },
+            {"checkpoint_every",        required_argument, 0,  'E' },
             {"simpoint",                required_argument, 0,  'S' },
             {"maxinsns",                required_argument, 0,  'm' }, // CFG
             {"trace   ",                required_argument, 0,  't' },
+            {"quantum",                 required_argument, 0,  'q' },
+            {"quantum_jitter",          required_argument, 0,  'J' },
+            {"schedule_seed",           required_argument, 0,  'e' },
+            {"record_schedule",         required_argument, 0,  'R' },
+            {"replay_schedule",         required_argument, 0,  'Y' },
+            {"parallel",                      no_argument, 0,  'j' },
+            {"stats",                         no_argument, 0,  'T' },
+            {"idle_skip",                     no_argument, 0,  'I' },
             {"ignore_sbi_shutdown",     required_argument, 0,  'P' }, // CFG
             {"dump_memories",                 no_argument, 0,  'D' }, // CFG
             {"memory_size",             required_argument, 0,  'M' }, // CFG
@@ -664,8 +857,14 @@ RISCVMachine *virt_machine_main(int argc, char **argv) {
             {"clint",                   required_argument, 0,  'C' }, // CFG
             {"custom_extension",              no_argument, 0,  'u' }, // CFG
             {"clear_ids",                     no_argument, 0,  'L' }, // CFG
+            {"tlb_size",                required_argument, 0,  'z' },
+            {"l2_tlb_size",             required_argument, 0,  'Z' },
+            {"asid_bits",               required_argument, 0,  'a' }, // CFG
 #ifdef LIVECACHE
             {"live_cache_size",         required_argument, 0,  'w' }, // CFG
+#endif
+#ifdef JIT
+            {"jit",                           no_argument, 0,  'x' },
 #endif
             {0,                         0,                 0,  0 }
         };
@@ -700,6 +899,26 @@ RISCVMachine *virt_machine_main(int argc, char **argv) {
                 snapshot_save_name = strdup(optarg);
                 break;
 
+            case 'U': snapshot_uncompressed = true; break;
+
+            case 'K': snapshot_incremental = true; break;
+
+            case 'E': {
+                if (checkpoint_every)
+                    usage(prog, "already had a checkpoint interval");
+                char *end;
+                checkpoint_every = strtoull(optarg, &end, 10);
+                if (*end == 'k' || *end == 'K')
+                    checkpoint_every *= 1000, ++end;
+                else if (*end == 'm' || *end == 'M')
+                    checkpoint_every *= 1000000, ++end;
+                else if (*end == 'g' || *end == 'G')
+                    checkpoint_every *= 1000000000, ++end;
+                if (end == optarg || *end != '\0' || !checkpoint_every)
+                    usage(prog, "checkpoint_every expects a number of instructions");
+                break;
+            }
+
             case 'S':
                 if (simpoint_file)
                     usage(prog, "already had a simpoint file");
@@ -727,6 +946,55 @@ RISCVMachine *virt_machine_main(int argc, char **argv) {
                 trace = (uint64_t)atoll(optarg);
                 break;
 
+            case 'q':
+                if (!quanta.empty())
+                    usage(prog, "already had a quantum");
+                for (const char *q = optarg;; ++q) {
+                    char *   end;
+                    uint64_t quantum = strtoull(q, &end, 10);
+                    if (*end == 'k' || *end == 'K')
+                        quantum *= 1000, ++end;
+                    else if (*end == 'm' || *end == 'M')
+                        quantum *= 1000000, ++end;
+                    if (end == q || (*end != ',' && *end != '\0'))
+                        usage(prog, "quantum expects N or a list N0,N1,...");
+                    quanta.push_back(quantum);
+                    q = end;
+                    if (*q == '\0')
+                        break;
+                }
+                if (quanta.size() > 1 && std::count(quanta.begin(), quanta.end(), 0))
+                    usage(prog, "harts can only single step all together");
+                break;
+
+            case 'J':
+                if (quantum_jitter >= 0)
+                    usage(prog, "already had a quantum_jitter");
+                quantum_jitter = atol(optarg);
+                if (quantum_jitter < 0 || quantum_jitter > 100)
+                    usage(prog, "quantum_jitter must be a percentage");
+                break;
+
+            case 'e': schedule_seed = strtoull(optarg, NULL, 0); break;
+
+            case 'R':
+                if (record_schedule)
+                    usage(prog, "already had a schedule to record");
+                record_schedule = optarg;
+                break;
+
+            case 'Y':
+                if (replay_schedule)
+                    usage(prog, "already had a schedule to replay");
+                replay_schedule = optarg;
+                break;
+
+            case 'j': parallel = true; break;
+
+            case 'T': stats = true; break;
+
+            case 'I': idle_skip = true; break;
+
             case 'P': ignore_sbi_shutdown = true; break;
 
             case 'D': dump_memories = true; break;
@@ -806,6 +1074,30 @@ RISCVMachine *virt_machine_main(int argc, char **argv) {
 
             case 'L': clear_ids = true; break;
 
+            case 'z':
+                if (tlb_size)
+                    usage(prog, "already had a tlb_size");
+                tlb_size = atol(optarg);
+                if (tlb_size <= 0)
+                    usage(prog, "tlb_size must be positive");
+                break;
+
+            case 'Z':
+                if (l2_tlb_size >= 0)
+                    usage(prog, "already had a l2_tlb_size");
+                l2_tlb_size = atol(optarg);
+                if (l2_tlb_size < 0)
+                    usage(prog, "l2_tlb_size must not be negative");
+                break;
+
+            case 'a':
+                if (asid_bits >= 0)
+                    usage(prog, "already had a asid_bits");
+                asid_bits = atol(optarg);
+                if (asid_bits < 0 || ASID_BITS_MAX < asid_bits)
+                    usage(prog, "asid_bits must be between 0 and 16");
+                break;
+
 #ifdef LIVECACHE
             case 'w':
                 if (live_cache_size)
@@ -823,6 +1115,10 @@ RISCVMachine *virt_machine_main(int argc, char **argv) {
                 break;
 #endif
 
+#ifdef JIT
+            case 'x': jit = true; break;
+#endif
+
             default: usage(prog, "I'm not having this argument");
         }
     }
@@ -835,6 +1131,20 @@ RISCVMachine *virt_machine_main(int argc, char **argv) {
     if (optind < argc)
         usage(prog, "too many arguments");
 
+    uint64_t quantum = quanta.empty() ? 0 : quanta[0];
+    if (parallel && !quantum)
+        usage(prog, "--parallel requires a --quantum");
+    if ((quantum_jitter > 0 || record_schedule || replay_schedule) && !quantum)
+        usage(prog, "scheduling the harts requires a --quantum");
+    if (parallel && (record_schedule || replay_schedule))
+        usage(prog, "--parallel runs cannot be recorded or replayed");
+#ifdef LIVECACHE
+    if (parallel)
+        usage(prog, "--parallel does not support the live cache");
+#endif
+    if (parallel && simpoint_file)
+        usage(prog, "--parallel does not support simpoints");
+
     assert(path);
     BlockDeviceModeEnum drive_mode = BF_MODE_SNAPSHOT;
     VirtMachineParams   p_s, *p = &p_s;
@@ -867,7 +1177,7 @@ RISCVMachine *virt_machine_main(int argc, char **argv) {
 
     if (ncpus)
         p->ncpus = ncpus;
-    if (p->ncpus >= MAX_CPUS)
+    if (p->ncpus > MAX_CPUS)
         usage(prog, "ncpus limit reached (MAX_CPUS).  Increase MAX_CPUS");
 
     if (p->ncpus == 0)
@@ -976,6 +1286,12 @@ RISCVMachine *virt_machine_main(int argc, char **argv) {
     // core modifications
     p->custom_extension = custom_extension;
     p->clear_ids        = clear_ids;
+    if (tlb_size)
+        p->tlb_size = tlb_size;
+    if (l2_tlb_size >= 0)
+        p->l2_tlb_size = l2_tlb_size;
+    if (asid_bits >= 0)
+        p->asid_bits = asid_bits;
 
     RISCVMachine *s = virt_machine_init(p);
     if (!s)
@@ -1028,6 +1344,36 @@ RISCVMachine *virt_machine_main(int argc, char **argv) {
 
     s->common.snapshot_save_name = snapshot_save_name;
     s->common.trace              = trace;
+    s->common.quantum            = quantum;
+    s->common.parallel           = parallel && s->ncpus > 1;
+    s->common.quantum_jitter     = quantum_jitter > 0 ? quantum_jitter : 0;
+    s->common.sched_seed         = schedule_seed;
+
+    if (quantum) {
+        s->common.hart_quantum = (uint64_t *)mallocz(s->ncpus * sizeof(uint64_t));
+        for (int i = 0; i < s->ncpus; ++i) s->common.hart_quantum[i] = quanta[std::min(i, (int)quanta.size() - 1)];
+    }
+
+    if (record_schedule) {
+        s->common.sched_record = fopen(record_schedule, "w");
+        if (!s->common.sched_record) {
+            perror(record_schedule);
+            exit(1);
+        }
+    }
+
+    if (replay_schedule) {
+        s->common.sched_replay = fopen(replay_schedule, "r");
+        if (!s->common.sched_replay) {
+            perror(replay_schedule);
+            exit(1);
+        }
+    }
+    s->common.stats              = stats;
+    s->common.idle_skip          = idle_skip;
+
+    s->common.snapshot_uncompressed = snapshot_uncompressed;
+    s->common.snapshot_incremental  = snapshot_incremental;
 
     // Allow the command option argument to overwrite the value
     // specified in the configuration file
@@ -1040,15 +1386,23 @@ RISCVMachine *virt_machine_main(int argc, char **argv) {
     if (s->common.maxinsns == 0)
         s->common.maxinsns = UINT64_MAX;
 
+    if (checkpoint_every < s->common.maxinsns) {
+        s->common.checkpoint_every = checkpoint_every;
+        s->common.checkpoint_start = s->common.maxinsns;
+        s->common.checkpoint_next  = s->common.maxinsns - checkpoint_every;
+    }
+
     for (int i = 0; i < s->ncpus; ++i) s->cpu_state[i]->ignore_sbi_shutdown = ignore_sbi_shutdown;
 
+#ifdef JIT
+    if (jit)
+        for (int i = 0; i < s->ncpus; ++i) riscv_jit_init(s->cpu_state[i]);
+#endif
+
     virt_machine_free_config(p);
 
     if (s->common.net)
         s->common.net->device_set_carrier(s->common.net, TRUE);
 
-    if (s->common.snapshot_load_name)
-        virt_machine_deserialize(s, s->common.snapshot_load_name);
-
     return s;
 }
@@ -16,6 +16,7 @@
 #include "dw_apb_uart.h"
 
 #include <assert.h>
+#include <stddef.h>
 #include <stdio.h>
 
 enum {
@@ -333,3 +334,18 @@ void dw_apb_uart_write(void *opaque, uint32_t offset, uint32_t val, int size_log
         default:; DEBUG("##ignored write\n"); break;
     }
 }
+
+/* Everything but the console and the IRQ line */
+void dw_apb_uart_save(void *opaque, FILE *f) {
+    DW_apb_uart_state *s     = (DW_apb_uart_state *)opaque;
+    size_t             start = offsetof(DW_apb_uart_state, rx_fifo);
+
+    device_state_put(f, (uint8_t *)s + start, sizeof *s - start);
+}
+
+BOOL dw_apb_uart_load(void *opaque, FILE *f) {
+    DW_apb_uart_state *s     = (DW_apb_uart_state *)opaque;
+    size_t             start = offsetof(DW_apb_uart_state, rx_fifo);
+
+    return device_state_get(f, (uint8_t *)s + start, sizeof *s - start);
+}
@@ -45,6 +45,7 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
 #include "cutils.h"
 #include "dromajo.h"
@@ -60,6 +61,7 @@ PhysMemoryMap *phys_mem_map_init(void) {
     s->free_ram       = default_free_ram;
     s->get_dirty_bits = default_get_dirty_bits;
     s->set_ram_addr   = default_set_addr;
+    s->index          = (PhysMemoryRange **)mallocz(sizeof(PhysMemoryRange *) << (PHYS_MEM_INDEX_LIMIT_LOG2 - PHYS_MEM_INDEX_SHIFT));
     return s;
 }
 
@@ -71,16 +73,82 @@ void phys_mem_map_end(PhysMemoryMap *s) {
         }
     }
 
+    free(s->index);
     free(s);
 }
 
-/* return NULL if not found */
-/* XXX: optimize */
-PhysMemoryRange *get_phys_mem_range(PhysMemoryMap *s, uint64_t paddr) {
-    for (int i = s->n_phys_mem_range - 1; i >= 0; --i) {
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Rebuild the segments and the granule index, must be called whenever
+ * a range is added, moved, enabled or disabled */
+static void phys_mem_map_update(PhysMemoryMap *s) {
+    uint64_t bound[2 * PHYS_MEM_RANGE_MAX];
+    int      n_bound = 0;
+
+    for (int i = 0; i < s->n_phys_mem_range; i++) {
         PhysMemoryRange *pr = &s->phys_mem_range[i];
-        if (paddr >= pr->addr && paddr < pr->addr + pr->size)
-            return pr;
+        if (pr->size != 0) {
+            bound[n_bound++] = pr->addr;
+            bound[n_bound++] = pr->addr + pr->size;
+        }
+    }
+    qsort(bound, n_bound, sizeof bound[0], cmp_u64);
+
+    /* Each elementary interval belongs to the last range covering it,
+     * as the old reverse linear scan did */
+    s->n_segment = 0;
+    for (int k = 0; k + 1 < n_bound; k++) {
+        PhysMemoryRange *pr = NULL;
+
+        if (bound[k] == bound[k + 1])
+            continue;
+        for (int i = s->n_phys_mem_range - 1; i >= 0 && !pr; --i) {
+            PhysMemoryRange *r = &s->phys_mem_range[i];
+            if (bound[k] >= r->addr && bound[k] < r->addr + r->size)
+                pr = r;
+        }
+        if (!pr)
+            continue;
+
+        PhysMemorySegment *prev = s->n_segment ? &s->segment[s->n_segment - 1] : NULL;
+        if (prev && prev->pr == pr && prev->end == bound[k]) {
+            prev->end = bound[k + 1];
+        } else {
+            PhysMemorySegment *seg = &s->segment[s->n_segment++];
+            seg->start             = bound[k];
+            seg->end               = bound[k + 1];
+            seg->pr                = pr;
+        }
+    }
+
+    const uint64_t granule = (uint64_t)1 << PHYS_MEM_INDEX_SHIFT;
+    const uint64_t limit   = (uint64_t)1 << PHYS_MEM_INDEX_LIMIT_LOG2;
+    memset(s->index, 0, sizeof(PhysMemoryRange *) << (PHYS_MEM_INDEX_LIMIT_LOG2 - PHYS_MEM_INDEX_SHIFT));
+    for (int k = 0; k < s->n_segment; k++) {
+        PhysMemorySegment *seg = &s->segment[k];
+        for (uint64_t g = seg->start & ~(granule - 1); g < seg->end && g < limit; g += granule)
+            if (seg->start <= g && g + granule <= seg->end)
+                s->index[g >> PHYS_MEM_INDEX_SHIFT] = seg->pr;
+            else
+                s->index[g >> PHYS_MEM_INDEX_SHIFT] = PHYS_MEM_INDEX_MIXED;
+    }
+}
+
+/* Binary search of the segments, for addresses the index can't resolve */
+PhysMemoryRange *phys_mem_range_search(PhysMemoryMap *s, uint64_t paddr) {
+    int lo = 0, hi = s->n_segment;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (paddr < s->segment[mid].start)
+            hi = mid;
+        else if (paddr >= s->segment[mid].end)
+            lo = mid + 1;
+        else
+            return s->segment[mid].pr;
     }
 
     return NULL;
@@ -103,6 +171,8 @@ PhysMemoryRange *register_ram_entry(PhysMemoryMap *s, uint64_t addr, uint64_t si
         pr->size = pr->org_size;
     pr->phys_mem   = NULL;
     pr->dirty_bits = NULL;
+    pr->write_hook = NULL;
+    phys_mem_map_update(s);
     return pr;
 }
 
@@ -111,8 +181,10 @@ static PhysMemoryRange *default_register_ram(PhysMemoryMap *s, uint64_t addr, ui
 
     pr = register_ram_entry(s, addr, size, devram_flags);
 
-    pr->phys_mem = (uint8_t *)mallocz(size);
-    if (!pr->phys_mem) {
+    /* Pages are only backed once touched, and checkpoint_load_memory()
+       can map a checkpoint in place of them */
+    pr->phys_mem = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pr->phys_mem == MAP_FAILED) {
         fprintf(dromajo_stderr, "Could not allocate VM memory\n");
         exit(1);
     }
@@ -158,7 +230,7 @@ static const uint32_t *default_get_dirty_bits(PhysMemoryMap *map, PhysMemoryRang
     return dirty_bits;
 }
 
-static void default_free_ram(PhysMemoryMap *s, PhysMemoryRange *pr) { free(pr->phys_mem); }
+static void default_free_ram(PhysMemoryMap *s, PhysMemoryRange *pr) { munmap(pr->phys_mem, pr->org_size); }
 
 PhysMemoryRange *cpu_register_device(PhysMemoryMap *s, uint64_t addr, uint64_t size, void *opaque, DeviceReadFunc *read_func,
                                      DeviceWriteFunc *write_func, int devio_flags) {
@@ -178,9 +250,75 @@ PhysMemoryRange *cpu_register_device(PhysMemoryMap *s, uint64_t addr, uint64_t s
     pr->read_func   = read_func;
     pr->write_func  = write_func;
     pr->devio_flags = devio_flags;
+    pr->save_func   = NULL;
+    pr->load_func   = NULL;
+    phys_mem_map_update(s);
     return pr;
 }
 
+/* The devices with a save function each get a record, their address and
+ * the size of the state that follows it. On load, the records of devices
+ * that the machine does not have are skipped. */
+typedef struct {
+    uint64_t addr;
+    uint64_t size;
+} DeviceStateRecord;
+
+BOOL phys_mem_save_devices(PhysMemoryMap *s, FILE *f) {
+    uint32_t n = 0;
+
+    for (int i = 0; i < s->n_phys_mem_range; ++i) n += !s->phys_mem_range[i].is_ram && s->phys_mem_range[i].save_func;
+    device_state_put(f, &n, sizeof n);
+
+    for (int i = 0; i < s->n_phys_mem_range; ++i) {
+        PhysMemoryRange *pr = &s->phys_mem_range[i];
+        if (pr->is_ram || !pr->save_func)
+            continue;
+
+        DeviceStateRecord r = {pr->addr, 0};
+        off_t             start = ftello(f);
+
+        device_state_put(f, &r, sizeof r);
+        pr->save_func(pr->opaque, f);
+
+        off_t end = ftello(f);
+        r.size    = end - start - sizeof r;
+        fseeko(f, start, SEEK_SET);
+        device_state_put(f, &r, sizeof r);
+        fseeko(f, end, SEEK_SET);
+    }
+
+    return !ferror(f);
+}
+
+BOOL phys_mem_load_devices(PhysMemoryMap *s, FILE *f) {
+    uint32_t n;
+
+    if (!device_state_get(f, &n, sizeof n))
+        return FALSE;
+
+    while (n--) {
+        DeviceStateRecord r;
+        if (!device_state_get(f, &r, sizeof r))
+            return FALSE;
+
+        PhysMemoryRange *pr = NULL;
+        for (int i = 0; i < s->n_phys_mem_range && !pr; ++i)
+            if (!s->phys_mem_range[i].is_ram && s->phys_mem_range[i].load_func && s->phys_mem_range[i].addr == r.addr)
+                pr = &s->phys_mem_range[i];
+
+        off_t start = ftello(f);
+        if (!pr)
+            fprintf(dromajo_stderr, "WARNING: no device at 0x%" PRIx64 " for its saved state\n", r.addr);
+        else if (!pr->load_func(pr->opaque, f) || ftello(f) != start + (off_t)r.size)
+            return FALSE;
+        if (fseeko(f, start + r.size, SEEK_SET))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
 static void default_set_addr(PhysMemoryMap *map, PhysMemoryRange *pr, uint64_t addr, BOOL enabled) {
     if (enabled) {
         if (pr->size == 0 || pr->addr != addr) {
@@ -208,8 +346,9 @@ void phys_mem_set_addr(PhysMemoryRange *pr, uint64_t addr, BOOL enabled) {
     if (!pr->is_ram) {
         default_set_addr(map, pr, addr, enabled);
     } else {
-        return map->set_ram_addr(map, pr, addr, enabled);
+        map->set_ram_addr(map, pr, addr, enabled);
     }
+    phys_mem_map_update(map);
 }
 
 /* IRQ support */
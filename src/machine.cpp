@@ -235,6 +235,12 @@ static int virt_machine_parse_config(VirtMachineParams *p, char *config_file_str
     vm_get_uint64_opt(cfg, "htif_base_addr", &p->htif_base_addr);
     vm_get_uint64_opt(cfg, "maxinsns", &p->maxinsns);
 
+    {
+        uint64_t asid_bits = p->asid_bits;
+        vm_get_uint64_opt(cfg, "asid_bits", &asid_bits);
+        p->asid_bits = asid_bits;
+    }
+
     if (vm_get_str_opt(cfg, "load", &p->snapshot_load_name) < 0)
         goto tag_fail;
 
@@ -49,9 +49,11 @@
 #include <unistd.h>
 
 #include "LiveCacheCore.h"
+#include "checkpoint.h"
 #include "cutils.h"
 #include "dromajo.h"
 #include "iomem.h"
+#include "riscv_jit.h"
 #include "riscv_machine.h"
 
 // NOTE: Use GET_INSN_COUNTER not mcycle because this is just to track advancement of simulation
@@ -156,6 +158,7 @@ static inline void track_write(RISCVCPUState *s, uint64_t vaddr, uint64_t paddr,
 #ifdef GOLDMEM_INORDER
     s->last_data_value = data;
 #endif
+    riscv_reservations_store(s->machine, s->mhartid, paddr);
 }
 
 static inline uint64_t track_dread(RISCVCPUState *s, uint64_t vaddr, uint64_t paddr, uint64_t data, int size) {
@@ -275,6 +278,7 @@ static inline bool check_triggers(RISCVCPUState *s, target_ulong t_mctl, target_
             return;                                                                                  \
         }                                                                                            \
         track_write(s, paddr, paddr, val, size);                                                     \
+        phys_mem_set_dirty_bit(pr, paddr - pr->addr);                                                \
         *(uint_type *)(pr->phys_mem + (uintptr_t)(paddr - pr->addr)) = val;                          \
         *fail                                                        = false;                        \
     }                                                                                                \
@@ -295,25 +299,28 @@ PHYS_MEM_READ_WRITE(8, uint8_t)
 PHYS_MEM_READ_WRITE(32, uint32_t)
 PHYS_MEM_READ_WRITE(64, uint64_t)
 
-/* return 0 if OK, != 0 if exception */
+/* return 0 if OK, != 0 if exception. Misaligned accesses never hit in
+ * the TLB, and while a data trigger is armed the matching TLB is kept
+ * empty, so both checks are only needed on the miss path. */
 #define TARGET_READ_WRITE(size, uint_type, size_log2)                                                                       \
     static inline __must_use_result int target_read_u##size(RISCVCPUState *s, uint_type *pval, target_ulong addr) {         \
-        if (check_triggers(s, MCONTROL_LOAD, addr))                                                                         \
-            return -1;                                                                                                      \
-        uint32_t tlb_idx;                                                                                                   \
-        if (!CONFIG_ALLOW_MISALIGNED_ACCESS && (addr & (size / 8 - 1)) != 0) {                                              \
-            s->pending_tval      = addr;                                                                                    \
-            s->pending_exception = CAUSE_MISALIGNED_LOAD;                                                                   \
-            return -1;                                                                                                      \
-        }                                                                                                                   \
-        tlb_idx = (addr >> PG_SHIFT) & (TLB_SIZE - 1);                                                                      \
+        uint32_t tlb_idx = (addr >> PG_SHIFT) & s->tlb_mask;                                                                \
         if (likely(s->tlb_read[tlb_idx].vaddr == (addr & ~(PG_MASK & ~((size / 8) - 1))))) {                                \
+            s->tlb_hit_count++;                                                                                             \
             uint64_t data  = *(uint_type *)(s->tlb_read[tlb_idx].mem_addend + (uintptr_t)addr);                             \
             uint64_t paddr = s->tlb_read_paddr_addend[tlb_idx] + addr;                                                      \
             *pval          = track_dread(s, addr, paddr, data, size);                                                       \
             return 0;                                                                                                       \
         }                                                                                                                   \
                                                                                                                             \
+        if (unlikely(s->trigger_armed & MCONTROL_LOAD) && check_triggers(s, MCONTROL_LOAD, addr))                           \
+            return -1;                                                                                                      \
+        if (!CONFIG_ALLOW_MISALIGNED_ACCESS && (addr & (size / 8 - 1)) != 0) {                                              \
+            s->pending_tval      = addr;                                                                                    \
+            s->pending_exception = CAUSE_MISALIGNED_LOAD;                                                                   \
+            return -1;                                                                                                      \
+        }                                                                                                                   \
+                                                                                                                            \
         mem_uint_t val;                                                                                                     \
         int        ret = riscv_cpu_read_memory(s, &val, addr, size_log2);                                                   \
         if (ret)                                                                                                            \
@@ -323,22 +330,23 @@ PHYS_MEM_READ_WRITE(64, uint64_t)
     }                                                                                                                       \
                                                                                                                             \
     static inline __must_use_result int target_write_u##size(RISCVCPUState *s, target_ulong addr, uint_type val) {          \
-        if (check_triggers(s, MCONTROL_STORE, addr))                                                                        \
-            return -1;                                                                                                      \
-        uint32_t tlb_idx;                                                                                                   \
-        if (!CONFIG_ALLOW_MISALIGNED_ACCESS && (addr & (size / 8 - 1)) != 0) {                                              \
-            s->pending_tval      = addr;                                                                                    \
-            s->pending_exception = CAUSE_MISALIGNED_STORE;                                                                  \
-            return -1;                                                                                                      \
-        }                                                                                                                   \
-        tlb_idx = (addr >> PG_SHIFT) & (TLB_SIZE - 1);                                                                      \
+        uint32_t tlb_idx = (addr >> PG_SHIFT) & s->tlb_mask;                                                                \
         if (likely(s->tlb_write[tlb_idx].vaddr == (addr & ~(PG_MASK & ~((size / 8) - 1))))) {                               \
+            s->tlb_hit_count++;                                                                                             \
             *(uint_type *)(s->tlb_write[tlb_idx].mem_addend + (uintptr_t)addr) = val;                                       \
             uint64_t paddr                                                     = s->tlb_write_paddr_addend[tlb_idx] + addr; \
             track_write(s, addr, paddr, val, size);                                                                         \
             return 0;                                                                                                       \
         }                                                                                                                   \
                                                                                                                             \
+        if (unlikely(s->trigger_armed & MCONTROL_STORE) && check_triggers(s, MCONTROL_STORE, addr))                         \
+            return -1;                                                                                                      \
+        if (!CONFIG_ALLOW_MISALIGNED_ACCESS && (addr & (size / 8 - 1)) != 0) {                                              \
+            s->pending_tval      = addr;                                                                                    \
+            s->pending_exception = CAUSE_MISALIGNED_STORE;                                                                  \
+            return -1;                                                                                                      \
+        }                                                                                                                   \
+                                                                                                                            \
         return riscv_cpu_write_memory(s, addr, val, size_log2);                                                             \
     }
 
@@ -352,17 +360,339 @@ TARGET_READ_WRITE(64, uint64_t, 3)
 TARGET_READ_WRITE(128, uint128_t, 4)
 #endif
 
+void riscv_reservations_update_filter(RISCVMachine *m) {
+    uint64_t filter = 0;
+
+    for (int i = 0; i < m->ncpus; ++i) {
+        uint64_t line = __atomic_load_n(&m->reserved_line[i], __ATOMIC_RELAXED);
+        if (line != (uint64_t)-1)
+            filter |= (uint64_t)1 << (line & 63);
+    }
+    m->reserved_filter = filter;
+}
+
+/* Harts running in parallel only ever add lines to the filter, it is
+ * brought up to date between quanta */
+void riscv_reservations_break(RISCVMachine *m, int hartid, uint64_t paddr) {
+    uint64_t line = paddr >> RESERVATION_LINE_SHIFT;
+
+    for (int i = 0; i < m->ncpus; ++i) {
+        uint64_t reserved = line;
+        if (i != hartid)
+            __atomic_compare_exchange_n(&m->reserved_line[i], &reserved, (uint64_t)-1, false, __ATOMIC_SEQ_CST,
+                                        __ATOMIC_RELAXED);
+    }
+    if (!m->common.parallel)
+        riscv_reservations_update_filter(m);
+}
+
+/* Reserve the cache line of the load just done by an LR */
+static inline void reservation_set(RISCVCPUState *s) {
+    RISCVMachine *m    = s->machine;
+    uint64_t      line = s->last_data_paddr >> RESERVATION_LINE_SHIFT;
+
+    __atomic_store_n(&m->reserved_line[s->mhartid], line, __ATOMIC_SEQ_CST);
+    __atomic_or_fetch(&m->reserved_filter, (uint64_t)1 << (line & 63), __ATOMIC_SEQ_CST);
+}
+
+/* TRUE if no other hart stored to the line reserved by the last LR */
+static inline BOOL reservation_held(RISCVCPUState *s) {
+    return __atomic_load_n(&s->machine->reserved_line[s->mhartid], __ATOMIC_SEQ_CST) != (uint64_t)-1;
+}
+
+/* An SC gives up the reservation, whether it succeeds or not */
+static inline void reservation_clear(RISCVCPUState *s) {
+    RISCVMachine *m = s->machine;
+
+    s->load_res = ~0;
+    __atomic_store_n(&m->reserved_line[s->mhartid], (uint64_t)-1, __ATOMIC_SEQ_CST);
+    if (!m->common.parallel)
+        riscv_reservations_update_filter(m);
+}
+
+/* Stores to the page of the HTIF tohost never get a write TLB entry, so
+ * that riscv_cpu_write_memory() sees them all and flags the write */
+static inline BOOL htif_watched(RISCVMachine *m, uint64_t paddr) {
+    return m->htif_tohost_addr && ((paddr ^ m->htif_tohost_addr) & ~(uint64_t)PG_MASK) == 0;
+}
+
+/* Flags a store done to the page of tohost */
+static inline void htif_note_store(RISCVMachine *m, uint64_t paddr) {
+    if (unlikely(htif_watched(m, paddr)))
+        __atomic_store_n(&m->htif_tohost_written, true, __ATOMIC_SEQ_CST);
+}
+
+/* Host address of the naturally aligned RAM location at addr, for an
+ * atomic memory operation of size bytes by a hart running in parallel.
+ * Returns 0 if OK, -1 on an exception, and 1 if the operation has to be
+ * done as a load followed by a store instead (misaligned or device
+ * accesses, armed load/store triggers).  The page of tohost gets no
+ * write TLB entry, the caller flags the store with htif_note_store(). */
+static int target_amo_ptr(RISCVCPUState *s, target_ulong addr, int size, uint8_t **pptr, target_ulong *ppaddr) {
+    uint32_t         tlb_idx = (addr >> PG_SHIFT) & s->tlb_mask;
+    target_ulong     paddr;
+    PhysMemoryRange *pr;
+    bool             pmp_blocked = false;
+
+    if ((addr & (size - 1)) != 0 || (s->trigger_armed & (MCONTROL_LOAD | MCONTROL_STORE)))
+        return 1;
+
+    if (likely(s->tlb_write[tlb_idx].vaddr == (addr & ~PG_MASK))) {
+        s->tlb_hit_count++;
+        *pptr   = (uint8_t *)(s->tlb_write[tlb_idx].mem_addend + (uintptr_t)addr);
+        *ppaddr = s->tlb_write_paddr_addend[tlb_idx] + addr;
+        return 0;
+    }
+
+    s->tlb_miss_count++;
+    int err = riscv_cpu_get_phys_addr(s, addr, ACCESS_WRITE, &paddr);
+    if (err) {
+        s->pending_tval      = addr;
+        s->pending_exception = err == -1 ? CAUSE_STORE_PAGE_FAULT : CAUSE_FAULT_STORE;
+        return -1;
+    }
+    pr = get_phys_mem_range_pmp(s, paddr, size, PMPCFG_R, &pmp_blocked);
+    if (!pmp_blocked)
+        pr = get_phys_mem_range_pmp(s, paddr, size, PMPCFG_W, &pmp_blocked);
+    if (pmp_blocked) {
+        s->pending_tval      = addr;
+        s->pending_exception = CAUSE_FAULT_STORE;
+        return -1;
+    }
+    if (!pr || !pr->is_ram)
+        return 1;
+
+    phys_mem_set_dirty_bit(pr, paddr - pr->addr);
+    *pptr   = pr->phys_mem + (uintptr_t)(paddr - pr->addr);
+    *ppaddr = paddr;
+    if (!riscv_cpu_invalidate_decoded(s, paddr, size) && !htif_watched(s->machine, paddr)) {
+        s->tlb_write[tlb_idx].vaddr = addr & ~PG_MASK;
+#ifdef PADDR_INLINE
+        s->tlb_write[tlb_idx].paddr_addend = paddr - addr;
+#else
+        s->tlb_write_paddr_addend[tlb_idx] = paddr - addr;
+#endif
+        s->tlb_write[tlb_idx].mem_addend = (uintptr_t)*pptr - addr;
+        s->tlb_write_shift[tlb_idx]      = s->tlb_leaf_shift;
+    }
+    return 0;
+}
+
+/* AMOs and SCs of harts running in parallel are host atomic operations
+ * on RAM.  An SC succeeds if memory still holds the value loaded by the
+ * LR. Otherwise, and when single stepping the harts in turn, they are a
+ * load followed by a store.  Both return 0 if OK, != 0 on an exception. */
+#define TARGET_AMO(size)                                                                                           \
+    static inline uint##size##_t amo_op_u##size(int funct5, uint##size##_t val, uint##size##_t val2) {              \
+        switch (funct5) {                                                                                           \
+            case 1: /* amoswap */ return val2;                                                                      \
+            case 0: /* amoadd */ return val + val2;                                                                 \
+            case 4: /* amoxor */ return val ^ val2;                                                                 \
+            case 0xc: /* amoand */ return val & val2;                                                               \
+            case 0x8: /* amoor */ return val | val2;                                                                \
+            case 0x10: /* amomin */ return (int##size##_t)val < (int##size##_t)val2 ? val : val2;                   \
+            case 0x14: /* amomax */ return (int##size##_t)val > (int##size##_t)val2 ? val : val2;                   \
+            case 0x18: /* amominu */ return val < val2 ? val : val2;                                                \
+            case 0x1c: /* amomaxu */ return val > val2 ? val : val2;                                                \
+            default: abort();                                                                                       \
+        }                                                                                                           \
+    }                                                                                                               \
+                                                                                                                    \
+    static inline __must_use_result int target_amo_u##size(RISCVCPUState *s, int funct5, target_ulong addr,        \
+                                                           uint##size##_t val2, uint##size##_t *pval) {             \
+        uint8_t *    ptr;                                                                                           \
+        target_ulong paddr;                                                                                         \
+        int          err;                                                                                           \
+                                                                                                                    \
+        if (unlikely(s->machine->common.parallel) && (err = target_amo_ptr(s, addr, size / 8, &ptr, &paddr)) <= 0) { \
+            if (err)                                                                                                \
+                return err;                                                                                         \
+            uint##size##_t *p = (uint##size##_t *)ptr, val = __atomic_load_n(p, __ATOMIC_RELAXED), res;             \
+            do                                                                                                      \
+                res = amo_op_u##size(funct5, val, val2);                                                            \
+            while (!__atomic_compare_exchange_n(p, &val, res, true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));          \
+            track_write(s, addr, paddr, res, size);                                                                 \
+            htif_note_store(s->machine, paddr);                                                                     \
+            *pval = val;                                                                                            \
+            return 0;                                                                                               \
+        }                                                                                                           \
+                                                                                                                    \
+        if (target_read_u##size(s, pval, addr)) {                                                                   \
+            if (s->pending_exception != CAUSE_BREAKPOINT)                                                           \
+                s->pending_exception += 2; /* LD -> ST */                                                           \
+            return -1;                                                                                              \
+        }                                                                                                           \
+        return target_write_u##size(s, addr, amo_op_u##size(funct5, *pval, val2));                                 \
+    }                                                                                                               \
+                                                                                                                    \
+    static inline __must_use_result int target_sc_u##size(RISCVCPUState *s, target_ulong addr, uint##size##_t val, \
+                                                          bool *stored) {                                           \
+        uint8_t *    ptr;                                                                                           \
+        target_ulong paddr;                                                                                         \
+        int          err;                                                                                           \
+                                                                                                                    \
+        if (unlikely(s->machine->common.parallel) && (err = target_amo_ptr(s, addr, size / 8, &ptr, &paddr)) <= 0) { \
+            if (err)                                                                                                \
+                return err;                                                                                         \
+            uint##size##_t expected = s->load_res_val;                                                              \
+            *stored                 = __atomic_compare_exchange_n((uint##size##_t *)ptr, &expected, val, false,     \
+                                                  __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);                              \
+            if (*stored) {                                                                                          \
+                track_write(s, addr, paddr, val, size);                                                             \
+                htif_note_store(s->machine, paddr);                                                                 \
+            }                                                                                                       \
+            return 0;                                                                                               \
+        }                                                                                                           \
+                                                                                                                    \
+        *stored = true;                                                                                             \
+        return target_write_u##size(s, addr, val);                                                                  \
+    }
+
+TARGET_AMO(32)
+#if MLEN >= 64
+TARGET_AMO(64)
+#endif
+
 #define PTE_V_MASK (1 << 0)
 #define PTE_U_MASK (1 << 4)
 #define PTE_A_MASK (1 << 6)
 #define PTE_D_MASK (1 << 7)
 
+static void tlb_add_superpage(TLBSpace *t, target_ulong vaddr, int shift) {
+    target_ulong sp = vaddr >> shift << shift | shift;
+
+    if (t->superpage_nb > TLB_SUPERPAGE_NB)
+        return;
+    for (int k = 0; k < t->superpage_nb; k++)
+        if (t->superpage[k] == sp)
+            return;
+    if (t->superpage_nb < TLB_SUPERPAGE_NB)
+        t->superpage[t->superpage_nb] = sp;
+    t->superpage_nb++;
+}
+
+/* Privilege and protection checks of a leaf PTE */
+static inline bool pte_access_ok(RISCVCPUState *s, int priv, target_ulong pte, riscv_memory_access_t access) {
+    int xwr = (pte >> 1) & 7;
+
+    if (priv == PRV_S) {
+        if ((pte & PTE_U_MASK) && !(s->mstatus & MSTATUS_SUM))
+            return false;
+    } else {
+        if (!(pte & PTE_U_MASK))
+            return false;
+    }
+    /* MXR allows read access to execute-only pages */
+    if (s->mstatus & MSTATUS_MXR)
+        xwr |= (xwr >> 2);
+
+    return (xwr >> access) & 1;
+}
+
+/* The set that holds the pages of the given size mapping vaddr. Bit
+ * (shift - PG_SHIFT) / 9 of l2_shifts tells if the space has any. */
+static inline L2TLBEntry *l2_tlb_set(RISCVCPUState *s, int space, target_ulong vaddr, int shift) {
+    uint32_t set = ((vaddr >> shift) ^ ((target_ulong)space << 5)) & s->l2_tlb_set_mask;
+    return &s->l2_tlb[set * L2_TLB_WAYS];
+}
+
+static inline bool l2_tlb_entry_maps(L2TLBEntry *e, TLBSpace *t, int space, int shift, target_ulong vaddr) {
+    return e->space == space && e->gen == t->l2_gen && e->shift == shift && ((e->vaddr ^ vaddr) >> shift) == 0;
+}
+
+static L2TLBEntry *l2_tlb_lookup(RISCVCPUState *s, target_ulong vaddr) {
+    TLBSpace *t     = s->tlb_space;
+    int       space = t - s->tlb_spaces;
+
+    for (int n = 0, shift = PG_SHIFT; t->l2_shifts >> n; n++, shift += 9) {
+        if (!(t->l2_shifts & (1 << n)))
+            continue;
+        L2TLBEntry *set = l2_tlb_set(s, space, vaddr, shift);
+        for (int w = 0; w < L2_TLB_WAYS; w++)
+            if (l2_tlb_entry_maps(&set[w], t, space, shift, vaddr))
+                return &set[w];
+    }
+    return NULL;
+}
+
+static void l2_tlb_insert(RISCVCPUState *s, target_ulong vaddr, target_ulong paddr, int shift, target_ulong pte) {
+    TLBSpace *  t     = s->tlb_space;
+    int         space = t - s->tlb_spaces;
+    L2TLBEntry *set   = l2_tlb_set(s, space, vaddr, shift);
+    L2TLBEntry *e     = NULL;
+
+    /* Replace the entry being refreshed (to set D), else a free one,
+     * else round robin */
+    for (int w = 0; w < L2_TLB_WAYS && !e; w++)
+        if (l2_tlb_entry_maps(&set[w], t, space, shift, vaddr))
+            e = &set[w];
+    for (int w = 0; w < L2_TLB_WAYS && !e; w++)
+        if (set[w].space == 0xff || set[w].gen != s->tlb_spaces[set[w].space].l2_gen)
+            e = &set[w];
+    if (!e)
+        e = &set[s->l2_tlb_victim++ % L2_TLB_WAYS];
+
+    e->vaddr = vaddr >> shift << shift;
+    e->paddr = paddr;
+    e->gen   = t->l2_gen;
+    e->space = space;
+    e->shift = shift;
+    e->pte   = pte;
+    t->l2_shifts |= 1 << ((shift - PG_SHIFT) / 9);
+}
+
+/* The slot of the non-leaf PTE of the given level (0 for the root)
+ * covering vpn, i.e. vaddr shifted by the size the PTE maps */
+static inline PWCEntry *pwc_slot(RISCVCPUState *s, int level, int space, target_ulong vpn) {
+    return &s->pwc[level][(vpn ^ ((target_ulong)space << 3)) & (PWC_SIZE - 1)];
+}
+
+/* PTE reads skip the memory map lookup while the page tables stay in
+ * the same RAM range */
+static inline uint64_t ptw_read(RISCVCPUState *s, target_ulong pte_addr, bool *fail) {
+    PhysMemoryRange *pr = s->ptw_ram;
+
+    s->pte_read_count++;
+    if (!pr || pte_addr - pr->addr >= pr->size) {
+        pr = get_phys_mem_range(s->mem_map, pte_addr);
+        if (!pr || !pr->is_ram)
+            return riscv_phys_read_u64(s, pte_addr, fail);
+        s->ptw_ram = pr;
+    }
+    if (!riscv_cpu_pmp_access_ok(s, pte_addr, 8, PMPCFG_R)) {
+        *fail = true;
+        return 0;
+    }
+    *fail = false;
+    return track_dread(s, pte_addr, pte_addr, *(uint64_t *)(pr->phys_mem + (uintptr_t)(pte_addr - pr->addr)), 64);
+}
+
+/* Write back a PTE read as old_pte with its A and D bits set.  Harts
+ * running in parallel may change the page tables at the same time, so
+ * then the PTE is only updated if it still holds old_pte.  Returns
+ * false if it did not. */
+static bool ptw_update(RISCVCPUState *s, target_ulong pte_addr, uint64_t old_pte, uint64_t pte, bool *fail) {
+    if (s->machine->common.parallel) {
+        PhysMemoryRange *pr = get_phys_mem_range(s->mem_map, pte_addr);
+        if (pr && pr->is_ram && riscv_cpu_pmp_access_ok(s, pte_addr, 8, PMPCFG_W)) {
+            uint64_t *ptr = (uint64_t *)(pr->phys_mem + (uintptr_t)(pte_addr - pr->addr));
+            *fail         = false;
+            track_write(s, pte_addr, pte_addr, pte, 64);
+            phys_mem_set_dirty_bit(pr, pte_addr - pr->addr);
+            return __atomic_compare_exchange_n(ptr, &old_pte, pte, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+        }
+    }
+
+    riscv_phys_write_u64(s, pte_addr, pte, fail);
+    return true;
+}
+
 /* access = 0: read, 1 = write, 2 = code. Set the exception_pending
    field if necessary. return 0 if OK, -1 if translation error, -2 if
    the physical address is illegal. */
 int riscv_cpu_get_phys_addr(RISCVCPUState *s, target_ulong vaddr, riscv_memory_access_t access, target_ulong *ppaddr) {
     int          mode, levels, pte_bits, pte_idx, pte_mask, pte_size_log2, xwr, priv;
-    int          need_write, vaddr_shift, i, pte_addr_bits;
+    int          need_write, vaddr_shift, i, pte_addr_bits, space, start;
     target_ulong pte_addr, pte, vaddr_mask, paddr;
 
     if ((s->mstatus & MSTATUS_MPRV) && access != ACCESS_CODE) {
@@ -372,6 +702,7 @@ int riscv_cpu_get_phys_addr(RISCVCPUState *s, target_ulong vaddr, riscv_memory_a
         priv = s->priv;
     }
 
+    s->tlb_leaf_shift = PG_SHIFT;
     if (priv == PRV_M) {
         *ppaddr = vaddr;
         return 0;
@@ -390,10 +721,42 @@ int riscv_cpu_get_phys_addr(RISCVCPUState *s, target_ulong vaddr, riscv_memory_a
             return -1;
         pte_addr_bits = 44;
     }
+
+    /* A hit in the L2 TLB only needs a walk to set the D bit, otherwise
+     * the walk decides which fault to raise */
+    if (s->l2_tlb) {
+        L2TLBEntry *e = l2_tlb_lookup(s, vaddr);
+        if (e && pte_access_ok(s, priv, e->pte, access) && (access != ACCESS_WRITE || (e->pte & PTE_D_MASK))) {
+            s->l2_tlb_hit_count++;
+            s->tlb_leaf_shift = e->shift;
+            if (e->shift > PG_SHIFT)
+                tlb_add_superpage(s->tlb_space, vaddr, e->shift);
+            vaddr_mask = ((target_ulong)1 << e->shift) - 1;
+            *ppaddr    = e->paddr | vaddr & vaddr_mask;
+            return 0;
+        }
+        s->l2_tlb_miss_count++;
+    }
+
+    ++s->ptw_count;
     pte_addr = (s->satp & (((target_ulong)1 << pte_addr_bits) - 1)) << PG_SHIFT;
     pte_bits = 12 - pte_size_log2;
     pte_mask = (1 << pte_bits) - 1;
-    for (i = 0; i < levels; i++) {
+
+    /* Resume from the deepest non-leaf PTE in the page walk cache */
+    space = s->tlb_space - s->tlb_spaces;
+    start = 0;
+    for (i = levels - 2; i >= 0; i--) {
+        target_ulong vpn = vaddr >> (PG_SHIFT + pte_bits * (levels - 1 - i));
+        PWCEntry *   e   = pwc_slot(s, i, space, vpn);
+        if (e->space == space && e->gen == s->tlb_space->l2_gen && e->vpn == vpn) {
+            pte_addr = e->paddr;
+            start    = i + 1;
+            break;
+        }
+    }
+
+    for (i = start; i < levels; i++) {
         bool fail;
 
         vaddr_shift = PG_SHIFT + pte_bits * (levels - 1 - i);
@@ -402,7 +765,7 @@ int riscv_cpu_get_phys_addr(RISCVCPUState *s, target_ulong vaddr, riscv_memory_a
         if (pte_size_log2 == 2)
             pte = riscv_phys_read_u32(s, pte_addr, &fail);
         else
-            pte = riscv_phys_read_u64(s, pte_addr, &fail);
+            pte = ptw_read(s, pte_addr, &fail);
 
         if (fail)
             return -2;
@@ -416,20 +779,7 @@ int riscv_cpu_get_phys_addr(RISCVCPUState *s, target_ulong vaddr, riscv_memory_a
             if (xwr == 2 || xwr == 6)
                 return -1;
 
-            /* priviledge check */
-            if (priv == PRV_S) {
-                if ((pte & PTE_U_MASK) && !(s->mstatus & MSTATUS_SUM))
-                    return -1;
-            } else {
-                if (!(pte & PTE_U_MASK))
-                    return -1;
-            }
-            /* protection check */
-            /* MXR allows read access to execute-only pages */
-            if (s->mstatus & MSTATUS_MXR)
-                xwr |= (xwr >> 2);
-
-            if (((xwr >> access) & 1) == 0)
+            if (!pte_access_ok(s, priv, pte, access))
                 return -1;
 
             /* 6. Check for misaligned superpages */
@@ -451,7 +801,8 @@ int riscv_cpu_get_phys_addr(RISCVCPUState *s, target_ulong vaddr, riscv_memory_a
                 if (access == ACCESS_WRITE && !(pte & PTE_D_MASK))
                     return -1;  // Must have D on write
             } else {
-                need_write = !(pte & PTE_A_MASK) || (!(pte & PTE_D_MASK) && access == ACCESS_WRITE);
+                target_ulong old_pte = pte;
+                need_write           = !(pte & PTE_A_MASK) || (!(pte & PTE_D_MASK) && access == ACCESS_WRITE);
                 pte |= PTE_A_MASK;
                 if (access == ACCESS_WRITE)
                     pte |= PTE_D_MASK;
@@ -459,18 +810,32 @@ int riscv_cpu_get_phys_addr(RISCVCPUState *s, target_ulong vaddr, riscv_memory_a
                     bool fail;
                     if (pte_size_log2 == 2)
                         riscv_phys_write_u32(s, pte_addr, pte, &fail);
-                    else
-                        riscv_phys_write_u64(s, pte_addr, pte, &fail);
+                    else if (!ptw_update(s, pte_addr, old_pte, pte, &fail))
+                        /* another hart changed the PTE, walk again */
+                        return riscv_cpu_get_phys_addr(s, vaddr, access, ppaddr);
                     if (fail)
                         return -2;
                 }
             }
 
+            s->tlb_leaf_shift = vaddr_shift;
+            if (vaddr_shift > PG_SHIFT)
+                tlb_add_superpage(s->tlb_space, vaddr, vaddr_shift);
+
             vaddr_mask = ((target_ulong)1 << vaddr_shift) - 1;
-            *ppaddr    = paddr & ~vaddr_mask | vaddr & vaddr_mask;
+            if (s->l2_tlb)
+                l2_tlb_insert(s, vaddr, paddr & ~vaddr_mask, vaddr_shift, pte);
+            *ppaddr = paddr & ~vaddr_mask | vaddr & vaddr_mask;
             return 0;
         }
 
+        if (i < levels - 1) {
+            PWCEntry *e = pwc_slot(s, i, space, vaddr >> vaddr_shift);
+            e->vpn      = vaddr >> vaddr_shift;
+            e->paddr    = paddr;
+            e->gen      = s->tlb_space->l2_gen;
+            e->space    = space;
+        }
         pte_addr = paddr;
     }
 
@@ -548,6 +913,7 @@ no_inline int riscv_cpu_read_memory(RISCVCPUState *s, mem_uint_t *pval, target_u
         }
         paddr = addr;  // No translation for this request
     } else {
+        s->tlb_miss_count++;
         int err = riscv_cpu_get_phys_addr(s, addr, ACCESS_READ, &paddr);
 
         if (err) {
@@ -571,15 +937,19 @@ no_inline int riscv_cpu_read_memory(RISCVCPUState *s, mem_uint_t *pval, target_u
             return 0;  // Isn't RAM or Virt Device, treated as mmio and memory copied from DUT
 
         if (pr->is_ram) {
-            tlb_idx                    = (addr >> PG_SHIFT) & (TLB_SIZE - 1);
-            ptr                        = pr->phys_mem + (uintptr_t)(paddr - pr->addr);
-            s->tlb_read[tlb_idx].vaddr = addr & ~PG_MASK;
+            ptr = pr->phys_mem + (uintptr_t)(paddr - pr->addr);
+            /* Armed load triggers need every load to come here */
+            if (!(s->trigger_armed & MCONTROL_LOAD)) {
+                tlb_idx                    = (addr >> PG_SHIFT) & s->tlb_mask;
+                s->tlb_read[tlb_idx].vaddr = addr & ~PG_MASK;
 #ifdef PADDR_INLINE
-            s->tlb_read[tlb_idx].paddr_addend = paddr - addr;
+                s->tlb_read[tlb_idx].paddr_addend = paddr - addr;
 #else
-            s->tlb_read_paddr_addend[tlb_idx]  = paddr - addr;
+                s->tlb_read_paddr_addend[tlb_idx] = paddr - addr;
 #endif
-            s->tlb_read[tlb_idx].mem_addend = (uintptr_t)ptr - addr;
+                s->tlb_read[tlb_idx].mem_addend = (uintptr_t)ptr - addr;
+                s->tlb_read_shift[tlb_idx]      = s->tlb_leaf_shift;
+            }
             switch (size_log2) {
                 case 0: ret = *(uint8_t *)ptr; break;
                 case 1: ret = *(uint16_t *)ptr; break;
@@ -593,6 +963,8 @@ no_inline int riscv_cpu_read_memory(RISCVCPUState *s, mem_uint_t *pval, target_u
                 default: abort();
             }
         } else {
+            std::lock_guard<std::mutex> io_guard(*s->machine->io_lock);
+
             offset = paddr - pr->addr;
             if (((pr->devio_flags >> size_log2) & 1) != 0) {
                 ret = pr->read_func(pr->opaque, offset, size_log2);
@@ -640,6 +1012,7 @@ no_inline int riscv_cpu_write_memory(RISCVCPUState *s, target_ulong addr, mem_ui
         }
         paddr = addr;
     } else {
+        s->tlb_miss_count++;
         int err = riscv_cpu_get_phys_addr(s, addr, ACCESS_WRITE, &paddr);
 
         if (err) {
@@ -657,15 +1030,22 @@ no_inline int riscv_cpu_write_memory(RISCVCPUState *s, target_ulong addr, mem_ui
             // Isn't RAM or Virt Device, treated as mmio and reads copy DUT data
         } else if (pr->is_ram) {
             phys_mem_set_dirty_bit(pr, paddr - pr->addr);
-            tlb_idx                     = (addr >> PG_SHIFT) & (TLB_SIZE - 1);
-            ptr                         = pr->phys_mem + (uintptr_t)(paddr - pr->addr);
-            s->tlb_write[tlb_idx].vaddr = addr & ~PG_MASK;
+            ptr = pr->phys_mem + (uintptr_t)(paddr - pr->addr);
+            /* Stores to pre-decoded code pages, to the page of tohost,
+             * and all stores while a store trigger is armed, must keep
+             * coming here */
+            BOOL watched = htif_watched(s->machine, paddr);
+            if (!riscv_cpu_invalidate_decoded(s, paddr, size) && !(s->trigger_armed & MCONTROL_STORE) && !watched) {
+                tlb_idx                     = (addr >> PG_SHIFT) & s->tlb_mask;
+                s->tlb_write[tlb_idx].vaddr = addr & ~PG_MASK;
 #ifdef PADDR_INLINE
-            s->tlb_write[tlb_idx].paddr_addend = paddr - addr;
+                s->tlb_write[tlb_idx].paddr_addend = paddr - addr;
 #else
-            s->tlb_write_paddr_addend[tlb_idx] = paddr - addr;
+                s->tlb_write_paddr_addend[tlb_idx] = paddr - addr;
 #endif
-            s->tlb_write[tlb_idx].mem_addend = (uintptr_t)ptr - addr;
+                s->tlb_write[tlb_idx].mem_addend = (uintptr_t)ptr - addr;
+                s->tlb_write_shift[tlb_idx]      = s->tlb_leaf_shift;
+            }
             switch (size_log2) {
                 case 0: *(uint8_t *)ptr = val; break;
                 case 1: *(uint16_t *)ptr = val; break;
@@ -678,7 +1058,11 @@ no_inline int riscv_cpu_write_memory(RISCVCPUState *s, target_ulong addr, mem_ui
 #endif
                 default: abort();
             }
+            if (unlikely(watched))
+                __atomic_store_n(&s->machine->htif_tohost_written, true, __ATOMIC_SEQ_CST);
         } else {
+            std::lock_guard<std::mutex> io_guard(*s->machine->io_lock);
+
             offset = paddr - pr->addr;
             if (((pr->devio_flags >> size_log2) & 1) != 0) {
                 pr->write_func(pr->opaque, offset, val, size_log2);
@@ -718,6 +1102,7 @@ static no_inline __must_use_result int target_read_insn_slow(RISCVCPUState *s, u
     PhysMemoryRange *pr;
     bool             pmp_blocked = false;
 
+    s->tlb_miss_count++;
     int err = riscv_cpu_get_phys_addr(s, addr, ACCESS_CODE, &paddr);
     if (err) {
         s->pending_tval      = addr;
@@ -731,7 +1116,7 @@ static no_inline __must_use_result int target_read_insn_slow(RISCVCPUState *s, u
         s->pending_exception = CAUSE_FAULT_FETCH;
         return -1;
     }
-    tlb_idx = (addr >> PG_SHIFT) & (TLB_SIZE - 1);
+    tlb_idx = (addr >> PG_SHIFT) & s->tlb_mask;
     ptr     = pr->phys_mem + (uintptr_t)(paddr - pr->addr);
     if (riscv_cpu_pmp_access_ok(s, paddr & ~PG_MASK, PG_MASK + 1, PMPCFG_X)) {
         /* All of this page has full execute access so we can bypass
@@ -739,11 +1124,11 @@ static no_inline __must_use_result int target_read_insn_slow(RISCVCPUState *s, u
         s->tlb_code[tlb_idx].vaddr        = addr & ~PG_MASK;
         s->tlb_code_paddr_addend[tlb_idx] = paddr - addr;
         s->tlb_code[tlb_idx].mem_addend   = (uintptr_t)ptr - addr;
+        s->tlb_code_shift[tlb_idx]        = s->tlb_leaf_shift;
     }
 
     /* check for page crossing */
-    int tlb_idx_cross = ((addr + 2) >> PG_SHIFT) & (TLB_SIZE - 1);
-    if (tlb_idx != tlb_idx_cross && size == 32) {
+    if (((addr ^ (addr + 2)) >> PG_SHIFT) != 0 && size == 32) {
         target_ulong paddr_cross;
         int          err = riscv_cpu_get_phys_addr(s, addr + 2, ACCESS_CODE, &paddr_cross);
         if (err) {
@@ -788,9 +1173,10 @@ static no_inline __must_use_result int target_read_insn_slow(RISCVCPUState *s, u
 /* addr must be aligned */
 static inline __must_use_result int target_read_insn_u16(RISCVCPUState *s, uint16_t *pinsn, target_ulong addr) {
     uintptr_t mem_addend;
-    uint32_t  tlb_idx = (addr >> PG_SHIFT) & (TLB_SIZE - 1);
+    uint32_t  tlb_idx = (addr >> PG_SHIFT) & s->tlb_mask;
 
     if (likely(s->tlb_code[tlb_idx].vaddr == (addr & ~PG_MASK))) {
+        s->tlb_hit_count++;
         mem_addend    = s->tlb_code[tlb_idx].mem_addend;
         uint32_t data = *(uint16_t *)(mem_addend + (uintptr_t)addr);
 #ifdef PADDR_INLINE
@@ -808,28 +1194,343 @@ static inline __must_use_result int target_read_insn_u16(RISCVCPUState *s, uint1
     return 0;
 }
 
-static void tlb_init(RISCVCPUState *s) {
-    for (int i = 0; i < TLB_SIZE; i++) {
-        s->tlb_read[i].vaddr  = -1;
-        s->tlb_write[i].vaddr = -1;
-        s->tlb_code[i].vaddr  = -1;
+/* Point the TLBs at the banks of the current translation context. The
+ * data context mirrors the priv/MPRV/SUM/MXR logic of
+ * riscv_cpu_get_phys_addr(). */
+static void tlb_select(RISCVCPUState *s) {
+    TLBSpace *t    = s->tlb_space;
+    int       priv = s->mstatus & MSTATUS_MPRV ? (s->mstatus >> MSTATUS_MPP_SHIFT) & 3 : s->priv;
+    int       data_ctx, code_ctx;
+
+    if (priv == PRV_M)
+        data_ctx = 0;
+    else if (priv == PRV_S)
+        data_ctx = 1 + !!(s->mstatus & MSTATUS_MXR) + 2 * !!(s->mstatus & MSTATUS_SUM);
+    else
+        data_ctx = 5 - !!(s->mstatus & MSTATUS_MXR);
+    code_ctx = s->priv == PRV_M ? 2 : s->priv;
+
+    s->tlb_read  = t->read[data_ctx];
+    s->tlb_write = t->write[data_ctx];
+    s->tlb_code  = t->code[code_ctx];
+#ifndef PADDR_INLINE
+    s->tlb_read_paddr_addend  = t->read_paddr_addend[data_ctx];
+    s->tlb_write_paddr_addend = t->write_paddr_addend[data_ctx];
+    s->tlb_code_paddr_addend  = t->code_paddr_addend[code_ctx];
+#endif
+    s->tlb_read_shift  = t->read_shift[data_ctx];
+    s->tlb_write_shift = t->write_shift[data_ctx];
+    s->tlb_code_shift  = t->code_shift[code_ctx];
+    t->data_used |= 1 << data_ctx;
+    t->code_used |= 1 << code_ctx;
+}
+
+/* Only banks used since the last flush can hold valid entries */
+static void tlb_flush_space(RISCVCPUState *s, TLBSpace *t) {
+    for (int ctx = 0; ctx < TLB_DATA_CTX_NB; ctx++)
+        if (t->data_used & (1 << ctx))
+            for (uint32_t i = 0; i <= s->tlb_mask; i++) {
+                t->read[ctx][i].vaddr  = -1;
+                t->write[ctx][i].vaddr = -1;
+            }
+    for (int ctx = 0; ctx < TLB_CODE_CTX_NB; ctx++)
+        if (t->code_used & (1 << ctx))
+            for (uint32_t i = 0; i <= s->tlb_mask; i++) t->code[ctx][i].vaddr = -1;
+    t->data_used    = 0;
+    t->code_used    = 0;
+    t->superpage_nb = 0;
+    t->l2_gen++;
+    t->l2_shifts = 0;
+}
+
+/* The tables of each hart, whose number goes up to MAX_CPUS */
+static void *hart_malloc(size_t size) {
+    void *ptr = malloc(size);
+
+    if (!ptr) {
+        fprintf(dromajo_stderr, "ERROR: out of memory for the state of the harts, try fewer of them or a smaller --tlb_size\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+static void *hart_mallocz(size_t size) { return memset(hart_malloc(size), 0, size); }
+
+/* tlb_size entries per bank, l2_tlb_size entries (0 to disable) in the
+ * L2 TLB, both powers of 2 */
+static void tlb_init(RISCVCPUState *s, uint32_t tlb_size, uint32_t l2_tlb_size) {
+    const int banks = 2 * TLB_DATA_CTX_NB + TLB_CODE_CTX_NB;
+
+    s->tlb_mask = tlb_size - 1;
+    for (int n = 0; n < TLB_SPACE_NB; n++) {
+        TLBSpace *t       = &s->tlb_spaces[n];
+        TLBEntry *entries = (TLBEntry *)hart_malloc(banks * tlb_size * sizeof(TLBEntry));
+        uint8_t * shifts  = (uint8_t *)hart_malloc(banks * tlb_size);
+#ifndef PADDR_INLINE
+        target_ulong *addends = (target_ulong *)hart_malloc(banks * tlb_size * sizeof(target_ulong));
+#endif
+
+        for (int ctx = 0; ctx < TLB_DATA_CTX_NB; ctx++) {
+            t->read[ctx]        = entries + (2 * ctx) * tlb_size;
+            t->write[ctx]       = entries + (2 * ctx + 1) * tlb_size;
+            t->read_shift[ctx]  = shifts + (2 * ctx) * tlb_size;
+            t->write_shift[ctx] = shifts + (2 * ctx + 1) * tlb_size;
+#ifndef PADDR_INLINE
+            t->read_paddr_addend[ctx]  = addends + (2 * ctx) * tlb_size;
+            t->write_paddr_addend[ctx] = addends + (2 * ctx + 1) * tlb_size;
+#endif
+        }
+        for (int ctx = 0; ctx < TLB_CODE_CTX_NB; ctx++) {
+            t->code[ctx]       = entries + (2 * TLB_DATA_CTX_NB + ctx) * tlb_size;
+            t->code_shift[ctx] = shifts + (2 * TLB_DATA_CTX_NB + ctx) * tlb_size;
+#ifndef PADDR_INLINE
+            t->code_paddr_addend[ctx] = addends + (2 * TLB_DATA_CTX_NB + ctx) * tlb_size;
+#endif
+        }
+
+        t->satp      = -1;
+        t->last_use  = 0;
+        t->l2_gen    = 0;
+        t->data_used = (1 << TLB_DATA_CTX_NB) - 1;
+        t->code_used = (1 << TLB_CODE_CTX_NB) - 1;
+        tlb_flush_space(s, t);
+    }
+    s->tlb_clock       = 0;
+    s->tlb_space       = &s->tlb_spaces[0];
+    s->tlb_space->satp = s->satp;
+    tlb_select(s);
+
+    for (int i = 0; i < PWC_LEVEL_NB; i++)
+        for (int j = 0; j < PWC_SIZE; j++) s->pwc[i][j].space = 0xff;
+    s->ptw_ram = NULL;
+
+    s->l2_tlb = NULL;
+    if (l2_tlb_size >= L2_TLB_WAYS) {
+        s->l2_tlb          = (L2TLBEntry *)hart_malloc(l2_tlb_size * sizeof(L2TLBEntry));
+        s->l2_tlb_set_mask = l2_tlb_size / L2_TLB_WAYS - 1;
+        s->l2_tlb_victim   = 0;
+        for (uint32_t i = 0; i < l2_tlb_size; i++) s->l2_tlb[i].space = 0xff;
+    }
+}
+
+static void tlb_end(RISCVCPUState *s) {
+    for (int n = 0; n < TLB_SPACE_NB; n++) {
+        free(s->tlb_spaces[n].read[0]);
+        free(s->tlb_spaces[n].read_shift[0]);
+#ifndef PADDR_INLINE
+        free(s->tlb_spaces[n].read_paddr_addend[0]);
+#endif
+    }
+    free(s->l2_tlb);
+}
+
+static void tlb_flush_all(RISCVCPUState *s) {
+    for (int n = 0; n < TLB_SPACE_NB; n++) tlb_flush_space(s, &s->tlb_spaces[n]);
+    tlb_select(s);
+}
+
+/* Switch to the banks of the new satp, recycling the least recently
+ * used address space if it isn't cached. The TLB isn't flushed, the
+ * guest has to use sfence.vma when it reuses an ASID. */
+static void tlb_set_satp(RISCVCPUState *s) {
+    TLBSpace *t = NULL, *lru = &s->tlb_spaces[0];
+
+    for (int n = 0; n < TLB_SPACE_NB && !t; n++)
+        if (s->tlb_spaces[n].satp == s->satp)
+            t = &s->tlb_spaces[n];
+        else if (s->tlb_spaces[n].last_use < lru->last_use)
+            lru = &s->tlb_spaces[n];
+
+    if (!t) {
+        t = lru;
+        tlb_flush_space(s, t);
+        t->satp = s->satp;
     }
+    t->last_use  = ++s->tlb_clock;
+    s->tlb_space = t;
+    tlb_select(s);
 }
 
-static void tlb_flush_all(RISCVCPUState *s) { tlb_init(s); }
+static inline bool tlb_entry_maps(TLBEntry *e, int shift, target_ulong vaddr) {
+    return e->vaddr != (target_ulong)-1 && ((e->vaddr ^ vaddr) >> shift) == 0;
+}
+
+/* sfence.vma: flush the translations of vaddr (all of them if
+ * all_vaddr) for the given ASID (all of them if all_asid) */
+static void tlb_flush_vaddr(RISCVCPUState *s, bool all_vaddr, target_ulong vaddr, bool all_asid, target_ulong asid) {
+    /* the unimplemented ASID bits are ignored, with none every space matches */
+    uint64_t asid_mask = (1ULL << s->machine->asid_bits) - 1;
+
+    for (int n = 0; n < TLB_SPACE_NB; n++) {
+        TLBSpace *t = &s->tlb_spaces[n];
+
+        if (t->satp == (uint64_t)-1)
+            continue;
+        if (!all_asid && ((t->satp >> 44) & asid_mask) != (asid & asid_mask))
+            continue;
+        if (all_vaddr) {
+            tlb_flush_space(s, t);
+            continue;
+        }
+
+        for (int k = 0, shift = PG_SHIFT; t->l2_shifts >> k; k++, shift += 9) {
+            if (!(t->l2_shifts & (1 << k)))
+                continue;
+            L2TLBEntry *set = l2_tlb_set(s, n, vaddr, shift);
+            for (int w = 0; w < L2_TLB_WAYS; w++)
+                if (l2_tlb_entry_maps(&set[w], t, n, shift, vaddr))
+                    set[w].space = 0xff;
+        }
+
+        /* Only leaf PTEs need to go, but the guest may be about to free
+         * the page tables, so the walk path of vaddr is dropped too */
+        int levels = ((t->satp >> 60) & 0xf) - 8 + 3;
+        for (int k = 0; k < levels - 1 && k < PWC_LEVEL_NB; k++) {
+            target_ulong vpn = vaddr >> (PG_SHIFT + 9 * (levels - 1 - k));
+            PWCEntry *   e   = pwc_slot(s, k, n, vpn);
+            if (e->space == n && e->vpn == vpn)
+                e->space = 0xff;
+        }
+
+        /* Entries are per 4 KiB page, so if vaddr falls within a
+         * superpage all the entries filled from it must go too */
+        bool in_superpage = t->superpage_nb > TLB_SUPERPAGE_NB;
+        for (int k = 0; k < t->superpage_nb && !in_superpage; k++)
+            in_superpage = ((t->superpage[k] ^ vaddr) >> (t->superpage[k] & PG_MASK)) == 0;
+
+        uint32_t first = 0, last = s->tlb_mask;
+        if (!in_superpage)
+            first = last = (vaddr >> PG_SHIFT) & s->tlb_mask;
+
+        for (uint32_t i = first; i <= last; i++) {
+            for (int ctx = 0; ctx < TLB_DATA_CTX_NB; ctx++)
+                if (t->data_used & (1 << ctx)) {
+                    if (tlb_entry_maps(&t->read[ctx][i], t->read_shift[ctx][i], vaddr))
+                        t->read[ctx][i].vaddr = -1;
+                    if (tlb_entry_maps(&t->write[ctx][i], t->write_shift[ctx][i], vaddr))
+                        t->write[ctx][i].vaddr = -1;
+                }
+            for (int ctx = 0; ctx < TLB_CODE_CTX_NB; ctx++)
+                if (t->code_used & (1 << ctx) && tlb_entry_maps(&t->code[ctx][i], t->code_shift[ctx][i], vaddr))
+                    t->code[ctx][i].vaddr = -1;
+        }
+    }
+}
+
+/* Recompute which trigger kinds can fire at the current privilege
+ * level. Must be called whenever tdata1, priv or debug_mode change.
+ * Newly armed load/store triggers empty the data TLBs so the next
+ * access takes the slow path, where the trigger is checked. */
+static void update_triggers(RISCVCPUState *s) {
+    uint8_t armed = 0;
+
+    if (!s->debug_mode)
+        for (int i = 0; i < MAX_TRIGGERS; ++i)
+            if (s->tdata1[i] & (MCONTROL_U << s->priv))
+                armed |= s->tdata1[i] & (MCONTROL_EXECUTE | MCONTROL_STORE | MCONTROL_LOAD);
 
-static void tlb_flush_vaddr(RISCVCPUState *s, target_ulong vaddr) { tlb_flush_all(s); }
+    if (armed & ~s->trigger_armed & (MCONTROL_STORE | MCONTROL_LOAD))
+        tlb_flush_all(s);
+    s->trigger_armed = armed;
+}
 
 void riscv_cpu_flush_tlb_write_range_ram(RISCVCPUState *s, uint8_t *ram_ptr, size_t ram_size) {
     uint8_t *ram_end = ram_ptr + ram_size;
-    for (int i = 0; i < TLB_SIZE; i++)
-        if (s->tlb_write[i].vaddr != (target_ulong)-1) {
-            uint8_t *ptr = (uint8_t *)(s->tlb_write[i].mem_addend + (uintptr_t)s->tlb_write[i].vaddr);
-            if (ram_ptr <= ptr && ptr < ram_end)
-                s->tlb_write[i].vaddr = -1;
+    s->ptw_ram       = NULL;
+    for (int n = 0; n < TLB_SPACE_NB; n++)
+        for (int ctx = 0; ctx < TLB_DATA_CTX_NB; ctx++) {
+            if (!(s->tlb_spaces[n].data_used & (1 << ctx)))
+                continue;
+            TLBEntry *tlb_write = s->tlb_spaces[n].write[ctx];
+            for (uint32_t i = 0; i <= s->tlb_mask; i++)
+                if (tlb_write[i].vaddr != (target_ulong)-1) {
+                    uint8_t *ptr = (uint8_t *)(tlb_write[i].mem_addend + (uintptr_t)tlb_write[i].vaddr);
+                    if (ram_ptr <= ptr && ptr < ram_end)
+                        tlb_write[i].vaddr = -1;
+                }
         }
 }
 
+void riscv_cpu_flush_decode_cache(RISCVCPUState *s) {
+    for (uint32_t i = 0; i <= s->decode_cache_mask; i++)
+        if (s->decode_cache[i])
+            s->decode_cache[i]->paddr = -1;
+}
+
+/* Harts whose decode cache and write TLB follow the stores of s.  Harts
+ * running in parallel cannot touch each other's, there stores from
+ * other harts are only seen after a fence.i, as the ISA requires. */
+static inline void coherent_harts(RISCVCPUState *s, int *first, int *last) {
+    RISCVMachine *m = s->machine;
+
+    if (m->common.parallel) {
+        *first = s->mhartid;
+        *last  = s->mhartid + 1;
+    } else {
+        *first = 0;
+        *last  = m->ncpus;
+    }
+}
+
+/* Return the pre-decoded instructions of the code page at paddr, whose
+ * host address is code_page.  When a page enters the cache, every write
+ * TLB entry pointing at it is dropped so that stores to it go through
+ * riscv_cpu_write_memory() and riscv_cpu_invalidate_decoded(). */
+static DecodedInsn *decode_cache_lookup(RISCVCPUState *s, target_ulong paddr, uint8_t *code_page) {
+    DecodedPage **slot = &s->decode_cache[(paddr >> PG_SHIFT) & s->decode_cache_mask];
+    DecodedPage * p    = *slot;
+
+    paddr &= ~(target_ulong)PG_MASK;
+    if (unlikely(!p || p->paddr != paddr)) {
+        int first, last;
+        if (!p) {
+            p = *slot = (DecodedPage *)hart_malloc(sizeof *p);
+            p->gen    = 0;
+        }
+        p->paddr = paddr;
+        p->gen++;
+        memset(p->insn, 0, sizeof p->insn);
+        coherent_harts(s, &first, &last);
+        for (int i = first; i < last; i++)
+            riscv_cpu_flush_tlb_write_range_ram(s->machine->cpu_state[i], code_page, PG_MASK + 1);
+    }
+
+    return p->insn;
+}
+
+/* Drop the pre-decoded instructions of any hart overlapping a store of
+ * size bytes at paddr.  Returns TRUE if the page is cached by some hart,
+ * in which case the store must not be given a write TLB entry. */
+BOOL riscv_cpu_invalidate_decoded(RISCVCPUState *s, uint64_t paddr, int size) {
+    RISCVMachine *m      = s->machine;
+    BOOL          cached = FALSE;
+    int           offset = paddr & PG_MASK;
+    /* a 32-bit instruction starting 2 bytes earlier overlaps too */
+    int first = offset < 3 ? 0 : (offset - 2) >> 1;
+    int last  = (offset + size - 1 > PG_MASK ? PG_MASK : offset + size - 1) >> 1;
+    int first_hart, last_hart;
+
+    coherent_harts(s, &first_hart, &last_hart);
+    for (int i = first_hart; i < last_hart; i++) {
+        RISCVCPUState *h = m->cpu_state[i];
+        DecodedPage *  p = h->decode_cache[(paddr >> PG_SHIFT) & h->decode_cache_mask];
+        if (p && p->paddr == (paddr & ~(uint64_t)PG_MASK)) {
+            memset(&p->insn[first], 0, (last - first + 1) * sizeof p->insn[0]);
+            p->gen++;
+            cached = TRUE;
+        }
+    }
+
+    return cached;
+}
+
+/* Other harts post interrupts through the CLINT and the PLIC, possibly
+ * from another host thread, so mip is only ever changed atomically */
+static void update_mip(RISCVCPUState *s, uint32_t mask, uint32_t val) {
+    __atomic_and_fetch(&s->mip, ~mask | val, __ATOMIC_SEQ_CST);
+    __atomic_or_fetch(&s->mip, mask & val, __ATOMIC_SEQ_CST);
+}
+
 #define SSTATUS_MASK (MSTATUS_SIE | MSTATUS_SPIE | MSTATUS_SPP | MSTATUS_FS | MSTATUS_SUM | MSTATUS_MXR | MSTATUS_UXL_MASK)
 
 #define MSTATUS_MASK                                                                                                               \
@@ -849,15 +1550,13 @@ static target_ulong get_mstatus(RISCVCPUState *s, target_ulong mask) {
 }
 
 static void set_mstatus(RISCVCPUState *s, target_ulong val) {
-    /* flush the TLBs if change of MMU config */
-    target_ulong mod = s->mstatus ^ val;
-    if ((mod & (MSTATUS_MPRV | MSTATUS_SUM | MSTATUS_MXR)) != 0 || ((s->mstatus & MSTATUS_MPRV) && (mod & MSTATUS_MPP) != 0)) {
-        tlb_flush_all(s);
-    }
     s->fs = (val >> MSTATUS_FS_SHIFT) & 3;
 
     target_ulong mask = MSTATUS_MASK & ~(MSTATUS_FS | MSTATUS_UXL_MASK | MSTATUS_SXL_MASK);
     s->mstatus        = s->mstatus & ~mask | val & mask;
+
+    /* MPRV/MPP/SUM/MXR changes switch the data TLB bank */
+    tlb_select(s);
 }
 
 static BOOL counter_access_ok(RISCVCPUState *s, uint32_t csr) {
@@ -1189,7 +1888,8 @@ static void unpack_pmpaddrs(RISCVCPUState *s) {
 }
 
 /* return -1 if invalid CSR, 0 if OK, -2 if CSR raised an exception,
- * 2 if TLBs have been flushed. */
+ * 1 if the interpreter must return to its caller, 2 if TLBs have been
+ * flushed. */
 static int csr_write(RISCVCPUState *s, uint32_t funct3, uint32_t csr, target_ulong val) {
     target_ulong mask;
 
@@ -1239,8 +1939,8 @@ static int csr_write(RISCVCPUState *s, uint32_t funct3, uint32_t csr, target_ulo
         case 0x142: s->scause = val & SCAUSE_MASK; break;
         case 0x143: s->stval = STVAL_TRUNCATE(val); break;
         case 0x144: /* sip */
-            mask   = s->mideleg;
-            s->mip = s->mip & ~mask | val & mask;
+            mask = s->mideleg;
+            update_mip(s, mask, val);
             break;
         case 0x180:
             if (s->priv == PRV_S && s->mstatus & MSTATUS_TVM)
@@ -1248,10 +1948,9 @@ static int csr_write(RISCVCPUState *s, uint32_t funct3, uint32_t csr, target_ulo
             {
                 uint64_t mode = (val >> 60) & 15;
                 if (mode == 0 || mode == 8 || mode == 9)
-                    s->satp = val & SATP_MASK;
+                    s->satp = val & SATP_MASK(s->machine->asid_bits);
             }
-            /* no ASID implemented [yet] */
-            tlb_flush_all(s);
+            tlb_set_satp(s);
             return 2;
 
         case 0x300: set_mstatus(s, val); break;
@@ -1288,8 +1987,8 @@ static int csr_write(RISCVCPUState *s, uint32_t funct3, uint32_t csr, target_ulo
         case 0x342: s->mcause = val & MCAUSE_MASK; break;
         case 0x343: s->mtval = MTVAL_TRUNCATE(val); break;
         case 0x344:
-            mask   = /* MEIP | */ MIP_SEIP | /*MIP_UEIP | MTIP | */ MIP_STIP | /*MIP_UTIP | MSIP | */ MIP_SSIP /*| MIP_USIP*/;
-            s->mip = s->mip & ~mask | val & mask;
+            mask = /* MEIP | */ MIP_SEIP | /*MIP_UEIP | MTIP | */ MIP_STIP | /*MIP_UTIP | MSIP | */ MIP_SSIP /*| MIP_USIP*/;
+            update_mip(s, mask, val);
             break;
 
         case 0x7a0:  // tselect
@@ -1310,6 +2009,7 @@ static int csr_write(RISCVCPUState *s, uint32_t funct3, uint32_t csr, target_ulo
                 if (s->debug_mode)
                     mask += 0x800000000000000ULL;
                 s->tdata1[s->tselect] = s->tdata1[s->tselect] & ~mask | val & mask;
+                update_triggers(s);
             }
             break;
         }
@@ -1486,7 +2186,8 @@ static int csr_write(RISCVCPUState *s, uint32_t funct3, uint32_t csr, target_ulo
                 simpoint_roi = 1;
             }
 
-            break;
+            /* Let the driver see the new ROI state and maxinsns right away */
+            return 1;
 #endif
 
         default:
@@ -1500,11 +2201,14 @@ static int csr_write(RISCVCPUState *s, uint32_t funct3, uint32_t csr, target_ulo
     return 0;
 }
 
+/* Also called after trap entry/return updated MPP, which matters
+ * under MPRV even when the privilege level is unchanged */
 static void set_priv(RISCVCPUState *s, int priv) {
     if (s->priv != priv) {
-        tlb_flush_all(s);
         s->priv = priv;
+        update_triggers(s);
     }
+    tlb_select(s);
 }
 
 static void raise_exception2(RISCVCPUState *s, uint64_t cause, target_ulong tval) {
@@ -1629,6 +2333,7 @@ static void handle_mret(RISCVCPUState *s) {
 static void handle_dret(RISCVCPUState *s) {
     s->stop_the_counter = FALSE;  // Enable counters again
     s->debug_mode       = FALSE;
+    update_triggers(s);
     set_priv(s, s->dcsr & 3);
     s->pc = s->dpc;
 }
@@ -1726,17 +2431,6 @@ static inline uint32_t get_field1(uint32_t val, int src_pos, int dst_pos, int ds
         return (val >> (src_pos - dst_pos)) & mask;
 }
 
-static inline RISCVCTFInfo ctf_compute_hint(int rd, int rs1) {
-    int          rd_link  = rd == 1 || rd == 5;
-    int          rs1_link = rs1 == 1 || rs1 == 5;
-    RISCVCTFInfo k        = (RISCVCTFInfo)(rd_link * 2 + rs1_link + (int)ctf_taken_jalr);
-
-    if (k == ctf_taken_jalr_pop_push && rs1 == rd)
-        return ctf_taken_jalr_push;
-
-    return k;
-}
-
 /*
  * While the 32-bit QNAN is defined in softfp.h, we need it here to
  * pull f_unbox{32,64} out of the fragile macro magic.
@@ -1763,21 +2457,42 @@ int riscv_cpu_interp(RISCVCPUState *s, int n_cycles) { return riscv_cpu_interp64
 /* Note: the value is not accurate when called in riscv_cpu_interp() */
 uint64_t riscv_cpu_get_cycles(RISCVCPUState *s) { return s->mcycle; }
 
+void riscv_cpu_print_stats(RISCVCPUState *s) {
+    fprintf(dromajo_stderr, "hartid=%d: %" PRIu64 " instructions, %" PRIu64 " page table walks, %" PRIu64 " PTE reads\n",
+            (int)s->mhartid, s->minstret, s->ptw_count, s->pte_read_count);
+    fprintf(dromajo_stderr, "hartid=%d: TLB %" PRIu64 " hits %" PRIu64 " misses, L2 TLB %" PRIu64 " hits %" PRIu64 " misses\n",
+            (int)s->mhartid, s->tlb_hit_count, s->tlb_miss_count, s->l2_tlb_hit_count, s->l2_tlb_miss_count);
+}
+
 void riscv_cpu_set_mip(RISCVCPUState *s, uint32_t mask) {
-    s->mip |= mask;
+    uint32_t mip = __atomic_or_fetch(&s->mip, mask, __ATOMIC_SEQ_CST);
     /* exit from power down if an interrupt is pending */
-    if (s->power_down_flag && (s->mip & s->mie) != 0 && (s->machine->common.pending_interrupt != -1 || !s->machine->common.cosim))
+    if (s->power_down_flag && (mip & s->mie) != 0 && (s->machine->common.pending_interrupt != -1 || !s->machine->common.cosim))
         s->power_down_flag = FALSE;
 }
 
-void riscv_cpu_reset_mip(RISCVCPUState *s, uint32_t mask) { s->mip &= ~mask; }
+void riscv_cpu_reset_mip(RISCVCPUState *s, uint32_t mask) { __atomic_and_fetch(&s->mip, ~mask, __ATOMIC_SEQ_CST); }
 
 uint32_t riscv_cpu_get_mip(RISCVCPUState *s) { return s->mip; }
 
 BOOL riscv_cpu_get_power_down(RISCVCPUState *s) { return s->power_down_flag; }
 
+/* A hart that ran WFI stays stalled until one of the interrupts it
+ * enables is pending, whether or not it is globally enabled. */
+BOOL riscv_cpu_stalled(RISCVCPUState *s) {
+    if (s->power_down_flag && (s->mip & s->mie) != 0)
+        s->power_down_flag = FALSE;
+    return s->power_down_flag;
+}
+
+/* Let n_cycles go by without retiring any instruction */
+void riscv_cpu_idle(RISCVCPUState *s, uint64_t n_cycles) {
+    if (!s->stop_the_counter)
+        s->mcycle += n_cycles;
+}
+
 RISCVCPUState *riscv_cpu_init(RISCVMachine *machine, int hartid) {
-    RISCVCPUState *s   = (RISCVCPUState *)mallocz(sizeof *s);
+    RISCVCPUState *s   = (RISCVCPUState *)hart_mallocz(sizeof *s);
     s->machine         = machine;
     s->mem_map         = machine->mem_map;
     s->pc              = machine->reset_vector;
@@ -1821,7 +2536,13 @@ RISCVCPUState *riscv_cpu_init(RISCVMachine *machine, int hartid) {
 
     s->dcsr = (1 << 30) + 3;
 
-    tlb_init(s);
+    tlb_init(s, machine->tlb_size, machine->l2_tlb_size);
+
+    uint32_t decode_cache_size = DECODE_CACHE_SIZE;
+    while (decode_cache_size > DECODE_CACHE_MIN && decode_cache_size * machine->ncpus > DECODE_CACHE_TOTAL)
+        decode_cache_size /= 2;
+    s->decode_cache      = (DecodedPage **)hart_mallocz(decode_cache_size * sizeof *s->decode_cache);
+    s->decode_cache_mask = decode_cache_size - 1;
 
     // Exit code of the user-space benchmark app
     s->benchmark_exit_code = 0;
@@ -1829,7 +2550,15 @@ RISCVCPUState *riscv_cpu_init(RISCVMachine *machine, int hartid) {
     return s;
 }
 
-void riscv_cpu_end(RISCVCPUState *s) { free(s); }
+void riscv_cpu_end(RISCVCPUState *s) {
+#ifdef JIT
+    riscv_jit_end(s);
+#endif
+    tlb_end(s);
+    for (uint32_t i = 0; i <= s->decode_cache_mask; i++) free(s->decode_cache[i]);
+    free(s->decode_cache);
+    free(s);
+}
 
 void riscv_set_pc(RISCVCPUState *s, uint64_t val) { s->pc = val & (s->misa & MCPUID_C ? ~1 : ~3); }
 
@@ -1918,7 +2647,10 @@ void riscv_get_ctf_target(RISCVCPUState *s, uint64_t *target) { *target = s->nex
 
 BOOL riscv_terminated(RISCVCPUState *s) { return s->terminate_simulation; }
 
-void riscv_set_debug_mode(RISCVCPUState *s, bool on) { s->debug_mode = on; }
+void riscv_set_debug_mode(RISCVCPUState *s, bool on) {
+    s->debug_mode = on;
+    update_triggers(s);
+}
 
 static void serialize_memory(const void *base, size_t size, const char *file) {
     int f_fd = open(file, O_CREAT | O_WRONLY | O_TRUNC, 0777);
@@ -1980,6 +2712,8 @@ static uint32_t create_ld(int rd, int rs1) { return 3 | ((rd & 0x1F) << 7) | (3
 
 static uint32_t create_sd(int rs1, int rs2) { return 0x23 | ((rs2 & 0x1F) << 20) | (3 << 12) | ((rs1 & 0x1F) << 15); }
 
+static uint32_t create_sw(int rs1, int rs2) { return 0x23 | ((rs2 & 0x1F) << 20) | (2 << 12) | ((rs1 & 0x1F) << 15); }
+
 static uint32_t create_fld(int rd, int rs1) { return 7 | ((rd & 0x1F) << 7) | (0x3 << 12) | ((rs1 & 0x1F) << 15); }
 
 static void create_csr12_recovery(uint32_t *rom, uint32_t *code_pos, uint32_t csrn, uint16_t val) {
@@ -2101,6 +2835,27 @@ static void create_io64_recovery(uint32_t *rom, uint32_t *code_pos, uint32_t *da
     rom[(*data_pos)++] = val >> 32;
 }
 
+static void create_io32_recovery(uint32_t *rom, uint32_t *code_pos, uint32_t *data_pos, uint64_t addr, uint32_t val) {
+    uint32_t data_off = sizeof(uint32_t) * (*data_pos - *code_pos);
+
+    rom[(*code_pos)++] = create_auipc(1, data_off);
+    rom[(*code_pos)++] = create_addi(1, data_off);
+    rom[(*code_pos)++] = create_ld(1, 1);
+
+    rom[(*data_pos)++] = addr & 0xFFFFFFFF;
+    rom[(*data_pos)++] = addr >> 32;
+
+    uint32_t data_off2 = sizeof(uint32_t) * (*data_pos - *code_pos);
+    rom[(*code_pos)++] = create_auipc(2, data_off2);
+    rom[(*code_pos)++] = create_addi(2, data_off2);
+    rom[(*code_pos)++] = create_ld(2, 2);
+
+    rom[(*code_pos)++] = create_sw(1, 2);
+
+    rom[(*data_pos)++] = val;
+    rom[(*data_pos)++] = 0;
+}
+
 static void create_hang_nonzero_hart(uint32_t *rom, uint32_t *code_pos, uint32_t *data_pos) {
     /* Note, this matches the boot loader prologue from copy_kernel() */
 
@@ -2111,23 +2866,23 @@ static void create_hang_nonzero_hart(uint32_t *rom, uint32_t *code_pos, uint32_t
                                       // 1:
 }
 
-static void create_boot_rom(RISCVCPUState *s, const char *file, const uint64_t clint_base_addr) {
-    uint32_t rom[ROM_SIZE / 4];
-    memset(rom, 0, sizeof rom);
-
-    // ROM organization
-    // 0000..003F wasted
-    // 0040..0AFF boot code (2,752 B)
-    // 0B00..0FFF boot data (  512 B)
-
-    uint32_t code_pos       = (BOOT_BASE_ADDR - ROM_BASE_ADDR) / sizeof *rom;
-    uint32_t data_pos       = 0xB00 / sizeof *rom;
-    uint32_t data_pos_start = data_pos;
+/* With several harts, each one restores itself with the code of its own
+ * ROM_SIZE window of the ROM.  This prologue of window 0 sends every
+ * hart to the same offset, right after it, in its window. */
+static void create_dispatch_harts(uint32_t *rom, uint32_t *code_pos) {
+    static_assert(ROM_SIZE_LOG2 < 64, "the shift amount of slli is 6 bits");
+
+    rom[(*code_pos)++] = 0xf14020f3;                        // csrr   x1, mhartid
+    rom[(*code_pos)++] = 0x00009093 | ROM_SIZE_LOG2 << 20;  // slli   x1, x1, ROM_SIZE_LOG2
+    rom[(*code_pos)++] = 0x00000117;                        // auipc  x2, 0
+    rom[(*code_pos)++] = 0x002080b3;                        // add    x1, x1, x2
+    rom[(*code_pos)++] = 0x00c08067;                        // jr     12(x1)
+}
 
-    if (s->machine->ncpus == 1)  // FIXME: May be interesting to freeze hartid >= ncpus
-        create_hang_nonzero_hart(rom, &code_pos, &data_pos);
+static void create_hart_recovery(RISCVCPUState *s, uint32_t *rom, uint32_t *code_pos, uint32_t *data_pos) {
+    RISCVMachine *m = s->machine;
 
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x7b1, s->pc);  // Write to DPC (CSR, 0x7b1)
+    create_csr64_recovery(rom, code_pos, data_pos, 0x7b1, s->pc);  // Write to DPC (CSR, 0x7b1)
 
     // Write current priviliege level to prv in dcsr (0 user, 1 supervisor, 2 user)
     // dcsr is at 0x7b0 prv is bits 0 & 1
@@ -2139,97 +2894,113 @@ static void create_boot_rom(RISCVCPUState *s, const char *file, const uint64_t c
         exit(-4);
     }
 
-    create_csr12_recovery(rom, &code_pos, 0x7b0, 0x600 | s->priv);
+    create_csr12_recovery(rom, code_pos, 0x7b0, 0x600 | s->priv);
 
 #ifdef LIVECACHE
-    uint64_t  n_addr=0;
-    uint64_t  n_addr_to_skip=0;
-    uint64_t *addr = s->machine->llc->traverse(n_addr);
-
-    if (n_addr > (ROM_SIZE-1024)) {
-        fprintf(stderr, "LiveCache: truncating boot rom from %d to %d (you may want to increase ROM_SIZE for better warmup)\n", n_addr, ROM_SIZE-1024);
-        n_addr_to_skip = n_addr - (ROM_SIZE - 1024);
-    }
-    uint32_t n_entries = n_addr-n_addr_to_skip;
+    if (s->mhartid == 0) {  // the cache is shared, warm it up once
+        uint64_t  n_addr=0;
+        uint64_t  n_addr_to_skip=0;
+        uint64_t *addr = m->llc->traverse(n_addr);
+
+        if (n_addr > (ROM_SIZE-1024)) {
+            fprintf(stderr, "LiveCache: truncating boot rom from %d to %d (you may want to increase ROM_SIZE for better warmup)\n", n_addr, ROM_SIZE-1024);
+            n_addr_to_skip = n_addr - (ROM_SIZE - 1024);
+        }
+        uint32_t n_entries = n_addr-n_addr_to_skip;
 
-    create_warmup_loop(rom, &code_pos, &data_pos, n_entries);
-    for (size_t i = n_addr_to_skip; i < n_addr; ++i) {
-        uint64_t a = addr[i] & ~0x1ULL;
-        printf("addr:%llx %s\n", (unsigned long long)a, (addr[i] & 1) ? "ST" : "LD");
-        create_warmup_data(rom, &data_pos, addr[i]);
+        create_warmup_loop(rom, code_pos, data_pos, n_entries);
+        for (size_t i = n_addr_to_skip; i < n_addr; ++i) {
+            uint64_t a = addr[i] & ~0x1ULL;
+            printf("addr:%llx %s\n", (unsigned long long)a, (addr[i] & 1) ? "ST" : "LD");
+            create_warmup_data(rom, data_pos, addr[i]);
+        }
     }
 #endif
 
     // NOTE: mstatus & misa should be one of the first because risvemu breaks down this
     // register for performance reasons. E.g: restoring the fflags also changes
     // parts of the mstats
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x300, get_mstatus(s, (target_ulong)-1));   // mstatus
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x301, s->misa | ((target_ulong)2 << 62));  // misa
+    create_csr64_recovery(rom, code_pos, data_pos, 0x300, get_mstatus(s, (target_ulong)-1));   // mstatus
+    create_csr64_recovery(rom, code_pos, data_pos, 0x301, s->misa | ((target_ulong)2 << 62));  // misa
 
     // All the remaining CSRs
     if (s->fs) {  // If the FPU is down, you can not recover flags
-        create_csr12_recovery(rom, &code_pos, 0x001, s->fflags);
+        create_csr12_recovery(rom, code_pos, 0x001, s->fflags);
         // Only if fflags, otherwise it would raise an illegal instruction
-        create_csr12_recovery(rom, &code_pos, 0x002, s->frm);
-        create_csr12_recovery(rom, &code_pos, 0x003, s->fflags | (s->frm << 5));
+        create_csr12_recovery(rom, code_pos, 0x002, s->frm);
+        create_csr12_recovery(rom, code_pos, 0x003, s->fflags | (s->frm << 5));
 
         // do the FP registers, iff fs is set
         for (int i = 0; i < 32; i++) {
-            uint32_t data_off = sizeof(uint32_t) * (data_pos - code_pos);
-            rom[code_pos++]   = create_auipc(1, data_off);
-            rom[code_pos++]   = create_addi(1, data_off);
-            rom[code_pos++]   = create_fld(i, 1);
+            uint32_t data_off = sizeof(uint32_t) * (*data_pos - *code_pos);
+            rom[(*code_pos)++] = create_auipc(1, data_off);
+            rom[(*code_pos)++] = create_addi(1, data_off);
+            rom[(*code_pos)++] = create_fld(i, 1);
 
-            rom[data_pos++] = (uint32_t)s->fp_reg[i];
-            rom[data_pos++] = (uint64_t)s->reg[i] >> 32;
+            rom[(*data_pos)++] = (uint32_t)s->fp_reg[i];
+            rom[(*data_pos)++] = (uint64_t)s->reg[i] >> 32;
         }
     }
 
     // Recover CPU CSRs
 
     // Cycle and instruction are alias across modes. Just write to m-mode counter
-    // Already done before CLINT. create_csr64_recovery(rom, &code_pos, &data_pos, 0xb00, s->insn_counter); // mcycle
-    // create_csr64_recovery(rom, &code_pos, &data_pos, 0xb02, s->insn_counter); // instret
+    // Already done before CLINT. create_csr64_recovery(rom, code_pos, data_pos, 0xb00, s->insn_counter); // mcycle
+    // create_csr64_recovery(rom, code_pos, data_pos, 0xb02, s->insn_counter); // instret
 
     for (int i = 3; i < 32; ++i) {
-        create_csr12_recovery(rom, &code_pos, 0xb00 + i, 0);                           // reset mhpmcounter3..31
-        create_csr64_recovery(rom, &code_pos, &data_pos, 0x320 + i, s->mhpmevent[i]);  // mhpmevent3..31
-    }
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x7a0, s->tselect);  // tselect
-    // FIXME: create_csr64_recovery(rom, &code_pos, &data_pos, 0x7a1, s->tdata1); // tdata1
-    // FIXME: create_csr64_recovery(rom, &code_pos, &data_pos, 0x7a2, s->tdata2); // tdata2
-
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x302, s->medeleg);
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x303, s->mideleg);
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x304, s->mie);  // mie & sie
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x305, s->mtvec);
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x105, s->stvec);
-    create_csr12_recovery(rom, &code_pos, 0x320, s->mcountinhibit);
-    create_csr12_recovery(rom, &code_pos, 0x306, s->mcounteren);
-    create_csr12_recovery(rom, &code_pos, 0x106, s->scounteren);
+        create_csr12_recovery(rom, code_pos, 0xb00 + i, 0);                         // reset mhpmcounter3..31
+        create_csr64_recovery(rom, code_pos, data_pos, 0x320 + i, s->mhpmevent[i]);  // mhpmevent3..31
+    }
+    create_csr64_recovery(rom, code_pos, data_pos, 0x7a0, s->tselect);  // tselect
+    // FIXME: create_csr64_recovery(rom, code_pos, data_pos, 0x7a1, s->tdata1); // tdata1
+    // FIXME: create_csr64_recovery(rom, code_pos, data_pos, 0x7a2, s->tdata2); // tdata2
+
+    create_csr64_recovery(rom, code_pos, data_pos, 0x302, s->medeleg);
+    create_csr64_recovery(rom, code_pos, data_pos, 0x303, s->mideleg);
+    create_csr64_recovery(rom, code_pos, data_pos, 0x304, s->mie);  // mie & sie
+    create_csr64_recovery(rom, code_pos, data_pos, 0x305, s->mtvec);
+    create_csr64_recovery(rom, code_pos, data_pos, 0x105, s->stvec);
+    create_csr12_recovery(rom, code_pos, 0x320, s->mcountinhibit);
+    create_csr12_recovery(rom, code_pos, 0x306, s->mcounteren);
+    create_csr12_recovery(rom, code_pos, 0x106, s->scounteren);
 
     // NB: restore addr before cfgs for fewer surprises!
-    for (int i = 0; i < 16; ++i) create_csr64_recovery(rom, &code_pos, &data_pos, CSR_PMPADDR(i), s->csr_pmpaddr[i]);
-    for (int i = 0; i < 4; i += 2) create_csr64_recovery(rom, &code_pos, &data_pos, CSR_PMPCFG(i), s->csr_pmpcfg[i]);
+    for (int i = 0; i < 16; ++i) create_csr64_recovery(rom, code_pos, data_pos, CSR_PMPADDR(i), s->csr_pmpaddr[i]);
+    for (int i = 0; i < 4; i += 2) create_csr64_recovery(rom, code_pos, data_pos, CSR_PMPCFG(i), s->csr_pmpcfg[i]);
 
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x340, s->mscratch);
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x341, s->mepc);
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x342, s->mcause);
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x343, s->mtval);
+    create_csr64_recovery(rom, code_pos, data_pos, 0x340, s->mscratch);
+    create_csr64_recovery(rom, code_pos, data_pos, 0x341, s->mepc);
+    create_csr64_recovery(rom, code_pos, data_pos, 0x342, s->mcause);
+    create_csr64_recovery(rom, code_pos, data_pos, 0x343, s->mtval);
 
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x140, s->sscratch);
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x141, s->sepc);
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x142, s->scause);
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x143, s->stval);
+    create_csr64_recovery(rom, code_pos, data_pos, 0x140, s->sscratch);
+    create_csr64_recovery(rom, code_pos, data_pos, 0x141, s->sepc);
+    create_csr64_recovery(rom, code_pos, data_pos, 0x142, s->scause);
+    create_csr64_recovery(rom, code_pos, data_pos, 0x143, s->stval);
 
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x344, s->mip);  // mip & sip
+    create_csr64_recovery(rom, code_pos, data_pos, 0x344, s->mip);  // mip & sip
 
     for (int i = 3; i < 32; i++) {  // Not 1 and 2 which are used by create_...
-        create_reg_recovery(rom, &code_pos, &data_pos, i, s->reg[i]);
+        create_reg_recovery(rom, code_pos, data_pos, i, s->reg[i]);
     }
 
+    // Recover the PLIC: the priorities are shared, the enables are per hart
+    // context, and only the ones that are set need to be written
+    if (s->mhartid == 0) {
+        for (int i = 0; i < PLIC_NUM_SOURCES; ++i)
+            if (m->plic_priority[i])
+                create_io32_recovery(rom, code_pos, data_pos, m->plic_base_addr + PLIC_PRIORITY_BASE + 4 * i, m->plic_priority[i]);
+    }
+    for (int ctx = 0; ctx < 2; ++ctx)
+        if (s->plic_enable_irq[ctx])
+            create_io32_recovery(rom,
+                                 code_pos,
+                                 data_pos,
+                                 m->plic_base_addr + PLIC_ENABLE_BASE + PLIC_ENABLE_STRIDE * (2 * s->mhartid + ctx),
+                                 s->plic_enable_irq[ctx]);
+
     // Recover CLINT (Close to the end of the recovery to avoid extra cycles)
-    // TODO: One per hart (multicore/SMP)
 
     fprintf(dromajo_stderr,
             "clint hartid=%d timecmp=%" PRId64 " cycles (%" PRId64 ")\n",
@@ -2237,49 +3008,74 @@ static void create_boot_rom(RISCVCPUState *s, const char *file, const uint64_t c
             s->timecmp,
             s->mcycle / RTC_FREQ_DIV);
 
+    if (s->mip & MIP_MSIP)
+        create_io32_recovery(rom, code_pos, data_pos, m->clint_base_addr + 4 * s->mhartid, 1);
+
     // Assuming 16 ratio between CPU and CLINT and that CPU is reset to zero
-    create_io64_recovery(rom, &code_pos, &data_pos, clint_base_addr + 0x4000, s->timecmp);
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0xb02, s->minstret);
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0xb00, s->mcycle);
+    create_io64_recovery(rom, code_pos, data_pos, m->clint_base_addr + 0x4000 + 8 * s->mhartid, s->timecmp);
+    create_csr64_recovery(rom, code_pos, data_pos, 0xb02, s->minstret);
+    create_csr64_recovery(rom, code_pos, data_pos, 0xb00, s->mcycle);
 
-    create_io64_recovery(rom, &code_pos, &data_pos, clint_base_addr + 0xbff8, s->mcycle / RTC_FREQ_DIV);
+    // mtime follows the mcycle of hart 0
+    if (s->mhartid == 0)
+        create_io64_recovery(rom, code_pos, data_pos, m->clint_base_addr + 0xbff8, s->mcycle / RTC_FREQ_DIV);
 
     for (int i = 1; i < 3; i++) {  // recover 1 and 2 now
-        create_reg_recovery(rom, &code_pos, &data_pos, i, s->reg[i]);
+        create_reg_recovery(rom, code_pos, data_pos, i, s->reg[i]);
     }
 
-    rom[code_pos++] = create_csrrw(1, 0x7b2);
-    create_csr64_recovery(rom, &code_pos, &data_pos, 0x180, s->satp);
+    rom[(*code_pos)++] = create_csrrw(1, 0x7b2);
+    create_csr64_recovery(rom, code_pos, data_pos, 0x180, s->satp);
     // last Thing because it changes addresses. Use dscratch register to remember reg 1
-    rom[code_pos++] = create_csrrs(1, 0x7b2);
+    rom[(*code_pos)++] = create_csrrs(1, 0x7b2);
 
     // dret 0x7b200073
-    rom[code_pos++] = 0x7b200073;
+    rom[(*code_pos)++] = 0x7b200073;
+}
 
-    if (sizeof rom / sizeof *rom <= data_pos || data_pos_start <= code_pos) {
-        fprintf(dromajo_stderr,
-                "ERROR: ROM is too small. ROM_SIZE should increase.  "
-                "Current code_pos=%d data_pos=%d\n",
-                code_pos,
-                data_pos);
-        exit(-6);
-    }
+/* Returns false, without writing file, if the recovery code does not fit */
+static bool create_boot_rom(RISCVMachine *m, const char *file) {
+    uint32_t *rom   = (uint32_t *)mallocz(m->rom_size);
+    uint32_t  entry = (BOOT_BASE_ADDR - ROM_BASE_ADDR) / sizeof *rom;
 
-    serialize_memory(rom, ROM_SIZE, file);
-}
+    // ROM organization, repeated in the ROM_SIZE window of every hart
+    // 0000..003F hart dispatch, or wasted
+    // 0040..0AFF boot code (2,752 B)
+    // 0B00..0FFF boot data (  512 B)
 
-void riscv_cpu_serialize(RISCVCPUState *s, const char *dump_name, const uint64_t clint_base_addr) {
-    FILE * conf_fd   = 0;
-    size_t n         = strlen(dump_name) + 64;
-    char * conf_name = (char *)alloca(n);
-    snprintf(conf_name, n, "%s.re_regs", dump_name);
+    if (m->ncpus == 1)  // FIXME: May be interesting to freeze hartid >= ncpus
+        create_hang_nonzero_hart(rom, &entry, NULL);
+    else
+        create_dispatch_harts(rom, &entry);
+
+    for (int i = 0; i < m->ncpus; ++i) {
+        uint32_t window         = i * (ROM_SIZE / sizeof *rom);
+        uint32_t code_pos       = window + entry;
+        uint32_t data_pos       = window + 0xB00 / sizeof *rom;
+        uint32_t data_pos_start = data_pos;
+
+        create_hart_recovery(m->cpu_state[i], rom, &code_pos, &data_pos);
+
+        if (window + ROM_SIZE / sizeof *rom <= data_pos || data_pos_start <= code_pos) {
+            fprintf(dromajo_stderr,
+                    "WARNING: ROM is too small. ROM_SIZE should increase.  "
+                    "Current hartid=%d code_pos=%d data_pos=%d\n",
+                    i,
+                    code_pos - window,
+                    data_pos - window);
+            free(rom);
+            return false;
+        }
+    }
 
-    conf_fd = fopen(conf_name, "w");
-    if (conf_fd == 0)
-        err(-3, "opening %s for serialization", conf_name);
+    serialize_memory(rom, m->rom_size, file);
+    free(rom);
+    return true;
+}
 
-    fprintf(conf_fd, "# DROMAJO serialization file\n");
+static_assert(CKPT_PAGE_SIZE == DEVRAM_PAGE_SIZE, "incremental checkpoints store the pages of the RAM dirty bits");
 
+static void serialize_hart(RISCVCPUState *s, FILE *conf_fd) {
     fprintf(conf_fd, "pc:0x%llx\n", (long long)s->pc);
 
     for (int i = 1; i < 32; i++) {
@@ -2326,29 +3122,392 @@ void riscv_cpu_serialize(RISCVCPUState *s, const char *dump_name, const uint64_t
 
     for (int i = 0; i < 4; i += 2) fprintf(conf_fd, "pmpcfg%d:%llx\n", i, (unsigned long long)s->csr_pmpcfg[i]);
     for (int i = 0; i < 16; ++i) fprintf(conf_fd, "pmpaddr%d:%llx\n", i, (unsigned long long)s->csr_pmpaddr[i]);
+}
+
+/* Binary state of the harts and the devices, <name>.cpustate, that Dromajo
+ * loads straight back into them, while RTL goes through the recovery code of
+ * the boot ROM. The layout is the one of the build, which the header checks. */
+#define CPUSTATE_MAGIC   "DROMAJOC"
+#define CPUSTATE_VERSION 2
+
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t ncpus;
+    uint32_t hart_size; /* sizeof(CPUStateHart) */
+    uint32_t reserved;
+} CPUStateHeader;
+
+typedef struct {
+    uint64_t pc;
+    uint64_t reg[32];
+#if FLEN > 0
+    fp_uint  fp_reg[32];
+    uint64_t fflags;
+    uint64_t frm;
+#endif
+    uint64_t priv;
+    uint64_t fs;
+    uint64_t power_down; /* in WFI */
+
+    uint64_t mstatus;
+    uint64_t misa;
+    uint64_t mie;
+    uint64_t mip;
+    uint64_t medeleg;
+    uint64_t mideleg;
+    uint64_t mcounteren;
+    uint64_t mcountinhibit;
+    uint64_t mtvec;
+    uint64_t mscratch;
+    uint64_t mepc;
+    uint64_t mcause;
+    uint64_t mtval;
+    uint64_t mhpmevent[32];
+    uint64_t minstret;
+    uint64_t mcycle;
+    uint64_t insn_counter;
+
+    uint64_t scounteren;
+    uint64_t stvec;
+    uint64_t sscratch;
+    uint64_t sepc;
+    uint64_t scause;
+    uint64_t stval;
+    uint64_t satp;
+
+    uint64_t tselect;
+    uint64_t tdata1[MAX_TRIGGERS];
+    uint64_t tdata2[MAX_TRIGGERS];
+    uint64_t dcsr;
+    uint64_t dpc;
+    uint64_t dscratch;
+
+    uint64_t pmpcfg[4];
+    uint64_t pmpaddr[16];
+
+    /* LR/SC reservation */
+    uint64_t load_res;
+    uint64_t load_res_val;
+    uint64_t reserved_line;
+
+    /* device registers of the hart */
+    uint64_t timecmp;
+    uint64_t plic_enable_irq[2];
+} CPUStateHart;
+
+static void save_hart_state(RISCVCPUState *s, CPUStateHart *h) {
+    memset(h, 0, sizeof *h);
+
+    h->pc = s->pc;
+    for (int i = 0; i < 32; ++i) h->reg[i] = s->reg[i];
+#if FLEN > 0
+    for (int i = 0; i < 32; ++i) h->fp_reg[i] = s->fp_reg[i];
+    h->fflags = s->fflags;
+    h->frm    = s->frm;
+#endif
+    h->priv       = s->priv;
+    h->fs         = s->fs;
+    h->power_down = s->power_down_flag;
+
+    h->mstatus       = s->mstatus;
+    h->misa          = s->misa;
+    h->mie           = s->mie;
+    h->mip           = s->mip;
+    h->medeleg       = s->medeleg;
+    h->mideleg       = s->mideleg;
+    h->mcounteren    = s->mcounteren;
+    h->mcountinhibit = s->mcountinhibit;
+    h->mtvec         = s->mtvec;
+    h->mscratch      = s->mscratch;
+    h->mepc          = s->mepc;
+    h->mcause        = s->mcause;
+    h->mtval         = s->mtval;
+    for (int i = 0; i < 32; ++i) h->mhpmevent[i] = s->mhpmevent[i];
+    h->minstret     = s->minstret;
+    h->mcycle       = s->mcycle;
+    h->insn_counter = s->insn_counter;
+
+    h->scounteren = s->scounteren;
+    h->stvec      = s->stvec;
+    h->sscratch   = s->sscratch;
+    h->sepc       = s->sepc;
+    h->scause     = s->scause;
+    h->stval      = s->stval;
+    h->satp       = s->satp;
+
+    h->tselect = s->tselect;
+    for (int i = 0; i < MAX_TRIGGERS; ++i) {
+        h->tdata1[i] = s->tdata1[i];
+        h->tdata2[i] = s->tdata2[i];
+    }
+    h->dcsr     = s->dcsr;
+    h->dpc      = s->dpc;
+    h->dscratch = s->dscratch;
+
+    for (int i = 0; i < 4; ++i) h->pmpcfg[i] = s->csr_pmpcfg[i];
+    for (int i = 0; i < 16; ++i) h->pmpaddr[i] = s->csr_pmpaddr[i];
+
+    h->load_res      = s->load_res;
+    h->load_res_val  = s->load_res_val;
+    h->reserved_line = s->machine->reserved_line[s->mhartid];
+
+    h->timecmp            = s->timecmp;
+    h->plic_enable_irq[0] = s->plic_enable_irq[0];
+    h->plic_enable_irq[1] = s->plic_enable_irq[1];
+}
+
+/* The device registers are left to restore_device_state() */
+static void load_hart_state(RISCVCPUState *s, const CPUStateHart *h) {
+    s->pc = h->pc;
+    for (int i = 0; i < 32; ++i) s->reg[i] = h->reg[i];
+#if FLEN > 0
+    for (int i = 0; i < 32; ++i) s->fp_reg[i] = h->fp_reg[i];
+    s->fflags = h->fflags;
+    s->frm    = h->frm;
+#endif
+    s->priv             = h->priv;
+    s->fs               = h->fs;
+    s->power_down_flag  = h->power_down;
+    s->debug_mode       = FALSE;
+    s->stop_the_counter = FALSE;
+
+    s->mstatus       = h->mstatus;
+    s->misa          = h->misa;
+    s->mie           = h->mie;
+    s->mip           = h->mip;
+    s->medeleg       = h->medeleg;
+    s->mideleg       = h->mideleg;
+    s->mcounteren    = h->mcounteren;
+    s->mcountinhibit = h->mcountinhibit;
+    s->mtvec         = h->mtvec;
+    s->mscratch      = h->mscratch;
+    s->mepc          = h->mepc;
+    s->mcause        = h->mcause;
+    s->mtval         = h->mtval;
+    for (int i = 0; i < 32; ++i) s->mhpmevent[i] = h->mhpmevent[i];
+    s->minstret     = h->minstret;
+    s->mcycle       = h->mcycle;
+    s->insn_counter = h->insn_counter;
+
+    s->scounteren = h->scounteren;
+    s->stvec      = h->stvec;
+    s->sscratch   = h->sscratch;
+    s->sepc       = h->sepc;
+    s->scause     = h->scause;
+    s->stval      = h->stval;
+    s->satp       = h->satp;
+
+    s->tselect = h->tselect;
+    for (int i = 0; i < MAX_TRIGGERS; ++i) {
+        s->tdata1[i] = h->tdata1[i];
+        s->tdata2[i] = h->tdata2[i];
+    }
+    s->dcsr     = h->dcsr;
+    s->dpc      = h->dpc;
+    s->dscratch = h->dscratch;
+
+    for (int i = 0; i < 4; ++i) s->csr_pmpcfg[i] = h->pmpcfg[i];
+    for (int i = 0; i < 16; ++i) s->csr_pmpaddr[i] = h->pmpaddr[i];
+
+    s->load_res                           = h->load_res;
+    s->load_res_val                       = h->load_res_val;
+    s->machine->reserved_line[s->mhartid] = h->reserved_line;
+
+    // What the CSR writes would have derived
+    unpack_pmpaddrs(s);
+    tlb_set_satp(s);
+    update_triggers(s);
+}
+
+static void save_cpu_state(RISCVMachine *m, const char *file) {
+    FILE *f = fopen(file, "wb");
+    if (!f)
+        err(-3, "trying to write %s", file);
+
+    CPUStateHeader hdr;
+    memset(&hdr, 0, sizeof hdr);
+    memcpy(hdr.magic, CPUSTATE_MAGIC, sizeof hdr.magic);
+    hdr.version   = CPUSTATE_VERSION;
+    hdr.ncpus     = m->ncpus;
+    hdr.hart_size = sizeof(CPUStateHart);
+
+    if (fwrite(&hdr, sizeof hdr, 1, f) != 1)
+        err(-3, "while writing %s", file);
+
+    for (int i = 0; i < m->ncpus; ++i) {
+        CPUStateHart h;
+        save_hart_state(m->cpu_state[i], &h);
+        if (fwrite(&h, sizeof h, 1, f) != 1)
+            err(-3, "while writing %s", file);
+    }
+
+    if (!phys_mem_save_devices(m->mem_map, f) || fclose(f))
+        err(-3, "while writing %s", file);
+}
+
+/* Stores to the device registers, like the recovery code of the ROM does */
+static void restore_io32(RISCVMachine *m, uint64_t addr, uint32_t val) {
+    PhysMemoryRange *pr = get_phys_mem_range(m->mem_map, addr);
+
+    if (!pr || pr->is_ram)
+        errx(-3, "no device at 0x%llx to restore", (unsigned long long)addr);
+    pr->write_func(pr->opaque, addr - pr->addr, val, 2);
+}
+
+static void load_cpu_state(RISCVMachine *m, const char *file) {
+    FILE *f = fopen(file, "rb");
+    if (!f)
+        err(-3, "trying to read %s", file);
+
+    CPUStateHeader hdr;
+    if (fread(&hdr, sizeof hdr, 1, f) != 1 || memcmp(hdr.magic, CPUSTATE_MAGIC, sizeof hdr.magic))
+        errx(-3, "%s: not a hart state file", file);
+    if (hdr.version != CPUSTATE_VERSION || hdr.hart_size != sizeof(CPUStateHart))
+        errx(-3, "%s: saved by an incompatible build of dromajo", file);
+    if (hdr.ncpus != (uint32_t)m->ncpus)
+        errx(-3, "%s: saved with %u harts, not %d", file, hdr.ncpus, m->ncpus);
+
+    CPUStateHart *harts = (CPUStateHart *)malloc(m->ncpus * sizeof *harts);
+
+    if (!harts || fread(harts, sizeof *harts, m->ncpus, f) != (size_t)m->ncpus)
+        errx(-3, "%s: truncated hart state", file);
+
+    // Before the enables below, which raise what the PLIC has pending
+    if (!phys_mem_load_devices(m->mem_map, f))
+        errx(-3, "%s: the device state does not match this machine", file);
+    fclose(f);
+
+    for (int i = 0; i < m->ncpus; ++i) load_hart_state(m->cpu_state[i], &harts[i]);
+    riscv_reservations_update_filter(m);
+
+    // mtime follows the restored mcycle of hart 0
+    riscv_timebase_publish(m);
+
+    for (int i = 0; i < m->ncpus; ++i) {
+        CPUStateHart *h     = &harts[i];
+        uint64_t      clint = m->clint_base_addr + 0x4000 + 8 * i;
+        uint32_t      mip   = m->cpu_state[i]->mip;
+
+        for (int ctx = 0; ctx < 2; ++ctx)
+            if (h->plic_enable_irq[ctx])
+                restore_io32(m, m->plic_base_addr + PLIC_ENABLE_BASE + PLIC_ENABLE_STRIDE * (2 * i + ctx), h->plic_enable_irq[ctx]);
+
+        restore_io32(m, clint, (uint32_t)h->timecmp);
+        restore_io32(m, clint + 4, h->timecmp >> 32);
+
+        // The writes above recompute the interrupts, the saved ones stand
+        m->cpu_state[i]->mip = mip;
+    }
+
+    free(harts);
+}
+
+/* The recovery code replaces the ROM, so no hart may still need it,
+ * unless none of them left the boot code yet */
+static int harts_in_rom(RISCVMachine *m, int *at_boot) {
+    int in_rom = 0;
+
+    *at_boot = 0;
+    for (int i = 0; i < m->ncpus; ++i) {
+        RISCVCPUState *s = m->cpu_state[i];
+
+        if (s->priv == 3 && s->pc <= ROM_BASE_ADDR + m->rom_size) {
+            ++in_rom;
+            *at_boot += s->pc == BOOT_BASE_ADDR;
+        }
+    }
+
+    return in_rom;
+}
+
+BOOL riscv_cpu_can_serialize(RISCVMachine *m) {
+    int at_boot;
+    int in_rom = harts_in_rom(m, &at_boot);
+
+    return in_rom == 0 || at_boot == m->ncpus;
+}
+
+static void ram_write_hook(void *opaque, size_t page_index) { checkpoint_job_preserve((CheckpointJob *)opaque, page_index); }
+
+void riscv_cpu_serialize(RISCVMachine *m, const char *dump_name, BOOL background) {
+    FILE * conf_fd   = 0;
+    size_t n         = strlen(dump_name) + 64;
+    char * conf_name = (char *)alloca(n);
+    snprintf(conf_name, n, "%s.re_regs", dump_name);
+
+    conf_fd = fopen(conf_name, "w");
+    if (conf_fd == 0)
+        err(-3, "opening %s for serialization", conf_name);
+
+    fprintf(conf_fd, "# DROMAJO serialization file\n");
+
+    for (int i = 0; i < m->ncpus; ++i) {
+        if (m->ncpus > 1)
+            fprintf(conf_fd, "hartid:%d\n", i);
+        serialize_hart(m->cpu_state[i], conf_fd);
+    }
 
     PhysMemoryRange *boot_ram       = 0;
     int              main_ram_found = 0;
 
-    for (int i = s->mem_map->n_phys_mem_range - 1; i >= 0; --i) {
-        PhysMemoryRange *pr = &s->mem_map->phys_mem_range[i];
+    for (int i = m->mem_map->n_phys_mem_range - 1; i >= 0; --i) {
+        PhysMemoryRange *pr = &m->mem_map->phys_mem_range[i];
         fprintf(conf_fd, "mrange%d:0x%llx 0x%llx %s\n", i, (long long)pr->addr, (long long)pr->size, pr->is_ram ? "ram" : "io");
 
         if (pr->is_ram && pr->addr == ROM_BASE_ADDR) {
             assert(!boot_ram);
             boot_ram = pr;
 
-        } else if (pr->is_ram && pr->addr == s->machine->ram_base_addr) {
+        } else if (pr->is_ram && pr->addr == m->ram_base_addr) {
             assert(!main_ram_found);
             main_ram_found = 1;
 
             char *f_name = (char *)alloca(strlen(dump_name) + 64);
             sprintf(f_name, "%s.mainram", dump_name);
+            char *chain_name = (char *)alloca(strlen(dump_name) + 64);
+            sprintf(chain_name, "%s.chain", dump_name);
+
+            // Each checkpoint starts over the tracking of the pages written
+            const uint32_t *dirty  = phys_mem_get_dirty_bits(pr);
+            const char *    parent = NULL;
+
+            if (m->common.snapshot_incremental && m->common.snapshot_last_name) {
+                char *parent_chain = (char *)alloca(strlen(m->common.snapshot_last_name) + 64);
+                sprintf(parent_chain, "%s.chain", m->common.snapshot_last_name);
+                if (checkpoint_chain_can_extend(parent_chain, f_name))
+                    parent = parent_chain;
+            }
 
-            serialize_memory(pr->phys_mem, pr->size, f_name);
+            if (background) {
+                // The harts copy the pages they write before the writer gets to them
+                m->checkpoint_job = checkpoint_save_background(pr->phys_mem,
+                                                               pr->size,
+                                                               f_name,
+                                                               parent ? dirty : NULL,
+                                                               !m->common.snapshot_uncompressed,
+                                                               m->common.snapshot_incremental ? chain_name : NULL,
+                                                               parent);
+                pr->write_hook        = ram_write_hook;
+                pr->write_hook_opaque = m->checkpoint_job;
+            } else {
+                checkpoint_save_memory(pr->phys_mem, pr->size, f_name, parent ? dirty : NULL, !m->common.snapshot_uncompressed);
+                if (m->common.snapshot_incremental)
+                    checkpoint_save_chain(chain_name, parent, f_name);
+            }
+
+            if (!m->common.snapshot_incremental)
+                unlink(chain_name);  // a stale chain would take precedence over the new image
         }
     }
 
+    fclose(conf_fd);
+
+    n                = strlen(dump_name) + 64;
+    char *state_name = (char *)alloca(n);
+    snprintf(state_name, n, "%s.cpustate", dump_name);
+    save_cpu_state(m, state_name);
+
     if (!boot_ram || !main_ram_found) {
         fprintf(dromajo_stderr, "ERROR: could not find boot and main ram???\n");
         exit(-3);
@@ -2358,38 +3517,71 @@ void riscv_cpu_serialize(RISCVCPUState *s, const char *dump_name, const uint64_t
     char *f_name = (char *)alloca(n);
     snprintf(f_name, n, "%s.bootram", dump_name);
 
-    if (s->priv != 3 || ROM_BASE_ADDR + ROM_SIZE < s->pc) {
+    int at_boot;
+    int in_rom = harts_in_rom(m, &at_boot);
+
+    if (in_rom == 0) {
         fprintf(dromajo_stderr, "NOTE: creating a new boot rom\n");
-        create_boot_rom(s, f_name, clint_base_addr);
-    } else if (BOOT_BASE_ADDR < s->pc) {
-        fprintf(dromajo_stderr, "ERROR: could not checkpoint when running inside the ROM\n");
-        exit(-4);
-    } else if (s->pc == BOOT_BASE_ADDR && boot_ram) {
+        if (!create_boot_rom(m, f_name)) {
+            // The hart state still lets dromajo restore the checkpoint
+            fprintf(dromajo_stderr, "WARNING: no boot rom, %s can only be loaded by dromajo\n", dump_name);
+            unlink(f_name);
+        }
+    } else if (at_boot == m->ncpus) {
         fprintf(dromajo_stderr, "NOTE: using the default dromajo ROM\n");
         serialize_memory(boot_ram->phys_mem, boot_ram->size, f_name);
     } else {
-        fprintf(dromajo_stderr, "ERROR: unexpected PC address 0x%llx\n", (long long)s->pc);
+        fprintf(dromajo_stderr, "ERROR: could not checkpoint when running inside the ROM\n");
         exit(-4);
     }
 }
 
-void riscv_cpu_deserialize(RISCVCPUState *s, const char *dump_name) {
-    for (int i = s->mem_map->n_phys_mem_range - 1; i >= 0; --i) {
-        PhysMemoryRange *pr = &s->mem_map->phys_mem_range[i];
+void riscv_cpu_serialize_wait(RISCVMachine *m) {
+    if (!m->checkpoint_job)
+        return;
+
+    PhysMemoryRange *pr = get_phys_mem_range(m->mem_map, m->ram_base_addr);
+    pr->write_hook      = NULL;
+
+    checkpoint_job_wait(m->checkpoint_job);
+    m->checkpoint_job = NULL;
+}
+
+void riscv_cpu_deserialize(RISCVMachine *m, const char *dump_name) {
+    /* Without the hart state, from an older dromajo, or in cosimulation
+     * where RTL runs the recovery code, the harts boot from the ROM */
+    size_t n          = strlen(dump_name) + 64;
+    char * state_name = (char *)alloca(n);
+    snprintf(state_name, n, "%s.cpustate", dump_name);
+    bool direct = !m->common.cosim && access(state_name, F_OK) == 0;
+
+    for (int i = m->mem_map->n_phys_mem_range - 1; i >= 0; --i) {
+        PhysMemoryRange *pr = &m->mem_map->phys_mem_range[i];
 
         if (pr->is_ram && pr->addr == ROM_BASE_ADDR) {
-            size_t n         = strlen(dump_name) + 64;
-            char * boot_name = (char *)alloca(n);
+            char *boot_name = (char *)alloca(n);
             snprintf(boot_name, n, "%s.bootram", dump_name);
 
-            deserialize_memory(pr->phys_mem, pr->size, boot_name);
+            // Only the harts restored from the ROM need it
+            if (!direct || access(boot_name, F_OK) == 0)
+                deserialize_memory(pr->phys_mem, pr->size, boot_name);
 
-        } else if (pr->is_ram && pr->addr == s->machine->ram_base_addr) {
-            size_t n         = strlen(dump_name) + 64;
-            char * main_name = (char *)alloca(n);
+        } else if (pr->is_ram && pr->addr == m->ram_base_addr) {
+            char *main_name = (char *)alloca(n);
             snprintf(main_name, n, "%s.mainram", dump_name);
+            char *chain_name = (char *)alloca(n);
+            snprintf(chain_name, n, "%s.chain", dump_name);
 
-            deserialize_memory(pr->phys_mem, pr->size, main_name);
+            if (access(chain_name, F_OK) == 0)
+                checkpoint_load_chain(pr->phys_mem, pr->size, chain_name);
+            else
+                checkpoint_load_memory(pr->phys_mem, pr->size, main_name);
+
+            // The next incremental checkpoint stores what changes from here
+            (void)phys_mem_get_dirty_bits(pr);
         }
     }
+
+    if (direct)
+        load_cpu_state(m, state_name);
 }
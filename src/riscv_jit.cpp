@@ -0,0 +1,751 @@
+/*
+ * Translation of hot blocks of pre-decoded instructions to x86-64 code
+ *
+ * Copyright (C) 2018,2019, Esperanto Technologies Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The interpreter hands over to riscv_jit_run() where it enters a code
+ * page and where it chains a taken jump in the page (JIT_RUN in
+ * dromajo_template.h), if it may still run JIT_MIN_RUN instructions or
+ * more, so not when single stepping.  Once it got to the same pre-decoded instruction
+ * JIT_HOT times, the instructions from there to the first control
+ * transfer of the page, at most JIT_BLOCK_MAX of them, are translated
+ * into a block of host code.
+ *
+ * A block does what the fast handlers of the interpreter do, plus the M
+ * extension and sllw/srlw/sraw, and in the same way: the registers and
+ * reg_prior are updated in place, and loads and stores only go through
+ * the mem_addend of tlb_read and tlb_write.  Anything else, including a
+ * TLB miss, a store to a reserved line and a misaligned jump target,
+ * ends the block before the instruction, which the interpreter runs
+ * next.  Exceptions, CSRs and floating point thus never get here.
+ *
+ * Blocks are looked up by their first pre-decoded instruction, and only
+ * run while the gen of its DecodedPage is the one they were translated
+ * from: a cached code page is never in the write TLB, so that stores to
+ * it go through riscv_cpu_invalidate_decoded(), which bumps gen.
+ *
+ * dromajo_jit_lockstep checks a --jit machine against dromajo_cosim_step().
+ */
+#include "riscv_jit.h"
+
+#ifdef JIT
+
+#ifndef __x86_64__
+#error "JIT translation needs an x86-64 host"
+#endif
+#if defined(PADDR_INLINE) || defined(LIVECACHE) || defined(GOLDMEM_INORDER)
+#error "JIT translation only follows the plain TLB fast path"
+#endif
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "dromajo.h"
+
+#define JIT_TABLE_SIZE  4096      /* blocks per hart, a power of 2 */
+#define JIT_CODE_SIZE   (16 << 20) /* bytes of host code per hart */
+#define JIT_BLOCK_MAX   64        /* instructions per block */
+#define JIT_INSN_BYTES  320       /* host code per instruction, exits included */
+#define JIT_BLOCK_BYTES (64 + JIT_BLOCK_MAX * JIT_INSN_BYTES)
+#define JIT_HOT         16   /* entries before a block is translated */
+#define JIT_COLD        1024 /* entries before trying again to translate one that was not */
+
+/* How a block ends, returned in the upper half of its result, the
+ * number of instructions it ran being in the lower half */
+enum {
+    JIT_CONTINUE, /* at s->pc, in the same page */
+    JIT_REFETCH,  /* at s->pc, through the code TLB */
+    JIT_STOP,     /* at s->pc, which the interpreter must run */
+};
+
+typedef uint64_t (*JitCode)(RISCVCPUState *s);
+
+typedef struct {
+    DecodedPage *page;
+    uint32_t     gen;     /* of page when translated */
+    uint16_t     offset;  /* in page */
+    uint16_t     n_insns; /* at most run by code */
+    int32_t      heat;    /* entries left before translating */
+    JitCode      code;    /* NULL until translated */
+} JitBlock;
+
+struct RISCVJit {
+    JitBlock table[JIT_TABLE_SIZE];
+    uint8_t *code_buf;
+    size_t   code_used;
+};
+
+/* x86-64 registers, and condition codes of jcc and setcc */
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_L = 0xc, CC_GE = 0xd };
+
+/* A block keeps s in rbx and the pc of its first instruction in r12,
+ * both callee saved, and uses rax, rcx, rdx, rsi and r8 */
+#define REG_S    RBX
+#define REG_PC   R12
+#define NO_INDEX 0x10
+
+#define S_OFFSET(field) ((int32_t)offsetof(RISCVCPUState, field))
+#define S_REG(r)        (S_OFFSET(reg) + 8 * (r))
+#define S_REG_PRIOR(r)  (S_OFFSET(reg_prior) + 8 * (r))
+
+/* Where a block leaves before running one of its instructions */
+typedef struct {
+    uint8_t *jump;  /* end of the jcc to it */
+    int      index; /* of the instruction in the block */
+    int32_t  delta; /* of its pc from the one of the block */
+} JitExit;
+
+typedef struct {
+    uint8_t *p;
+    JitExit  exits[2 * JIT_BLOCK_MAX];
+    int      n_exits;
+} JitAsm;
+
+static void emit8(JitAsm *a, uint8_t v) { *a->p++ = v; }
+
+static void emit32(JitAsm *a, uint32_t v) {
+    memcpy(a->p, &v, sizeof v);
+    a->p += sizeof v;
+}
+
+static void emit64(JitAsm *a, uint64_t v) {
+    memcpy(a->p, &v, sizeof v);
+    a->p += sizeof v;
+}
+
+static void emit_rex(JitAsm *a, int w, int reg, int index, int base) {
+    int rex = w << 3 | (reg & 8) >> 1 | (index & 8) >> 2 | (base & 8) >> 3;
+
+    if (rex)
+        emit8(a, 0x40 | rex);
+}
+
+static void emit_opcode(JitAsm *a, int op) {
+    if (op > 0xff)
+        emit8(a, op >> 8);
+    emit8(a, op);
+}
+
+/* op with a register, or an opcode extension, and [base + index + disp];
+ * w selects 64-bit operands */
+static void emit_op_mem(JitAsm *a, int w, int op, int reg, int base, int index, int32_t disp) {
+    int mod = disp == 0 && (base & 7) != RBP ? 0 : disp == (int8_t)disp ? 1 : 2;
+
+    emit_rex(a, w, reg, index == NO_INDEX ? 0 : index, base);
+    emit_opcode(a, op);
+    if (index == NO_INDEX && (base & 7) != RSP) {
+        emit8(a, mod << 6 | (reg & 7) << 3 | (base & 7));
+    } else {
+        emit8(a, mod << 6 | (reg & 7) << 3 | RSP);
+        emit8(a, (index == NO_INDEX ? RSP : index & 7) << 3 | (base & 7));
+    }
+    if (mod == 1)
+        emit8(a, disp);
+    else if (mod == 2)
+        emit32(a, disp);
+}
+
+static void emit_op_rr(JitAsm *a, int w, int op, int reg, int rm) {
+    emit_rex(a, w, reg, 0, rm);
+    emit_opcode(a, op);
+    emit8(a, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+/* add (0), or (1), and (4), sub (5), xor (6) or cmp (7) of imm to rm */
+static void emit_op_imm(JitAsm *a, int w, int ext, int rm, int32_t imm) {
+    if (imm == (int8_t)imm) {
+        emit_op_rr(a, w, 0x83, ext, rm);
+        emit8(a, imm);
+    } else {
+        emit_op_rr(a, w, 0x81, ext, rm);
+        emit32(a, imm);
+    }
+}
+
+/* shl (4), shr (5) or sar (7) of rm by n */
+static void emit_shift_imm(JitAsm *a, int w, int ext, int rm, int n) {
+    emit_op_rr(a, w, 0xc1, ext, rm);
+    emit8(a, n);
+}
+
+static void emit_mov_imm(JitAsm *a, int reg, uint64_t val) {
+    if ((int64_t)val == (int32_t)val) {
+        emit_op_rr(a, 1, 0xc7, 0, reg);
+        emit32(a, val);
+    } else if (val == (uint32_t)val) {
+        emit_rex(a, 0, 0, 0, reg);
+        emit8(a, 0xb8 | (reg & 7));
+        emit32(a, val);
+    } else {
+        emit_rex(a, 1, 0, 0, reg);
+        emit8(a, 0xb8 | (reg & 7));
+        emit64(a, val);
+    }
+}
+
+/* mov dword [s + offset], imm */
+static void emit_store_imm32(JitAsm *a, int32_t offset, uint32_t imm) {
+    emit_op_mem(a, 0, 0xc7, 0, REG_S, NO_INDEX, offset);
+    emit32(a, imm);
+}
+
+static void emit_load_reg(JitAsm *a, int w, int dst, int r) { emit_op_mem(a, w, 0x8b, dst, REG_S, NO_INDEX, S_REG(r)); }
+
+/* as write_reg() in riscv_cpu.cpp, tmp gets clobbered */
+static void emit_write_reg(JitAsm *a, int rd, int src, int tmp) {
+    emit_load_reg(a, 1, tmp, rd);
+    emit_op_mem(a, 1, 0x89, tmp, REG_S, NO_INDEX, S_REG_PRIOR(rd));
+    emit_store_imm32(a, S_OFFSET(most_recently_written_reg), rd);
+    emit_op_mem(a, 1, 0x89, src, REG_S, NO_INDEX, S_REG(rd));
+}
+
+/* eax = 0 or 1 depending on cc, after a cmp */
+static void emit_setcc(JitAsm *a, int cc) {
+    emit_op_rr(a, 0, 0x0f90 | cc, 0, RAX);
+    emit_op_rr(a, 0, 0x0fb6, RAX, RAX);
+}
+
+static void emit_movsxd(JitAsm *a) { emit_op_rr(a, 1, 0x63, RAX, RAX); }
+
+/* Jumps forward, returning where to patch them */
+static uint8_t *emit_jcc8(JitAsm *a, int cc) {
+    emit8(a, 0x70 | cc);
+    emit8(a, 0);
+    return a->p;
+}
+
+static uint8_t *emit_jmp8(JitAsm *a) {
+    emit8(a, 0xeb);
+    emit8(a, 0);
+    return a->p;
+}
+
+static void patch8(uint8_t *jump, uint8_t *target) {
+    assert(target - jump == (int8_t)(target - jump));
+    jump[-1] = target - jump;
+}
+
+static uint8_t *emit_jcc32(JitAsm *a, int cc) {
+    emit_opcode(a, 0x0f80 | cc);
+    emit32(a, 0);
+    return a->p;
+}
+
+static void patch32(uint8_t *jump, uint8_t *target) {
+    int32_t rel = target - jump;
+    memcpy(jump - 4, &rel, sizeof rel);
+}
+
+/* Leave the block if cc, before the instruction index at delta */
+static void emit_exit_if(JitAsm *a, int cc, int index, int32_t delta) {
+    JitExit *e = &a->exits[a->n_exits++];
+
+    assert(a->n_exits <= 2 * JIT_BLOCK_MAX);
+    e->jump  = emit_jcc32(a, cc);
+    e->index = index;
+    e->delta = delta;
+}
+
+static void emit_return(JitAsm *a, int n_insns, int how) {
+    emit_mov_imm(a, RAX, (uint64_t)how << 32 | n_insns);
+    emit8(a, 0x41); /* pop r12 */
+    emit8(a, 0x5c);
+    emit8(a, 0x5b); /* pop rbx */
+    emit8(a, 0xc3); /* ret */
+}
+
+/* s->pc = the pc of the block + delta, then return */
+static void emit_exit(JitAsm *a, int32_t delta, int n_insns, int how) {
+    emit_op_mem(a, 1, 0x8d, RAX, REG_PC, NO_INDEX, delta);
+    emit_op_mem(a, 1, 0x89, RAX, REG_S, NO_INDEX, S_OFFSET(pc));
+    emit_return(a, n_insns, how);
+}
+
+static void emit_alu(JitAsm *a, const DecodedInsn *d, int32_t delta) {
+    switch (d->op) {
+        case DOP_LI: emit_mov_imm(a, RAX, (int64_t)d->imm); break;
+        case DOP_AUIPC:
+            emit_mov_imm(a, RAX, (int64_t)delta + d->imm);
+            emit_op_rr(a, 1, 0x01, REG_PC, RAX);
+            break;
+        case DOP_ADDI:
+        case DOP_SLTI:
+        case DOP_SLTIU:
+        case DOP_XORI:
+        case DOP_ORI:
+        case DOP_ANDI: {
+            static const int ext[] = {0, 7, 7, 6, 1, 4};
+            emit_load_reg(a, 1, RAX, d->rs1);
+            emit_op_imm(a, 1, ext[d->op - DOP_ADDI], RAX, d->imm);
+            if (d->op == DOP_SLTI)
+                emit_setcc(a, CC_L);
+            else if (d->op == DOP_SLTIU)
+                emit_setcc(a, CC_B);
+            break;
+        }
+        case DOP_SLLI:
+        case DOP_SRLI:
+        case DOP_SRAI:
+        case DOP_SLLIW:
+        case DOP_SRLIW:
+        case DOP_SRAIW: {
+            int w = d->op <= DOP_SRAI;
+            int op = w ? d->op - DOP_SLLI : d->op - DOP_SLLIW;
+            emit_load_reg(a, w, RAX, d->rs1);
+            emit_shift_imm(a, w, op == 0 ? 4 : op == 1 ? 5 : 7, RAX, d->imm);
+            if (!w)
+                emit_movsxd(a);
+            break;
+        }
+        case DOP_ADD:
+        case DOP_SUB:
+        case DOP_XOR:
+        case DOP_OR:
+        case DOP_AND:
+        case DOP_SLT:
+        case DOP_SLTU: {
+            int op = d->op == DOP_ADD ? 0x03 : d->op == DOP_SUB ? 0x2b : d->op == DOP_XOR ? 0x33 : d->op == DOP_OR ? 0x0b
+                   : d->op == DOP_AND ? 0x23 : 0x3b;
+            emit_load_reg(a, 1, RAX, d->rs1);
+            emit_op_mem(a, 1, op, RAX, REG_S, NO_INDEX, S_REG(d->rs2));
+            if (d->op == DOP_SLT)
+                emit_setcc(a, CC_L);
+            else if (d->op == DOP_SLTU)
+                emit_setcc(a, CC_B);
+            break;
+        }
+        case DOP_SLL:
+        case DOP_SRL:
+        case DOP_SRA:
+            emit_load_reg(a, 1, RAX, d->rs1);
+            emit_load_reg(a, 1, RCX, d->rs2);
+            emit_op_rr(a, 1, 0xd3, d->op == DOP_SLL ? 4 : d->op == DOP_SRL ? 5 : 7, RAX);
+            break;
+        case DOP_ADDIW:
+            emit_load_reg(a, 0, RAX, d->rs1);
+            emit_op_imm(a, 0, 0, RAX, d->imm);
+            emit_movsxd(a);
+            break;
+        case DOP_ADDW:
+        case DOP_SUBW:
+            emit_load_reg(a, 0, RAX, d->rs1);
+            emit_op_mem(a, 0, d->op == DOP_ADDW ? 0x03 : 0x2b, RAX, REG_S, NO_INDEX, S_REG(d->rs2));
+            emit_movsxd(a);
+            break;
+        default: assert(0);
+    }
+    emit_write_reg(a, d->rd, RAX, RCX);
+}
+
+/* div(u) and rem(u) of rax by rcx, 32 (w = 0) or 64-bit, into rax, with
+ * the results RISC-V gives for a zero divisor and an overflow, on which
+ * x86 traps */
+static void emit_divrem(JitAsm *a, int w, bool is_signed, bool rem) {
+    uint8_t *zero, *minus_one = NULL, *done_minus_one = NULL, *done;
+
+    emit_op_rr(a, w, 0x85, RCX, RCX);
+    zero = emit_jcc8(a, CC_E);
+    if (is_signed) {
+        emit_op_imm(a, w, 7, RCX, -1);
+        minus_one = emit_jcc8(a, CC_NE);
+        if (rem)
+            emit_op_rr(a, 0, 0x31, RAX, RAX);
+        else
+            emit_op_rr(a, w, 0xf7, 3, RAX); /* neg, which keeps the most negative value */
+        done_minus_one = emit_jmp8(a);
+        patch8(minus_one, a->p);
+        emit_rex(a, w, 0, 0, 0); /* cqo or cdq */
+        emit8(a, 0x99);
+        emit_op_rr(a, w, 0xf7, 7, RCX);
+    } else {
+        emit_op_rr(a, 0, 0x31, RDX, RDX);
+        emit_op_rr(a, w, 0xf7, 6, RCX);
+    }
+    if (rem)
+        emit_op_rr(a, 1, 0x89, RDX, RAX);
+    done = emit_jmp8(a);
+    patch8(zero, a->p);
+    if (!rem)
+        emit_mov_imm(a, RAX, -1);
+    /* else the remainder is the dividend, already in rax */
+    if (done_minus_one)
+        patch8(done_minus_one, a->p);
+    patch8(done, a->p);
+}
+
+/* The M extension and sllw/srlw/sraw, which the interpreter leaves to
+ * the full decoder (DOP_SLOW).  Returns false for anything else. */
+static bool emit_slow_op(JitAsm *a, uint32_t insn) {
+    int  opcode = insn & 0x7f, funct3 = (insn >> 12) & 7, funct7 = insn >> 25;
+    int  rd = (insn >> 7) & 0x1f, rs1 = (insn >> 15) & 0x1f, rs2 = (insn >> 20) & 0x1f;
+    int  w      = opcode == 0x33;
+    bool m_ext  = funct7 == 1 && (opcode == 0x33 || opcode == 0x3b && (funct3 == 0 || funct3 >= 4));
+    bool shiftw = opcode == 0x3b && (funct7 == 0 && (funct3 == 1 || funct3 == 5) || funct7 == 0x20 && funct3 == 5);
+
+    if (!m_ext && !shiftw)
+        return false;
+    if (rd == 0)
+        return true;
+
+    if (shiftw) {
+        emit_load_reg(a, 0, RAX, rs1);
+        emit_load_reg(a, 0, RCX, rs2);
+        emit_op_rr(a, 0, 0xd3, funct3 == 1 ? 4 : funct7 ? 7 : 5, RAX);
+        emit_movsxd(a);
+        emit_write_reg(a, rd, RAX, RCX);
+        return true;
+    }
+
+    emit_load_reg(a, w, RAX, rs1);
+    switch (funct3) {
+        case 0: /* mul */ emit_op_mem(a, w, 0x0faf, RAX, REG_S, NO_INDEX, S_REG(rs2)); break;
+        case 1: /* mulh */
+        case 3: /* mulhu */
+            emit_op_mem(a, 1, 0xf7, funct3 == 1 ? 5 : 4, REG_S, NO_INDEX, S_REG(rs2));
+            emit_op_rr(a, 1, 0x89, RDX, RAX);
+            break;
+        case 2: /* mulhsu: mulhu - (rs1 < 0 ? rs2 : 0) */
+            emit_op_mem(a, 1, 0xf7, 4, REG_S, NO_INDEX, S_REG(rs2));
+            emit_load_reg(a, 1, RCX, rs1);
+            emit_shift_imm(a, 1, 7, RCX, 63);
+            emit_op_mem(a, 1, 0x23, RCX, REG_S, NO_INDEX, S_REG(rs2));
+            emit_op_rr(a, 1, 0x29, RCX, RDX);
+            emit_op_rr(a, 1, 0x89, RDX, RAX);
+            break;
+        default:
+            emit_load_reg(a, w, RCX, rs2);
+            emit_divrem(a, w, !(funct3 & 1), funct3 >= 6);
+            break;
+    }
+    if (!w)
+        emit_movsxd(a);
+    emit_write_reg(a, rd, RAX, RCX);
+    return true;
+}
+
+/* Leaves in rsi the address of the access d of size bytes, in rcx its
+ * TLB index times 8 and in rdx the mem_addend of the TLB bank at
+ * tlb_field, or leaves the block on a miss.  As target_read_u8() and
+ * co., a misaligned address never hits. */
+static void emit_tlb_lookup(JitAsm *a, const DecodedInsn *d, int size, int32_t tlb_field, int index, int32_t delta) {
+    emit_load_reg(a, 1, RSI, d->rs1);
+    if (d->imm)
+        emit_op_imm(a, 1, 0, RSI, d->imm);
+    emit_op_rr(a, 1, 0x89, RSI, RCX);
+    emit_shift_imm(a, 1, 5, RCX, PG_SHIFT);
+    emit_op_mem(a, 0, 0x23, RCX, REG_S, NO_INDEX, S_OFFSET(tlb_mask));
+    emit_shift_imm(a, 1, 4, RCX, 4);
+    emit_op_mem(a, 1, 0x8b, RDX, REG_S, NO_INDEX, tlb_field);
+    emit_op_rr(a, 1, 0x89, RSI, RAX);
+    emit_op_imm(a, 1, 4, RAX, ~(PG_MASK & ~(size - 1)));
+    emit_op_mem(a, 1, 0x3b, RAX, RDX, RCX, offsetof(TLBEntry, vaddr));
+    emit_exit_if(a, CC_NE, index, delta);
+    emit_op_mem(a, 1, 0x8b, RDX, RDX, RCX, offsetof(TLBEntry, mem_addend));
+    emit_shift_imm(a, 1, 5, RCX, 1);
+}
+
+/* r8 = the physical address of the access, from the TLB index in rcx */
+static void emit_paddr(JitAsm *a, int32_t paddr_addend_field) {
+    emit_op_mem(a, 1, 0x8b, R8, REG_S, NO_INDEX, paddr_addend_field);
+    emit_op_mem(a, 1, 0x8b, R8, R8, RCX, 0);
+    emit_op_rr(a, 1, 0x01, RSI, R8);
+}
+
+static void emit_load(JitAsm *a, const DecodedInsn *d, int index, int32_t delta) {
+    static const int size[] = {1, 2, 4, 1, 2, 4, 8};
+    /* movsx, movsx, movsxd, movzx, movzx, mov r32 and mov r64 */
+    static const int op[] = {0x0fbe, 0x0fbf, 0x63, 0x0fb6, 0x0fb7, 0x8b, 0x8b};
+    static const int w[]  = {1, 1, 1, 0, 0, 0, 1};
+    int              i    = d->op - DOP_LB;
+
+    emit_tlb_lookup(a, d, size[i], S_OFFSET(tlb_read), index, delta);
+    emit_op_mem(a, 1, 0xff, 0, REG_S, NO_INDEX, S_OFFSET(tlb_hit_count));
+    emit_op_mem(a, w[i], op[i], RAX, RDX, RSI, 0);
+    emit_paddr(a, S_OFFSET(tlb_read_paddr_addend));
+    emit_op_mem(a, 1, 0x89, R8, REG_S, NO_INDEX, S_OFFSET(last_data_paddr));
+    if (d->rd != 0)
+        emit_write_reg(a, d->rd, RAX, RCX);
+}
+
+/* As target_write_u8() and co. followed by track_write(), except that a
+ * store to a reserved line is left to the interpreter */
+static void emit_store(JitAsm *a, RISCVCPUState *s, const DecodedInsn *d, int index, int32_t delta) {
+    int size = 1 << (d->op - DOP_SB);
+
+    emit_tlb_lookup(a, d, size, S_OFFSET(tlb_write), index, delta);
+    emit_paddr(a, S_OFFSET(tlb_write_paddr_addend));
+    emit_mov_imm(a, RAX, (uintptr_t)&s->machine->reserved_filter);
+    emit_op_mem(a, 1, 0x8b, RAX, RAX, NO_INDEX, 0);
+    emit_op_rr(a, 1, 0x89, R8, RCX);
+    emit_shift_imm(a, 1, 5, RCX, RESERVATION_LINE_SHIFT);
+    emit_op_rr(a, 1, 0x0fa3, RCX, RAX); /* bt */
+    emit_exit_if(a, CC_B, index, delta);
+    emit_op_mem(a, 1, 0xff, 0, REG_S, NO_INDEX, S_OFFSET(tlb_hit_count));
+    emit_load_reg(a, size == 8, RAX, d->rs2);
+    if (size == 2)
+        emit8(a, 0x66);
+    emit_op_mem(a, size == 8, size == 1 ? 0x88 : 0x89, RAX, RDX, RSI, 0);
+    emit_op_mem(a, 1, 0x89, R8, REG_S, NO_INDEX, S_OFFSET(last_data_paddr));
+}
+
+/* A jump to rax taken by the n_insns-th instruction of the block: stay
+ * in the page if the target is in it (in_page, or checked against the
+ * pc of the jump at delta if in_page < 0) and no interrupt may be
+ * pending, as DECODED_JUMP_INSN() does */
+static void emit_taken(JitAsm *a, RISCVCTFInfo kind, int n_insns, int in_page, int32_t delta) {
+    emit_op_mem(a, 1, 0x89, RAX, REG_S, NO_INDEX, S_OFFSET(pc));
+    emit_op_mem(a, 1, 0x89, RAX, REG_S, NO_INDEX, S_OFFSET(next_addr));
+    emit_store_imm32(a, S_OFFSET(info), kind);
+#ifndef NO_CHAINING
+    if (in_page) {
+        uint8_t *other_page = NULL, *pending;
+        if (in_page < 0) {
+            emit_op_mem(a, 1, 0x8d, RCX, REG_PC, NO_INDEX, delta);
+            emit_op_rr(a, 1, 0x31, RAX, RCX);
+            emit_op_rr(a, 1, 0xf7, 0, RCX); /* test rcx, ~PG_MASK */
+            emit32(a, ~PG_MASK);
+            other_page = emit_jcc8(a, CC_NE);
+        }
+        emit_op_mem(a, 0, 0x8b, RAX, REG_S, NO_INDEX, S_OFFSET(mip));
+        emit_op_mem(a, 0, 0x23, RAX, REG_S, NO_INDEX, S_OFFSET(mie));
+        pending = emit_jcc8(a, CC_NE);
+        emit_return(a, n_insns, JIT_CONTINUE);
+        patch8(pending, a->p);
+        if (other_page)
+            patch8(other_page, a->p);
+    }
+#endif
+    emit_return(a, n_insns, JIT_REFETCH);
+}
+
+/* Leave the block before a jump whose target is misaligned without the
+ * C extension, misaligned being given by the flags */
+static void emit_check_target(JitAsm *a, const DecodedInsn *d, int cc, int index, int32_t delta) {
+    uint8_t *aligned = NULL;
+
+    if (d->len != 4)
+        return;
+    if (cc >= 0)
+        aligned = emit_jcc8(a, cc);
+    emit_op_mem(a, 0, 0xf7, 0, REG_S, NO_INDEX, S_OFFSET(misa));
+    emit32(a, MCPUID_C);
+    emit_exit_if(a, CC_E, index, delta);
+    if (aligned)
+        patch8(aligned, a->p);
+}
+
+/* The branch or jump d at offset in the page, which ends the block */
+static void emit_jump(JitAsm *a, const DecodedInsn *d, int offset, int index, int32_t delta) {
+    int target = offset + d->imm;
+
+    switch (d->op) {
+        case DOP_BEQ:
+        case DOP_BNE:
+        case DOP_BLT:
+        case DOP_BGE:
+        case DOP_BLTU:
+        case DOP_BGEU: {
+            static const int cc[] = {CC_E, CC_NE, CC_L, CC_GE, CC_B, CC_AE};
+            emit_load_reg(a, 1, RAX, d->rs1);
+            emit_op_mem(a, 1, 0x3b, RAX, REG_S, NO_INDEX, S_REG(d->rs2));
+            uint8_t *taken = emit_jcc32(a, cc[d->op - DOP_BEQ]);
+            emit_exit(a, delta + d->len, index + 1, JIT_CONTINUE);
+            patch32(taken, a->p);
+            if (target & 3)
+                emit_check_target(a, d, -1, index, delta);
+            emit_op_mem(a, 1, 0x8d, RAX, REG_PC, NO_INDEX, delta + d->imm);
+            emit_taken(a, ctf_taken_branch, index + 1, 0 <= target && target <= PG_MASK, delta);
+            break;
+        }
+        case DOP_JAL:
+            if (target & 3)
+                emit_check_target(a, d, -1, index, delta);
+            if (d->rd != 0) {
+                emit_op_mem(a, 1, 0x8d, RCX, REG_PC, NO_INDEX, delta + d->len);
+                emit_write_reg(a, d->rd, RCX, RDX);
+            }
+            emit_op_mem(a, 1, 0x8d, RAX, REG_PC, NO_INDEX, delta + d->imm);
+            emit_taken(a, ctf_taken_jump, index + 1, 0 <= target && target <= PG_MASK, delta);
+            break;
+        case DOP_JALR:
+            emit_load_reg(a, 1, RAX, d->rs1);
+            if (d->imm)
+                emit_op_imm(a, 1, 0, RAX, d->imm);
+            emit_op_imm(a, 1, 4, RAX, ~1);
+            if (d->len == 4) {
+                emit8(a, 0xa8); /* test al, 2 */
+                emit8(a, 2);
+                emit_check_target(a, d, CC_E, index, delta);
+            }
+            if (d->rd != 0) {
+                emit_op_mem(a, 1, 0x8d, RCX, REG_PC, NO_INDEX, delta + d->len);
+                emit_write_reg(a, d->rd, RCX, RDX);
+            }
+            emit_taken(a, ctf_compute_hint(d->rd, d->rs1), index + 1, -1, delta);
+            break;
+        default: assert(0);
+    }
+}
+
+/* Translate the block at offset in page, whose host address is
+ * code_page, returning NULL if its first instruction cannot be */
+static JitCode jit_translate(RISCVCPUState *s, DecodedPage *page, uint8_t *code_page, int offset, uint16_t *n_insns) {
+    RISCVJit *jit   = s->jit;
+    uint8_t * start = jit->code_buf + jit->code_used;
+    JitAsm    a;
+    int       index = 0, off = offset;
+    bool      ended = false;
+
+    a.p       = start;
+    a.n_exits = 0;
+    emit8(&a, 0x53); /* push rbx */
+    emit8(&a, 0x41); /* push r12 */
+    emit8(&a, 0x54);
+    emit_op_rr(&a, 1, 0x89, RDI, REG_S);
+    emit_op_mem(&a, 1, 0x8b, REG_PC, REG_S, NO_INDEX, S_OFFSET(pc));
+
+    /* as the interpreter, which goes back through the code TLB from PG_MASK - 1 on */
+    while (index < JIT_BLOCK_MAX && off < PG_MASK - 1) {
+        const DecodedInsn *d     = &page->insn[off >> 1];
+        int32_t            delta = off - offset;
+
+        if (d->op >= DOP_BEQ && d->op <= DOP_JALR) {
+            emit_jump(&a, d, off, index++, delta);
+            ended = true;
+            break;
+        }
+        if (d->op >= DOP_LB && d->op <= DOP_LD) {
+            emit_load(&a, d, index, delta);
+        } else if (d->op >= DOP_SB && d->op <= DOP_SD) {
+            emit_store(&a, s, d, index, delta);
+        } else if (d->op >= DOP_LI && d->op <= DOP_SUBW) {
+            emit_alu(&a, d, delta);
+        } else if (d->op == DOP_SLOW && d->len == 4) {
+            uint32_t insn;
+            memcpy(&insn, code_page + off, sizeof insn);
+            if (!emit_slow_op(&a, insn))
+                break;
+        } else if (d->op != DOP_NOP) {
+            break;
+        }
+        index++;
+        off += d->len;
+    }
+    if (index == 0)
+        return NULL;
+    if (!ended)
+        emit_exit(&a, off - offset, index, index == JIT_BLOCK_MAX || off >= PG_MASK - 1 ? JIT_CONTINUE : JIT_STOP);
+
+    for (int i = 0; i < a.n_exits; i++) {
+        JitExit *e = &a.exits[i];
+        if (i > 0 && e->index == e[-1].index) {
+            patch32(e->jump, e[-1].jump);
+            continue;
+        }
+        uint8_t *stub = a.p;
+        emit_exit(&a, e->delta, e->index, JIT_STOP);
+        patch32(e->jump, stub);
+        e->jump = stub; /* for the next exits before the same instruction */
+    }
+
+    assert(a.p <= start + JIT_BLOCK_BYTES);
+    jit->code_used = (a.p - jit->code_buf + 15) & ~15;
+    *n_insns       = index;
+    return (JitCode)start;
+}
+
+/* The block at offset in page, translated if it just got hot, or NULL */
+static JitBlock *jit_lookup(RISCVCPUState *s, DecodedPage *page, uint8_t *code_page, int offset) {
+    RISCVJit *jit = s->jit;
+    JitBlock *b   = &jit->table[((uintptr_t)page / sizeof *page * 97 + (offset >> 1)) & (JIT_TABLE_SIZE - 1)];
+
+    if (b->page != page || b->offset != offset || b->gen != page->gen) {
+        b->page   = page;
+        b->offset = offset;
+        b->gen    = page->gen;
+        b->heat   = JIT_HOT;
+        b->code   = NULL;
+    }
+    if (b->code)
+        return b;
+    if (--b->heat > 0)
+        return NULL;
+
+    if (jit->code_used + JIT_BLOCK_BYTES > JIT_CODE_SIZE) {
+        /* start over, with b only */
+        JitBlock keep = *b;
+        memset(jit->table, 0, sizeof jit->table);
+        jit->code_used = 0;
+        *b             = keep;
+    }
+    b->code = jit_translate(s, page, code_page, offset, &b->n_insns);
+    if (!b->code)
+        b->heat = JIT_COLD;
+
+    return b->code ? b : NULL;
+}
+
+int riscv_jit_run(RISCVCPUState *s, DecodedInsn *dcode, uint8_t *code_page, int max_insns, BOOL *refetch) {
+    DecodedPage *page = (DecodedPage *)((uint8_t *)dcode - offsetof(DecodedPage, insn));
+    int          n    = 0;
+
+    *refetch = FALSE;
+    /* execute triggers must see every instruction */
+    if (s->trigger_armed & MCONTROL_EXECUTE)
+        return 0;
+
+    while ((s->pc & PG_MASK) < PG_MASK - 1) {
+        JitBlock *b = jit_lookup(s, page, code_page, s->pc & PG_MASK);
+        if (!b || b->n_insns > max_insns - n)
+            break;
+
+        uint64_t ret = b->code(s);
+        n += (uint32_t)ret;
+        if (ret >> 32 != JIT_CONTINUE) {
+            *refetch = ret >> 32 == JIT_REFETCH;
+            break;
+        }
+    }
+
+    return n;
+}
+
+void riscv_jit_init(RISCVCPUState *s) {
+    RISCVJit *jit = (RISCVJit *)calloc(1, sizeof *jit);
+
+    if (jit)
+        jit->code_buf = (uint8_t *)mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (!jit || jit->code_buf == MAP_FAILED) {
+        fprintf(dromajo_stderr, "ERROR: out of memory for the translated code of the harts, try without --jit\n");
+        exit(1);
+    }
+    s->jit = jit;
+}
+
+void riscv_jit_end(RISCVCPUState *s) {
+    if (!s->jit)
+        return;
+    munmap(s->jit->code_buf, JIT_CODE_SIZE);
+    free(s->jit);
+    s->jit = NULL;
+}
+
+#endif
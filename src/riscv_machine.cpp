@@ -46,11 +46,14 @@
 #include <inttypes.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+
 #include "cutils.h"
 #include "dromajo.h"
 #include "dw_apb_uart.h"
@@ -90,7 +93,161 @@ enum {
     SIFIVE_UART_IP_RXWM = 2  /* Receive watermark interrupt pending */
 };
 
-static uint64_t rtc_get_time(RISCVMachine *m) { return m->cpu_state[0]->mcycle / RTC_FREQ_DIV; }
+static uint64_t rtc_get_time(RISCVMachine *m) {
+    RISCVTimebase *tb = &m->timebase;
+
+    if (!m->common.parallel)
+        return m->cpu_state[0]->mcycle / RTC_FREQ_DIV;
+    if (__atomic_load_n(&tb->mtime_written, __ATOMIC_ACQUIRE))
+        return tb->mtime_write;
+    return __atomic_load_n(&tb->cycles, __ATOMIC_RELAXED) / RTC_FREQ_DIV;
+}
+
+static void rtc_set_time(RISCVMachine *m, uint64_t mtime) {
+    RISCVTimebase *tb = &m->timebase;
+
+    if (!m->common.parallel) {
+        m->cpu_state[0]->mcycle = mtime * RTC_FREQ_DIV;
+        return;
+    }
+    tb->mtime_write = mtime;
+    __atomic_store_n(&tb->mtime_written, true, __ATOMIC_RELEASE);
+}
+
+void riscv_timebase_publish(RISCVMachine *m) {
+    RISCVTimebase *tb = &m->timebase;
+
+    if (__atomic_load_n(&tb->mtime_written, __ATOMIC_ACQUIRE)) {
+        std::lock_guard<std::mutex> io_guard(*m->io_lock);
+        m->cpu_state[0]->mcycle = tb->mtime_write * RTC_FREQ_DIV;
+        __atomic_store_n(&tb->mtime_written, false, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&tb->cycles, m->cpu_state[0]->mcycle, __ATOMIC_RELAXED);
+}
+
+void riscv_event_init(RISCVEvent *ev, RISCVEventFunc *func, void *opaque) {
+    ev->when   = UINT64_MAX;
+    ev->func   = func;
+    ev->opaque = opaque;
+    ev->index  = -1;
+}
+
+static void events_set(RISCVEventQueue *q, int i, RISCVEvent *ev) {
+    q->heap[i] = ev;
+    ev->index  = i;
+}
+
+/* Moves heap entry i up or down to its place */
+static void events_sift(RISCVEventQueue *q, int i) {
+    RISCVEvent *ev = q->heap[i];
+
+    while (i > 0 && ev->when < q->heap[(i - 1) / 2]->when) {
+        events_set(q, i, q->heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= q->count)
+            break;
+        if (child + 1 < q->count && q->heap[child + 1]->when < q->heap[child]->when)
+            ++child;
+        if (ev->when <= q->heap[child]->when)
+            break;
+        events_set(q, i, q->heap[child]);
+        i = child;
+    }
+    events_set(q, i, ev);
+}
+
+static void events_update_deadline(RISCVMachine *m) {
+    RISCVEventQueue *q = &m->events;
+
+    __atomic_store_n(&m->timebase.deadline, q->count ? q->heap[0]->when : UINT64_MAX, __ATOMIC_RELAXED);
+}
+
+void riscv_event_cancel(RISCVMachine *m, RISCVEvent *ev) {
+    RISCVEventQueue *q = &m->events;
+    int              i = ev->index;
+
+    ev->when = UINT64_MAX;
+    if (i < 0)
+        return;
+
+    ev->index = -1;
+    if (i != --q->count) {
+        events_set(q, i, q->heap[q->count]);
+        events_sift(q, i);
+    }
+    events_update_deadline(m);
+}
+
+void riscv_event_schedule(RISCVMachine *m, RISCVEvent *ev, uint64_t when) {
+    RISCVEventQueue *q = &m->events;
+
+    if (when == UINT64_MAX) {
+        riscv_event_cancel(m, ev);
+        return;
+    }
+
+    ev->when = when;
+    if (ev->index < 0) {
+        if (q->count == q->size) {
+            q->size = q->size ? 2 * q->size : 16;
+            q->heap = (RISCVEvent **)realloc(q->heap, q->size * sizeof *q->heap);
+        }
+        events_set(q, q->count++, ev);
+    }
+    events_sift(q, ev->index);
+    events_update_deadline(m);
+}
+
+/* Runs the events due by hart 0 mcycle now, in the order they are due */
+static void events_run(RISCVMachine *m, uint64_t now) {
+    std::unique_lock<std::mutex> io_guard(*m->io_lock, std::defer_lock);
+    if (m->common.parallel)
+        io_guard.lock();
+
+    RISCVEventQueue *q = &m->events;
+    while (q->count && q->heap[0]->when <= now) {
+        RISCVEvent *ev = q->heap[0];
+        riscv_event_cancel(m, ev);
+        ev->func(m, ev, now);
+    }
+}
+
+/* The hart 0 mcycle at which hart s's timer interrupt is due, given
+ * mtime now: mtime must be past 0 and timecmp - mtime, signed, down to
+ * 0.  If it is not due yet, mtime is below timecmp and it will be when
+ * mtime gets to timecmp. */
+static uint64_t timer_deadline(RISCVCPUState *s, uint64_t mtime) {
+    if (riscv_cpu_get_mip(s) & MIP_MTIP)
+        return UINT64_MAX;
+
+    uint64_t due = std::max(mtime, (uint64_t)1);
+    if ((int64_t)(s->timecmp - due) > 0)
+        due = s->timecmp;
+    if (due > UINT64_MAX / RTC_FREQ_DIV)
+        return UINT64_MAX;
+    return due * RTC_FREQ_DIV;
+}
+
+static void timer_schedule(RISCVMachine *m, int hartid) {
+    riscv_event_schedule(m, &m->timer_event[hartid], timer_deadline(m->cpu_state[hartid], rtc_get_time(m)));
+}
+
+/* Posts the timer interrupt of a hart, unless mtime is still 0 or was
+ * written meanwhile, in which case it is rescheduled for when it gets
+ * due.  mtime is taken from the mcycle the event runs at, so that the
+ * new deadline is always past it. */
+static void timer_fire(RISCVMachine *m, RISCVEvent *ev, uint64_t now) {
+    RISCVCPUState *s     = (RISCVCPUState *)ev->opaque;
+    uint64_t       mtime = now / RTC_FREQ_DIV;
+
+    if (!(riscv_cpu_get_mip(s) & MIP_MTIP) && mtime > 0 && (int64_t)(s->timecmp - mtime) <= 0)
+        riscv_cpu_set_mip(s, MIP_MTIP);
+    else
+        riscv_event_schedule(m, ev, timer_deadline(s, mtime));
+}
 
 void dromajo_default_error_log(int hartid, const char *fmt, ...) {
     va_list args;
@@ -184,13 +341,29 @@ static void uart_write(void *opaque, uint32_t offset, uint32_t val, int size_log
     vm_error("%s: bad write: addr=0x%x v=0x%x\n", __func__, (int)offset, (int)val);
 }
 
+static void uart_save(void *opaque, FILE *f) {
+    SiFiveUARTState *s     = (SiFiveUARTState *)opaque;
+    size_t           start = offsetof(SiFiveUARTState, rx_fifo);
+
+    device_state_put(f, (uint8_t *)s + start, sizeof *s - start);
+}
+
+static BOOL uart_load(void *opaque, FILE *f) {
+    SiFiveUARTState *s     = (SiFiveUARTState *)opaque;
+    size_t           start = offsetof(SiFiveUARTState, rx_fifo);
+
+    return device_state_get(f, (uint8_t *)s + start, sizeof *s - start);
+}
+
 /* CLINT registers
  * 0000 msip hart 0
  * 0004 msip hart 1
+ * ...  msip hart n at 4 * n
  * 4000 mtimecmp hart 0 lo
  * 4004 mtimecmp hart 0 hi
  * 4008 mtimecmp hart 1 lo
  * 400c mtimecmp hart 1 hi
+ * ...  mtimecmp hart n at 4000 + 8 * n
  * bff8 mtime lo
  * bffc mtime hi
  */
@@ -208,15 +381,13 @@ static uint32_t clint_read(void *opaque, uint32_t offset, int size_log2) {
             val = (riscv_cpu_get_mip(m->cpu_state[hartid]) & MIP_MSIP) != 0;
         }
     } else if (offset == 0xbff8) {
-        uint64_t mtime = m->cpu_state[0]->mcycle / RTC_FREQ_DIV;  // WARNING: mcycle may need to move to RISCVMachine
-        val            = mtime;
+        val = rtc_get_time(m);
     } else if (offset == 0xbffc) {
-        uint64_t mtime = m->cpu_state[0]->mcycle / RTC_FREQ_DIV;
-        val            = mtime >> 32;
+        val = rtc_get_time(m) >> 32;
     } else if (0x4000 <= offset && offset < 0xbff8) {
         int hartid = (offset - 0x4000) >> 3;
         if (m->ncpus <= hartid) {
-            vm_error("%s: MSIP access for hartid:%d which is beyond ncpus\n", __func__, hartid);
+            vm_error("%s: MTIMECMP access for hartid:%d which is beyond ncpus\n", __func__, hartid);
             val = 0;
         } else if ((offset >> 2) & 1) {
             val = m->cpu_state[hartid]->timecmp >> 32;
@@ -261,23 +432,21 @@ static void clint_write(void *opaque, uint32_t offset, uint32_t val, int size_lo
         else
             riscv_cpu_reset_mip(m->cpu_state[hartid], MIP_MSIP);
     } else if (offset == 0xbff8) {
-        uint64_t mtime          = m->cpu_state[0]->mcycle / RTC_FREQ_DIV;  // WARNING: move mcycle to RISCVMachine
-        mtime                   = (mtime & 0xFFFFFFFF00000000L) + val;
-        m->cpu_state[0]->mcycle = mtime * RTC_FREQ_DIV;
+        rtc_set_time(m, (rtc_get_time(m) & 0xFFFFFFFF00000000L) + val);
     } else if (offset == 0xbffc) {
-        uint64_t mtime          = m->cpu_state[0]->mcycle / RTC_FREQ_DIV;
-        mtime                   = (mtime & 0x00000000FFFFFFFFL) + ((uint64_t)val << 32);
-        m->cpu_state[0]->mcycle = mtime * RTC_FREQ_DIV;
+        rtc_set_time(m, (rtc_get_time(m) & 0x00000000FFFFFFFFL) + ((uint64_t)val << 32));
     } else if (0x4000 <= offset && offset < 0xbff8) {
         int hartid = (offset - 0x4000) >> 3;
         if (m->ncpus <= hartid) {
-            vm_error("%s: MSIP access for hartid:%d which is beyond ncpus\n", __func__, hartid);
+            vm_error("%s: MTIMECMP access for hartid:%d which is beyond ncpus\n", __func__, hartid);
         } else if ((offset >> 2) & 1) {
             m->cpu_state[hartid]->timecmp = (m->cpu_state[hartid]->timecmp & 0xffffffff) | ((uint64_t)val << 32);
             riscv_cpu_reset_mip(m->cpu_state[hartid], MIP_MTIP);
+            timer_schedule(m, hartid);
         } else {
             m->cpu_state[hartid]->timecmp = (m->cpu_state[hartid]->timecmp & ~0xffffffff) | val;
             riscv_cpu_reset_mip(m->cpu_state[hartid], MIP_MTIP);
+            timer_schedule(m, hartid);
         }
     } else {
         vm_error("clint_write to unmanaged address CLINT_BASE+0x%x\n", offset);
@@ -304,7 +473,32 @@ static void plic_update_mip(RISCVMachine *s, int hartid) {
     }
 }
 
-static uint32_t plic_priority[PLIC_NUM_SOURCES + 1];  // XXX migrate to VirtMachine!
+/* Only the harts enabling 'irq' can see their mip change with it */
+static void plic_update_irq(RISCVMachine *s, int irq) {
+    const uint64_t *harts = s->plic_irq_harts[irq];
+
+    for (int w = 0; w < PLIC_HART_WORDS(s->ncpus); ++w) {
+        for (uint64_t bits = harts[w]; bits; bits &= bits - 1) plic_update_mip(s, w * 64 + ctz64(bits));
+    }
+}
+
+static void plic_set_enable(RISCVMachine *s, int ctx, uint32_t val) {
+    int            hartid  = ctx / 2;  // PLIC_HART_CONFIG is "MS"
+    RISCVCPUState *cpu     = s->cpu_state[hartid];
+    uint64_t       hartbit = 1ULL << (hartid & 63);
+
+    cpu->plic_enable_irq[ctx % 2] = val;
+
+    uint32_t enabled = cpu->plic_enable_irq[0] | cpu->plic_enable_irq[1];
+    for (int irq = 1; irq < 32; ++irq) {
+        if (enabled & (1u << irq))
+            s->plic_irq_harts[irq][hartid / 64] |= hartbit;
+        else
+            s->plic_irq_harts[irq][hartid / 64] &= ~hartbit;
+    }
+
+    plic_update_mip(s, hartid);
+}
 
 static uint32_t plic_read(void *opaque, uint32_t offset, int size_log2) {
     uint32_t      val = 0;
@@ -314,24 +508,19 @@ static uint32_t plic_read(void *opaque, uint32_t offset, int size_log2) {
     if (PLIC_PRIORITY_BASE <= offset && offset < PLIC_PRIORITY_BASE + (PLIC_NUM_SOURCES << 2)) {
         uint32_t irq = (offset - PLIC_PRIORITY_BASE) >> 2;
         assert(irq < PLIC_NUM_SOURCES);
-        val = plic_priority[irq];
+        val = s->plic_priority[irq];
     } else if (PLIC_PENDING_BASE <= offset && offset < PLIC_PENDING_BASE + (PLIC_NUM_SOURCES >> 3)) {
         if (offset == PLIC_PENDING_BASE)
             val = s->plic_pending_irq;
         else
             val = 0;
-    } else if (PLIC_ENABLE_BASE <= offset && offset < PLIC_ENABLE_BASE + (PLIC_ENABLE_STRIDE * MAX_CPUS)) {
+    } else if (PLIC_ENABLE_BASE <= offset && offset < PLIC_ENABLE_BASE + PLIC_ENABLE_STRIDE * PLIC_CONTEXTS(s->ncpus)) {
         int addrid = (offset - PLIC_ENABLE_BASE) / PLIC_ENABLE_STRIDE;
         int hartid = addrid / 2;  // PLIC_HART_CONFIG is "MS"
-        if (hartid < s->ncpus) {
-            // uint32_t wordid = (offset & (PLIC_ENABLE_STRIDE-1)) >> 2;
-            RISCVCPUState *cpu = s->cpu_state[hartid];
-            val                = cpu->plic_enable_irq[addrid % 2];
-        } else {
-            val = 0;
-        }
-    } else if (PLIC_CONTEXT_BASE <= offset && offset < PLIC_CONTEXT_BASE + PLIC_CONTEXT_STRIDE * MAX_CPUS) {
-        uint32_t hartid = (offset - PLIC_CONTEXT_BASE) / PLIC_CONTEXT_STRIDE;
+        // uint32_t wordid = (offset & (PLIC_ENABLE_STRIDE-1)) >> 2;
+        RISCVCPUState *cpu = s->cpu_state[hartid];
+        val                = cpu->plic_enable_irq[addrid % 2];
+    } else if (PLIC_CONTEXT_BASE <= offset && offset < PLIC_CONTEXT_BASE + PLIC_CONTEXT_STRIDE * PLIC_CONTEXTS(s->ncpus)) {
         uint32_t wordid = (offset & (PLIC_CONTEXT_STRIDE - 1)) >> 2;
         if (wordid == 0) {
             val = 0;  // target_priority in qemu
@@ -341,7 +530,7 @@ static uint32_t plic_read(void *opaque, uint32_t offset, int size_log2) {
                 int i = ctz32(mask);
                 s->plic_served_irq |= 1 << i;
                 s->plic_pending_irq &= ~(1 << i);
-                plic_update_mip(s, hartid);
+                plic_update_irq(s, i);
                 val = i;
             } else {
                 val = 0;
@@ -365,27 +554,23 @@ static void plic_write(void *opaque, uint32_t offset, uint32_t val, int size_log
     if (PLIC_PRIORITY_BASE <= offset && offset < PLIC_PRIORITY_BASE + (PLIC_NUM_SOURCES << 2)) {
         uint32_t irq = (offset - PLIC_PRIORITY_BASE) >> 2;
         assert(irq < PLIC_NUM_SOURCES);
-        plic_priority[irq] = val & 7;
+        s->plic_priority[irq] = val & 7;
 
     } else if (PLIC_PENDING_BASE <= offset && offset < PLIC_PENDING_BASE + (PLIC_NUM_SOURCES >> 3)) {
         vm_error("plic_write: INVALID pending write to offset=0x%x\n", offset);
-    } else if (PLIC_ENABLE_BASE <= offset && offset < PLIC_ENABLE_BASE + PLIC_ENABLE_STRIDE * MAX_CPUS) {
-        int addrid = (offset - PLIC_ENABLE_BASE) / PLIC_ENABLE_STRIDE;
-        int hartid = addrid / 2;  // PLIC_HART_CONFIG is "MS"
-        if (hartid < s->ncpus) {
-            // uint32_t wordid = (offset & (PLIC_ENABLE_STRIDE - 1)) >> 2;
-            RISCVCPUState *cpu   = s->cpu_state[hartid];
-            cpu->plic_enable_irq[addrid % 2] = val;
-        }
-    } else if (PLIC_CONTEXT_BASE <= offset && offset < PLIC_CONTEXT_BASE + PLIC_CONTEXT_STRIDE * MAX_CPUS) {
-        uint32_t hartid = (offset - PLIC_CONTEXT_BASE) / PLIC_CONTEXT_STRIDE;
+    } else if (PLIC_ENABLE_BASE <= offset && offset < PLIC_ENABLE_BASE + PLIC_ENABLE_STRIDE * PLIC_CONTEXTS(s->ncpus)) {
+        // uint32_t wordid = (offset & (PLIC_ENABLE_STRIDE - 1)) >> 2;
+        plic_set_enable(s, (offset - PLIC_ENABLE_BASE) / PLIC_ENABLE_STRIDE, val);
+    } else if (PLIC_CONTEXT_BASE <= offset && offset < PLIC_CONTEXT_BASE + PLIC_CONTEXT_STRIDE * PLIC_CONTEXTS(s->ncpus)) {
+        uint32_t hartid = (offset - PLIC_CONTEXT_BASE) / PLIC_CONTEXT_STRIDE / 2;
         uint32_t wordid = (offset & (PLIC_CONTEXT_STRIDE - 1)) >> 2;
         if (wordid == 0) {
-            plic_priority[wordid] = val;
+            s->plic_priority[wordid] = val;
         } else if (wordid == 1) {
             int irq = val & 31;
             uint32_t mask = 1 << irq;
             s->plic_served_irq &= ~mask;
+            plic_update_irq(s, irq);
         } else {
             vm_error("plic_write: hartid=%d ERROR?? unexpected wordid=%d offset=%x val=%x\n", hartid, wordid, offset, val);
         }
@@ -397,6 +582,23 @@ static void plic_write(void *opaque, uint32_t offset, uint32_t val, int size_log
 #endif
 }
 
+/* The enables are saved with the harts, which rebuild plic_irq_harts */
+static void plic_save(void *opaque, FILE *f) {
+    RISCVMachine *s = (RISCVMachine *)opaque;
+
+    device_state_put(f, &s->plic_pending_irq, sizeof s->plic_pending_irq);
+    device_state_put(f, &s->plic_served_irq, sizeof s->plic_served_irq);
+    device_state_put(f, s->plic_priority, sizeof s->plic_priority);
+}
+
+static BOOL plic_load(void *opaque, FILE *f) {
+    RISCVMachine *s = (RISCVMachine *)opaque;
+
+    return device_state_get(f, &s->plic_pending_irq, sizeof s->plic_pending_irq)
+           && device_state_get(f, &s->plic_served_irq, sizeof s->plic_served_irq)
+           && device_state_get(f, s->plic_priority, sizeof s->plic_priority);
+}
+
 static void plic_set_irq(void *opaque, int irq_num, int state) {
     RISCVMachine *m = (RISCVMachine *)opaque;
 
@@ -407,9 +609,7 @@ static void plic_set_irq(void *opaque, int irq_num, int state) {
     else
         m->plic_pending_irq &= ~mask;
 
-    for (int hartid = 0; hartid < m->ncpus; ++hartid) {
-        plic_update_mip(m, hartid);
-    }
+    plic_update_irq(m, irq_num);
 }
 
 static uint8_t *get_ram_ptr(RISCVMachine *s, uint64_t paddr) {
@@ -593,6 +793,15 @@ static void fdt_prop_tab_str(FDTState *s, const char *prop_name, ...) {
     free(tab);
 }
 
+/* return the size in bytes fdt_output() will write */
+static int fdt_output_size(FDTState *s) {
+    int pos = sizeof(struct fdt_header) + (s->tab_len + 1) * sizeof(uint32_t);
+
+    pos = (pos + 7) & ~7;
+    pos += sizeof(struct fdt_reserve_entry) + s->string_table_len;
+    return (pos + 7) & ~7;
+}
+
 /* write the FDT to 'dst1'. return the FDT size in bytes */
 int fdt_output(FDTState *s, uint8_t *dst) {
     struct fdt_header *       h;
@@ -651,8 +860,8 @@ void fdt_end(FDTState *s) {
     free(s);
 }
 
-static int riscv_build_fdt(RISCVMachine *m, uint8_t *dst, const char *dtb_name, const char *cmd_line, uint64_t initrd_start,
-                           uint64_t initrd_end) {
+static int riscv_build_fdt(RISCVMachine *m, uint8_t *dst, int max_size, const char *dtb_name, const char *cmd_line,
+                           uint64_t initrd_start, uint64_t initrd_end) {
     FDTState *s = 0;
     int       size;
     if (!dtb_name) {
@@ -660,10 +869,13 @@ static int riscv_build_fdt(RISCVMachine *m, uint8_t *dst, const char *dtb_name,
         int       max_xlen, i, cur_phandle;
         char      isa_string[128], *q;
         uint32_t  misa;
-        uint32_t  tab[4 * MAX_CPUS];
+        uint32_t *tab;
+        int *     hartid2handle;
         FBDevice *fb_dev;
 
-        s = fdt_init();
+        s             = fdt_init();
+        tab           = (uint32_t *)malloc(4 * m->ncpus * sizeof *tab);
+        hartid2handle = (int *)malloc(m->ncpus * sizeof *hartid2handle);
 
         cur_phandle = 1;
 
@@ -679,8 +891,6 @@ static int riscv_build_fdt(RISCVMachine *m, uint8_t *dst, const char *dtb_name,
         fdt_prop_u32(s, "#size-cells", 0);
         fdt_prop_u32(s, "timebase-frequency", RTC_FREQ);
 
-        int hartid2handle[MAX_CPUS];
-
         for (int hartid = 0; hartid < m->ncpus; ++hartid) {
             /* cpu */
             fdt_begin_node_num(s, "cpu", hartid);
@@ -840,6 +1050,15 @@ static int riscv_build_fdt(RISCVMachine *m, uint8_t *dst, const char *dtb_name,
 
         fdt_end_node(s); /* / */
 
+        free(tab);
+        free(hartid2handle);
+
+        if (fdt_output_size(s) > max_size) {
+            vm_error("dromajo: the FDT for %d harts does not fit in the boot ROM\n", m->ncpus);
+            fdt_end(s);
+            return -1;
+        }
+
         size = fdt_output(s, dst);
         fdt_end(s);
     } else {
@@ -848,6 +1067,12 @@ static int riscv_build_fdt(RISCVMachine *m, uint8_t *dst, const char *dtb_name,
         size = ftell(f);
         rewind(f);
 
+        if (size > max_size) {
+            vm_error("dromajo: %s does not fit in the boot ROM\n", dtb_name);
+            fclose(f);
+            return -1;
+        }
+
         if (fread((char *)dst, 1, size, f) != (size_t)size) {
             vm_error("dromajo: %s: %s\n", dtb_name, strerror(errno));
             return -1;
@@ -1031,7 +1256,7 @@ static int copy_kernel(RISCVMachine *s, const uint8_t *fw_buf, size_t fw_buf_len
             fdt_off += 256;
 
         uint8_t *ram_ptr = get_ram_ptr(s, ROM_BASE_ADDR);
-        if (riscv_build_fdt(s, ram_ptr + fdt_off, dtb_name, cmd_line, initrd_start, initrd_end) < 0)
+        if (riscv_build_fdt(s, ram_ptr + fdt_off, s->rom_size - fdt_off, dtb_name, cmd_line, initrd_start, initrd_end) < 0)
             return -1;
     }
 
@@ -1054,6 +1279,9 @@ void virt_machine_set_defaults(VirtMachineParams *p) {
     p->plic_size         = PLIC_SIZE;
     p->clint_base_addr   = CLINT_BASE_ADDR;
     p->clint_size        = CLINT_SIZE;
+    p->tlb_size          = TLB_SIZE;
+    p->l2_tlb_size       = L2_TLB_SIZE;
+    p->asid_bits         = 0;
 }
 
 RISCVMachine *global_virt_machine = 0;
@@ -1067,10 +1295,11 @@ uint8_t       dromajo_get_byte_direct(uint64_t paddr) {
 }
 
 RISCVMachine *virt_machine_init(const VirtMachineParams *p) {
-    VIRTIODevice *blk_dev;
-    int           irq_num, i;
-    VIRTIOBusDef  vbus_s, *vbus = &vbus_s;
-    RISCVMachine *s = (RISCVMachine *)mallocz(sizeof *s);
+    VIRTIODevice *   blk_dev;
+    int              irq_num, i;
+    VIRTIOBusDef     vbus_s, *vbus = &vbus_s;
+    PhysMemoryRange *pr;
+    RISCVMachine *   s = (RISCVMachine *)mallocz(sizeof *s);
 
     s->ram_size      = p->ram_size;
     s->ram_base_addr = p->ram_base_addr;
@@ -1081,6 +1310,7 @@ RISCVMachine *virt_machine_init(const VirtMachineParams *p) {
     s->mem_map->flush_tlb_write_range = riscv_flush_tlb_write_range;
     s->common.maxinsns                = p->maxinsns;
     s->common.snapshot_load_name      = p->snapshot_load_name;
+    s->io_lock                        = new std::mutex;
 
     /* loggers are changed using install_new_loggers() in dromajo_cosim */
     s->common.debug_log = &dromajo_default_debug_log;
@@ -1106,18 +1336,46 @@ RISCVMachine *virt_machine_init(const VirtMachineParams *p) {
     /* clear mimpid, marchid, mvendorid */
     s->clear_ids = p->clear_ids;
 
-    if (MAX_CPUS < s->ncpus) {
-        vm_error("ERROR: ncpus:%d exceeds maximum MAX_CPU\n", s->ncpus);
+    s->tlb_size    = p->tlb_size;
+    s->l2_tlb_size = p->l2_tlb_size;
+    if (s->tlb_size == 0 || (s->tlb_size & (s->tlb_size - 1)) != 0) {
+        vm_error("ERROR: tlb_size:%u must be a power of 2\n", s->tlb_size);
+        return NULL;
+    }
+    if (s->l2_tlb_size != 0 && (s->l2_tlb_size < L2_TLB_WAYS || (s->l2_tlb_size & (s->l2_tlb_size - 1)) != 0)) {
+        vm_error("ERROR: l2_tlb_size:%u must be 0 or a power of 2 of at least %d\n", s->l2_tlb_size, L2_TLB_WAYS);
+        return NULL;
+    }
+    s->asid_bits = p->asid_bits;
+    if (s->asid_bits > ASID_BITS_MAX) {
+        vm_error("ERROR: asid_bits:%u must be at most %d\n", s->asid_bits, ASID_BITS_MAX);
         return NULL;
     }
 
+    if (s->ncpus < 1 || MAX_CPUS < s->ncpus) {
+        vm_error("ERROR: ncpus:%d must be between 1 and MAX_CPUS:%d\n", s->ncpus, MAX_CPUS);
+        return NULL;
+    }
+
+    s->rom_size      = s->ncpus * ROM_SIZE;
+    s->cpu_state     = (RISCVCPUState **)mallocz(s->ncpus * sizeof *s->cpu_state);
+    s->reserved_line = (uint64_t *)mallocz(s->ncpus * sizeof *s->reserved_line);
+    for (int irq = 0; irq < 32; ++irq)
+        s->plic_irq_harts[irq] = (uint64_t *)mallocz(PLIC_HART_WORDS(s->ncpus) * sizeof(uint64_t));
+
+    s->timer_event       = (RISCVEvent *)mallocz(s->ncpus * sizeof *s->timer_event);
+    s->timebase.deadline = UINT64_MAX;
+
     for (int i = 0; i < s->ncpus; ++i) {
-        s->cpu_state[i] = riscv_cpu_init(s, i);
+        s->cpu_state[i]     = riscv_cpu_init(s, i);
+        s->reserved_line[i] = -1;
+        riscv_event_init(&s->timer_event[i], timer_fire, s->cpu_state[i]);
+        timer_schedule(s, i);
     }
 
     /* RAM */
-    cpu_register_ram(s->mem_map, s->ram_base_addr, s->ram_size, 0);
-    cpu_register_ram(s->mem_map, ROM_BASE_ADDR, ROM_SIZE, 0);
+    cpu_register_ram(s->mem_map, s->ram_base_addr, s->ram_size, DEVRAM_FLAG_DIRTY_BITS);  // incremental checkpoints
+    cpu_register_ram(s->mem_map, ROM_BASE_ADDR, s->rom_size, 0);
 
     for (int i = 0; i < s->ncpus; ++i) {
         s->cpu_state[i]->physical_addr_len = p->physical_addr_len;
@@ -1126,30 +1384,34 @@ RISCVMachine *virt_machine_init(const VirtMachineParams *p) {
     SiFiveUARTState *uart = (SiFiveUARTState *)calloc(sizeof *uart, 1);
     uart->irq             = UART0_IRQ;
     uart->cs              = p->console;
-    cpu_register_device(s->mem_map, UART0_BASE_ADDR, UART0_SIZE, uart, uart_read, uart_write, DEVIO_SIZE32);
+    pr = cpu_register_device(s->mem_map, UART0_BASE_ADDR, UART0_SIZE, uart, uart_read, uart_write, DEVIO_SIZE32);
+    phys_mem_set_state_funcs(pr, uart_save, uart_load);
 
     DW_apb_uart_state *dw_apb_uart = (DW_apb_uart_state *)calloc(sizeof *dw_apb_uart, 1);
     dw_apb_uart->irq               = &s->plic_irq[DW_APB_UART0_IRQ];
     dw_apb_uart->cs                = p->console;
-    cpu_register_device(s->mem_map,
-                        DW_APB_UART0_BASE_ADDR,
-                        DW_APB_UART0_SIZE,
-                        dw_apb_uart,
-                        dw_apb_uart_read,
-                        dw_apb_uart_write,
-                        DEVIO_SIZE32 | DEVIO_SIZE16 | DEVIO_SIZE8);
+    pr = cpu_register_device(s->mem_map,
+                             DW_APB_UART0_BASE_ADDR,
+                             DW_APB_UART0_SIZE,
+                             dw_apb_uart,
+                             dw_apb_uart_read,
+                             dw_apb_uart_write,
+                             DEVIO_SIZE32 | DEVIO_SIZE16 | DEVIO_SIZE8);
+    phys_mem_set_state_funcs(pr, dw_apb_uart_save, dw_apb_uart_load);
 
     DW_apb_uart_state *dw_apb_uart1 = (DW_apb_uart_state *)calloc(sizeof *dw_apb_uart, 1);
     dw_apb_uart1->irq               = &s->plic_irq[DW_APB_UART1_IRQ];
     dw_apb_uart1->cs                = p->console;
-    cpu_register_device(s->mem_map,
-                        DW_APB_UART1_BASE_ADDR,
-                        DW_APB_UART1_SIZE,
-                        dw_apb_uart,
-                        dw_apb_uart_read,
-                        dw_apb_uart_write,
-                        DEVIO_SIZE32 | DEVIO_SIZE16 | DEVIO_SIZE8);
-
+    pr = cpu_register_device(s->mem_map,
+                             DW_APB_UART1_BASE_ADDR,
+                             DW_APB_UART1_SIZE,
+                             dw_apb_uart1,
+                             dw_apb_uart_read,
+                             dw_apb_uart_write,
+                             DEVIO_SIZE32 | DEVIO_SIZE16 | DEVIO_SIZE8);
+    phys_mem_set_state_funcs(pr, dw_apb_uart_save, dw_apb_uart_load);
+
+    /* msip and mtimecmp are saved with the harts */
     cpu_register_device(s->mem_map,
                         p->clint_base_addr,
                         p->clint_size,
@@ -1157,13 +1419,15 @@ RISCVMachine *virt_machine_init(const VirtMachineParams *p) {
                         clint_read,
                         clint_write,
                         DEVIO_SIZE32 | DEVIO_SIZE16 | DEVIO_SIZE8);
-    cpu_register_device(s->mem_map, p->plic_base_addr, p->plic_size, s, plic_read, plic_write, DEVIO_SIZE32);
+    pr = cpu_register_device(s->mem_map, p->plic_base_addr, p->plic_size, s, plic_read, plic_write, DEVIO_SIZE32);
+    phys_mem_set_state_funcs(pr, plic_save, plic_load);
 
     for (int j = 1; j < 32; j++) {
         irq_init(&s->plic_irq[j], plic_set_irq, s, j);
     }
 
-    s->htif_tohost_addr = p->htif_base_addr;
+    s->htif_tohost_addr    = p->htif_base_addr;
+    s->htif_tohost_written = true; /* as loaded */
 
     s->common.console = p->console;
 
@@ -1266,7 +1530,7 @@ RISCVMachine *virt_machine_init(const VirtMachineParams *p) {
         }
 
         uint8_t *ram_ptr = get_ram_ptr(s, ROM_BASE_ADDR);
-        for (int i = 0; i < ROM_SIZE / 4; ++i) {
+        for (int i = 0; i < (int)s->rom_size / 4; ++i) {
             uint32_t *q_base = (uint32_t *)(ram_ptr + (BOOT_BASE_ADDR - ROM_BASE_ADDR));
             fprintf(fd, "@%06x %08x\n", i, q_base[i]);
         }
@@ -1281,56 +1545,137 @@ RISCVMachine *virt_machine_init(const VirtMachineParams *p) {
 void virt_machine_end(RISCVMachine *s) {
     if (s->common.snapshot_save_name)
         virt_machine_serialize(s, s->common.snapshot_save_name);
+    riscv_cpu_serialize_wait(s);
 
     /* XXX: stop all */
     for (int i = 0; i < s->ncpus; ++i) {
         riscv_cpu_end(s->cpu_state[i]);
     }
 
+    if (s->common.sched_record)
+        fclose(s->common.sched_record);
+    if (s->common.sched_replay)
+        fclose(s->common.sched_replay);
+    free(s->common.hart_quantum);
+    free(s->common.snapshot_last_name);
+
     phys_mem_map_end(s->mem_map);
+    delete s->io_lock;
+    for (int irq = 0; irq < 32; ++irq) free(s->plic_irq_harts[irq]);
+    free(s->events.heap);
+    free(s->timer_event);
+    free(s->reserved_line);
+    free(s->cpu_state);
     free(s);
 }
 
+/* A checkpoint restores every hart through the recovery code in its
+ * window of the boot ROM, so it must be loaded with the same ncpus */
 void virt_machine_serialize(RISCVMachine *m, const char *dump_name) {
-    RISCVCPUState *s = m->cpu_state[0];  // FIXME: MULTICORE
+    vm_error("plic: %x %x\n", m->plic_pending_irq, m->plic_served_irq);
 
-    vm_error("plic: %x %x timecmp=%llx\n", m->plic_pending_irq, m->plic_served_irq, (unsigned long long)s->timecmp);
+    riscv_cpu_serialize_wait(m);  // it may be the parent of this one
+    riscv_cpu_serialize(m, dump_name, FALSE);
 
-    assert(m->ncpus == 1);  // FIXME: riscv_cpu_serialize must be patched for multicore
-    riscv_cpu_serialize(s, dump_name, m->clint_base_addr);
+    free(m->common.snapshot_last_name);
+    m->common.snapshot_last_name = strdup(dump_name);
 }
 
+/* Called between quanta, while no hart runs, to take the periodic
+ * snapshots.  The simulation only stalls for the registers and the boot
+ * ROM, the main RAM is saved in the background, and a snapshot waits for
+ * the previous one to be on disk.  Harts still in the ROM, right after a
+ * restore, delay it. */
+void virt_machine_checkpoint(RISCVMachine *m) {
+    if (m->checkpoint_job && checkpoint_job_done(m->checkpoint_job))
+        riscv_cpu_serialize_wait(m);
+
+    if (!m->common.checkpoint_every || m->common.maxinsns > m->common.checkpoint_next || !riscv_cpu_can_serialize(m))
+        return;
+
+    uint64_t    n_insns = m->common.checkpoint_start - m->common.maxinsns;
+    const char *prefix  = m->common.snapshot_save_name ? m->common.snapshot_save_name : "checkpoint";
+    size_t      n       = strlen(prefix) + 32;
+    char *      name    = (char *)alloca(n);
+    snprintf(name, n, "%s.%" PRIu64, prefix, n_insns);
+
+    riscv_cpu_serialize_wait(m);
+    riscv_cpu_serialize(m, name, TRUE);
+
+    free(m->common.snapshot_last_name);
+    m->common.snapshot_last_name = strdup(name);
+
+    if (m->common.maxinsns > m->common.checkpoint_every)
+        m->common.checkpoint_next = m->common.maxinsns - m->common.checkpoint_every;
+    else
+        m->common.checkpoint_every = 0;  // the run is over first
+}
+
+/* A loaded checkpoint can be the parent of an incremental one */
 void virt_machine_deserialize(RISCVMachine *m, const char *dump_name) {
-    RISCVCPUState *s = m->cpu_state[0];  // FIXME: MULTICORE
+    riscv_cpu_deserialize(m, dump_name);
 
-    assert(m->ncpus == 1);  // FIXME: riscv_cpu_serialize must be patched for multicore
-    riscv_cpu_deserialize(s, dump_name);
+    free(m->common.snapshot_last_name);
+    m->common.snapshot_last_name = strdup(dump_name);
 }
 
 int virt_machine_get_sleep_duration(RISCVMachine *m, int hartid, int ms_delay) {
     RISCVCPUState *s = m->cpu_state[hartid];
-    int64_t        ms_delay1;
-
-    /* wait for an event: the only asynchronous event is the RTC timer */
-    if (!(riscv_cpu_get_mip(s) & MIP_MTIP) && rtc_get_time(m) > 0) {
-        ms_delay1 = s->timecmp - rtc_get_time(m);
-        if (ms_delay1 <= 0) {
-            riscv_cpu_set_mip(s, MIP_MTIP);
-            ms_delay = 0;
-        } else {
-            /* convert delay to ms */
-            ms_delay1 = ms_delay1 / (RTC_FREQ / 1000);
-            if (ms_delay1 < ms_delay)
-                ms_delay = ms_delay1;
-        }
-    }
+    uint64_t       cycles;
+
+    if (m->common.parallel && hartid == 0)
+        riscv_timebase_publish(m);
+
+    /* the single point where the harts observe the events */
+    cycles = m->common.parallel ? __atomic_load_n(&m->timebase.cycles, __ATOMIC_RELAXED) : m->cpu_state[0]->mcycle;
+    if (cycles >= __atomic_load_n(&m->timebase.deadline, __ATOMIC_RELAXED))
+        events_run(m, cycles);
 
     if (!riscv_cpu_get_power_down(s))
-        ms_delay = 0;
+        return 0;
+
+    uint64_t mtime = rtc_get_time(m);
+    if (!(riscv_cpu_get_mip(s) & MIP_MTIP) && mtime > 0) {
+        /* convert delay to ms */
+        int64_t ms_delay1 = (int64_t)(s->timecmp - mtime) / (RTC_FREQ / 1000);
+        if (ms_delay1 < ms_delay)
+            ms_delay = ms_delay1;
+    }
 
     return ms_delay;
 }
 
+/* Number of instructions hartid can run before the first event in the
+ * queue is due and has to be run by virt_machine_get_sleep_duration().
+ * Events are due at a hart 0 mcycle, so only hart 0 can move them
+ * closer. */
+uint64_t virt_machine_get_event_budget(RISCVMachine *m, int hartid) {
+    if (hartid != 0)
+        return UINT64_MAX;
+
+    uint64_t mcycle   = m->cpu_state[0]->mcycle;
+    uint64_t deadline = __atomic_load_n(&m->timebase.deadline, __ATOMIC_RELAXED);
+    return deadline > mcycle ? deadline - mcycle : 1;
+}
+
+/* When every hart is stalled in WFI nothing can happen before the first
+ * event in the queue: move all the harts' mcycle, hence mtime, right up
+ * to it.  At most max_cycles are skipped, all of them if no event is
+ * scheduled.  Returns the number of cycles skipped. */
+uint64_t virt_machine_idle_skip(RISCVMachine *m, uint64_t max_cycles) {
+    for (int i = 0; i < m->ncpus; ++i)
+        if (!riscv_cpu_stalled(m->cpu_state[i]))
+            return 0;
+
+    uint64_t n_cycles = std::min(virt_machine_get_event_budget(m, 0), max_cycles);
+    if (n_cycles <= 1)
+        return 0;
+
+    for (int i = 0; i < m->ncpus; ++i) riscv_cpu_idle(m->cpu_state[i], n_cycles);
+
+    return n_cycles;
+}
+
 uint64_t virt_machine_get_pc(RISCVMachine *s, int hartid) { return riscv_get_pc(s->cpu_state[hartid]); }
 
 uint64_t virt_machine_get_reg(RISCVMachine *s, int hartid, int rn) { return riscv_get_reg(s->cpu_state[hartid], rn); }
@@ -42,11 +42,13 @@
 #include <assert.h>
 #include <inttypes.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "cutils.h"
+#include "dromajo.h"
 #include "list.h"
 
 #define DEBUG_VIRTIO
@@ -138,7 +140,7 @@ typedef struct {
 typedef int VIRTIODeviceRecvFunc(VIRTIODevice *s1, int queue_idx, int desc_idx, int read_size, int write_size);
 
 /* return NULL if no RAM at this address. The mapping is valid for one page */
-typedef uint8_t *VIRTIOGetRAMPtrFunc(VIRTIODevice *s, virtio_phys_addr_t paddr);
+typedef uint8_t *VIRTIOGetRAMPtrFunc(VIRTIODevice *s, virtio_phys_addr_t paddr, BOOL is_rw);
 
 struct VIRTIODevice {
     PhysMemoryMap *  mem_map;
@@ -163,6 +165,9 @@ struct VIRTIODevice {
     VIRTIODeviceRecvFunc *device_recv;
     void (*config_write)(VIRTIODevice *s); /* called after the config
                                               is written */
+    void (*save_state)(VIRTIODevice *s, FILE *f); /* state of the device
+                                                      type, if any */
+    BOOL (*load_state)(VIRTIODevice *s, FILE *f);
     uint32_t config_space_size;            /* in bytes, must be multiple of 4 */
     uint8_t  config_space[MAX_CONFIG_SPACE_SIZE];
 };
@@ -190,16 +195,18 @@ static void virtio_reset(VIRTIODevice *s) {
     }
 }
 
-static uint8_t *virtio_pci_get_ram_ptr(VIRTIODevice *s, virtio_phys_addr_t paddr) {
-    return pci_device_get_dma_ptr(s->pci_dev, paddr);
+static uint8_t *virtio_pci_get_ram_ptr(VIRTIODevice *s, virtio_phys_addr_t paddr, BOOL is_rw) {
+    return pci_device_get_dma_ptr(s->pci_dev, paddr, is_rw);
 }
 
-static uint8_t *virtio_mmio_get_ram_ptr(VIRTIODevice *s, virtio_phys_addr_t paddr) {
+static uint8_t *virtio_mmio_get_ram_ptr(VIRTIODevice *s, virtio_phys_addr_t paddr, BOOL is_rw) {
     PhysMemoryRange *pr;
 
     pr = get_phys_mem_range(s->mem_map, paddr);
     if (!pr || !pr->is_ram)
         return NULL;
+    if (is_rw)
+        phys_mem_set_dirty_bit(pr, paddr - pr->addr);
     return pr->phys_mem + (uintptr_t)(paddr - pr->addr);
 }
 
@@ -222,6 +229,29 @@ static void virtio_add_pci_capability(VIRTIODevice *s, int cfg_type, int bar, ui
     pci_add_capability(s->pci_dev, cap, cap_len);
 }
 
+/* The transport registers from int_status to the queues, the config
+   space, then what the device type keeps. The interrupt line is not
+   raised again, the PLIC saves it as pending. */
+static void virtio_save(void *opaque, FILE *f) {
+    VIRTIODevice *s     = (VIRTIODevice *)opaque;
+    size_t        start = offsetof(VIRTIODevice, int_status);
+
+    device_state_put(f, (uint8_t *)s + start, offsetof(VIRTIODevice, device_id) - start);
+    device_state_put(f, s->config_space, s->config_space_size);
+    if (s->save_state)
+        s->save_state(s, f);
+}
+
+static BOOL virtio_load(void *opaque, FILE *f) {
+    VIRTIODevice *s     = (VIRTIODevice *)opaque;
+    size_t        start = offsetof(VIRTIODevice, int_status);
+
+    if (!device_state_get(f, (uint8_t *)s + start, offsetof(VIRTIODevice, device_id) - start)
+        || !device_state_get(f, s->config_space, s->config_space_size))
+        return FALSE;
+    return !s->load_state || s->load_state(s, f);
+}
+
 static void virtio_pci_bar_set(void *opaque, int bar_num, uint32_t addr, BOOL enabled) {
     VIRTIODevice *s = (VIRTIODevice *)opaque;
     phys_mem_set_addr(s->mem_range, addr, enabled);
@@ -294,6 +324,7 @@ static void virtio_init(VIRTIODevice *s, VIRTIOBusDef *bus, uint32_t device_id,
                                            virtio_mmio_write,
                                            DEVIO_SIZE8 | DEVIO_SIZE16 | DEVIO_SIZE32);
         s->get_ram_ptr = virtio_mmio_get_ram_ptr;
+        phys_mem_set_state_funcs(s->mem_range, virtio_save, virtio_load);
     }
 
     s->device_id         = device_id;
@@ -307,7 +338,7 @@ static uint16_t virtio_read16(VIRTIODevice *s, virtio_phys_addr_t addr) {
     uint8_t *ptr;
     if (addr & 1)
         return 0; /* unaligned access are not supported */
-    ptr = s->get_ram_ptr(s, addr);
+    ptr = s->get_ram_ptr(s, addr, FALSE);
     if (!ptr)
         return 0;
     return *(uint16_t *)ptr;
@@ -317,7 +348,7 @@ static void virtio_write16(VIRTIODevice *s, virtio_phys_addr_t addr, uint16_t va
     uint8_t *ptr;
     if (addr & 1)
         return; /* unaligned access are not supported */
-    ptr = s->get_ram_ptr(s, addr);
+    ptr = s->get_ram_ptr(s, addr, TRUE);
     if (!ptr)
         return;
     *(uint16_t *)ptr = val;
@@ -327,7 +358,7 @@ static void virtio_write32(VIRTIODevice *s, virtio_phys_addr_t addr, uint32_t va
     uint8_t *ptr;
     if (addr & 3)
         return; /* unaligned access are not supported */
-    ptr = s->get_ram_ptr(s, addr);
+    ptr = s->get_ram_ptr(s, addr, TRUE);
     if (!ptr)
         return;
     *(uint32_t *)ptr = val;
@@ -339,7 +370,7 @@ static int virtio_memcpy_from_ram(VIRTIODevice *s, uint8_t *buf, virtio_phys_add
 
     while (count > 0) {
         l   = min_int(count, VIRTIO_PAGE_SIZE - (addr & (VIRTIO_PAGE_SIZE - 1)));
-        ptr = s->get_ram_ptr(s, addr);
+        ptr = s->get_ram_ptr(s, addr, FALSE);
         if (!ptr)
             return -1;
         memcpy(buf, ptr, l);
@@ -356,7 +387,7 @@ static int virtio_memcpy_to_ram(VIRTIODevice *s, virtio_phys_addr_t addr, const
 
     while (count > 0) {
         l   = min_int(count, VIRTIO_PAGE_SIZE - (addr & (VIRTIO_PAGE_SIZE - 1)));
-        ptr = s->get_ram_ptr(s, addr);
+        ptr = s->get_ram_ptr(s, addr, TRUE);
         if (!ptr)
             return -1;
         memcpy(ptr, buf, l);
@@ -933,12 +964,43 @@ static int virtio_block_recv_request(VIRTIODevice *s, int queue_idx, int desc_id
     return 0;
 }
 
+/* The sectors in a snapshot overlay, the backing file has the rest */
+static void virtio_block_save(VIRTIODevice *s, FILE *f) {
+    VIRTIOBlockDevice *s1      = (VIRTIOBlockDevice *)s;
+    BlockDevice *      bs      = s1->bs;
+    uint8_t            overlay = bs->save_state != NULL;
+
+    if (s1->req_in_progress)
+        fprintf(dromajo_stderr, "WARNING: the block request in progress is not saved\n");
+    device_state_put(f, &overlay, sizeof overlay);
+    if (overlay)
+        bs->save_state(bs, f);
+}
+
+static BOOL virtio_block_load(VIRTIODevice *s, FILE *f) {
+    VIRTIOBlockDevice *s1 = (VIRTIOBlockDevice *)s;
+    BlockDevice *      bs = s1->bs;
+    uint8_t            overlay;
+
+    if (!device_state_get(f, &overlay, sizeof overlay))
+        return FALSE;
+    if (!overlay)
+        return TRUE;
+    if (!bs->load_state) {
+        fprintf(dromajo_stderr, "ERROR: the disk was saved in snapshot mode\n");
+        return FALSE;
+    }
+    return bs->load_state(bs, f);
+}
+
 VIRTIODevice *virtio_block_init(VIRTIOBusDef *bus, BlockDevice *bs) {
     uint64_t nb_sectors;
 
     VIRTIOBlockDevice *s = (VIRTIOBlockDevice *)mallocz(sizeof(*s));
     virtio_init(&s->common, bus, 2, 8, virtio_block_recv_request);
-    s->bs = bs;
+    s->bs                = bs;
+    s->common.save_state = virtio_block_save;
+    s->common.load_state = virtio_block_load;
 
     nb_sectors = bs->get_sector_count(bs);
     put_le32(s->common.config_space, nb_sectors);
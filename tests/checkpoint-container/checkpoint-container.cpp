@@ -0,0 +1,225 @@
+/*
+ * Round trips through the checkpoint container (src/checkpoint.cpp):
+ * zero, compressible and incompressible pages, a partial last page,
+ * deltas loaded through a chain, and rejection of a corrupted index.
+ *
+ * Copyright (C) 2018,2019, Esperanto Technologies Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License")
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <err.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "checkpoint.h"
+#include "cutils.h"
+
+#define N_FULL_PAGES 37
+#define MEM_SIZE     (N_FULL_PAGES * CKPT_PAGE_SIZE + 1000)  // the last page is partial
+#define N_PAGES      (N_FULL_PAGES + 1)
+
+static int n_failed = 0;
+
+static void check(bool ok, const char *what) {
+    printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+    if (!ok)
+        ++n_failed;
+}
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint8_t rng_byte() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state >> 24;
+}
+
+/* Memory allocated like the RAM is, so that loads can map pages */
+static uint8_t *alloc_mem() {
+    void *p = mmap(NULL, MEM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        err(1, "mmap");
+    return (uint8_t *)p;
+}
+
+static void fill_page(uint8_t *mem, int page, int kind) {
+    uint8_t *p   = mem + page * CKPT_PAGE_SIZE;
+    size_t   len = page == N_FULL_PAGES ? MEM_SIZE - N_FULL_PAGES * CKPT_PAGE_SIZE : CKPT_PAGE_SIZE;
+
+    switch (kind) {
+    case 0: memset(p, 0, len); break;
+    case 1:
+        for (size_t i = 0; i < len; ++i) p[i] = rng_byte();
+        break;
+    default:
+        for (size_t i = 0; i < len; ++i) p[i] = "checkpoint "[i % 11] + page;
+        break;
+    }
+}
+
+/* Fills each page with zeros, random bytes or text, by page number */
+static void fill_mem(uint8_t *mem) {
+    for (int page = 0; page < N_PAGES; ++page) fill_page(mem, page, page % 3);
+}
+
+static bool load_matches(const uint8_t *ref, const char *file, bool chain) {
+    uint8_t *mem = alloc_mem();
+    memset(mem, 0xa5, MEM_SIZE);  // the zero pages must get cleared
+    if (chain)
+        checkpoint_load_chain(mem, MEM_SIZE, file);
+    else
+        checkpoint_load_memory(mem, MEM_SIZE, file);
+    bool ok = memcmp(ref, mem, MEM_SIZE) == 0;
+    munmap(mem, MEM_SIZE);
+    return ok;
+}
+
+/* The loader exits on a bad image, so it runs in a child */
+static bool load_fails(const char *file, bool chain) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0)
+        err(1, "fork");
+    if (pid == 0) {
+        freopen("/dev/null", "w", stderr);
+        uint8_t *mem = alloc_mem();
+        if (chain)
+            checkpoint_load_chain(mem, MEM_SIZE, file);
+        else
+            checkpoint_load_memory(mem, MEM_SIZE, file);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+static std::vector<uint8_t> read_file(const std::string &file) {
+    std::vector<uint8_t> data;
+    FILE *               f = fopen(file.c_str(), "rb");
+    if (!f)
+        err(1, "%s", file.c_str());
+    int c;
+    while ((c = fgetc(f)) != EOF) data.push_back(c);
+    fclose(f);
+    return data;
+}
+
+static void write_file(const std::string &file, const std::vector<uint8_t> &data) {
+    FILE *f = fopen(file.c_str(), "wb");
+    if (!f || fwrite(data.data(), 1, data.size(), f) != data.size() || fclose(f))
+        err(1, "%s", file.c_str());
+}
+
+int main() {
+    char dir_template[] = "/tmp/checkpoint-container.XXXXXX";
+    if (!mkdtemp(dir_template))
+        err(1, "mkdtemp");
+    std::string dir    = dir_template;
+    std::string raw    = dir + "/raw.mainram";
+    std::string lz     = dir + "/lz.mainram";
+    std::string delta  = dir + "/delta.mainram";
+    std::string chain  = dir + "/delta.chain";
+    std::string parent = dir + "/lz.chain";
+    std::string bad    = dir + "/bad.mainram";
+
+    uint8_t *mem = alloc_mem();
+    fill_mem(mem);
+
+    checkpoint_save_memory(mem, MEM_SIZE, raw.c_str(), NULL, false);
+    check(load_matches(mem, raw.c_str(), false), "uncompressed image");
+
+    checkpoint_save_memory(mem, MEM_SIZE, lz.c_str(), NULL, true);
+    check(load_matches(mem, lz.c_str(), false), "compressed image");
+
+    std::vector<uint8_t> image = read_file(lz);
+    CheckpointHeader     hdr;
+    memcpy(&hdr, image.data(), sizeof hdr);
+    check(get_le32((const uint8_t *)&hdr.version) == CKPT_VERSION
+              && get_le64((const uint8_t *)&hdr.mem_size) == MEM_SIZE
+              // the zero pages are not stored
+              && get_le64((const uint8_t *)&hdr.n_pages) == N_PAGES - (N_PAGES + 2) / 3,
+          "little endian header");
+
+    // Only the text pages compress, the random ones are kept raw
+    bool     lz_ok        = true;
+    uint64_t index_offset = get_le64((const uint8_t *)&hdr.index_offset);
+    for (uint64_t i = 0; i < get_le64((const uint8_t *)&hdr.n_pages); ++i) {
+        const uint8_t *entry = &image[index_offset + i * sizeof(CheckpointPage)];
+        uint64_t       page  = get_le64(entry + offsetof(CheckpointPage, page));
+        uint32_t       size  = get_le32(entry + offsetof(CheckpointPage, size));
+        uint32_t       flags = get_le32(entry + offsetof(CheckpointPage, flags));
+        if (page % 3 == 2)
+            lz_ok &= flags == CKPT_PAGE_LZ && size < CKPT_PAGE_SIZE / 4;
+        else
+            lz_ok &= flags == 0;
+    }
+    check(lz_ok, "text pages compressed, random pages raw");
+
+    /* A delta with a page that became zero, one that got random, one
+     * partial, and one that was dirtied but kept its content */
+    uint32_t dirty[(N_PAGES + 31) / 32] = {0};
+    int      dirtied[]                  = {1, 3, 5, 9, N_FULL_PAGES};
+    for (int page : dirtied) dirty[page / 32] |= 1u << (page % 32);
+    fill_page(mem, 1, 0);
+    fill_page(mem, 3, 1);
+    fill_page(mem, 5, 2);
+    fill_page(mem, N_FULL_PAGES, 1);
+
+    checkpoint_save_chain(parent.c_str(), NULL, lz.c_str());
+    check(checkpoint_chain_can_extend(parent.c_str(), delta.c_str()), "chain can be extended");
+    checkpoint_save_memory(mem, MEM_SIZE, delta.c_str(), dirty, true);
+    checkpoint_save_chain(chain.c_str(), parent.c_str(), delta.c_str());
+    check(load_matches(mem, chain.c_str(), true), "delta loaded through its chain");
+    check(load_fails(delta.c_str(), false), "delta loaded alone is rejected");
+
+    check(!load_fails(raw.c_str(), false), "intact image loads in a child");
+
+    /* Two entries of the index swapped, so that it is no longer sorted */
+    image = read_file(raw);
+    memcpy(&hdr, image.data(), sizeof hdr);
+    index_offset = get_le64((const uint8_t *)&hdr.index_offset);
+    CheckpointPage entries[2];
+    memcpy(entries, &image[index_offset], sizeof entries);
+    memcpy(&image[index_offset], &entries[1], sizeof entries[1]);
+    memcpy(&image[index_offset + sizeof entries[1]], &entries[0], sizeof entries[0]);
+    write_file(bad, image);
+    check(load_fails(bad.c_str(), false), "unsorted index is rejected");
+
+    /* A payload past the index */
+    image = read_file(raw);
+    put_le64(&image[index_offset + offsetof(CheckpointPage, offset)], index_offset);
+    write_file(bad, image);
+    check(load_fails(bad.c_str(), false), "payload out of the file is rejected");
+
+    /* A page past the end of the memory */
+    image = read_file(raw);
+    put_le64(&image[index_offset + offsetof(CheckpointPage, page)], N_PAGES + 1);
+    write_file(bad, image);
+    check(load_fails(bad.c_str(), false), "page out of the memory is rejected");
+
+    for (const std::string &file : {raw, lz, delta, chain, parent, bad}) unlink(file.c_str());
+    rmdir(dir.c_str());
+
+    printf("%s\n", n_failed ? "FAILED" : "ALL PASSED");
+    return n_failed != 0;
+}